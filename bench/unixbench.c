@@ -0,0 +1,697 @@
+/*
+ * unixtool benchmark driver
+ *
+ * Builds a synthetic TI/LMI SYSV (68K) band image with the on-disk layout
+ * unixtool expects, then times unixtool against it:
+ *
+ *   ls       ls -R of the whole tree
+ *   lookup   batch of path lookups + reads of every small file
+ *   read     one large file going through triple indirection
+ *   extract  extraction of the small-file tree
+ *
+ * For each it reports wall time, MB/s, ops/s, and the read/write system
+ * calls the child made (from /proc/<pid>/io, where available).
+ *
+ * Usage: unixbench UNIXTOOL WORKDIR [SMALL_FILES [LARGE_MIB]]
+ */
+
+#define _GNU_SOURCE /* waitid() WNOWAIT, wait4() */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BLOCK 1024          /* Filesystem block size */
+#define ILIST 0x7C0         /* Byte offset of inode 0 */
+#define DIR_FILES 256       /* Small files per directory */
+#define DEEP_LEVELS 12      /* Depth of the /deep chain */
+#define SB_MAGIC 0xFD187E20 /* Superblock magic as stored (big-endian) */
+#define FS_TYPE 2           /* 1 KiB blocks */
+
+#define TYPE_DIR 0x4  /* Inode type bits */
+#define TYPE_FILE 0x8
+
+/* IMAGE UNDER CONSTRUCTION */
+typedef struct rImage
+{
+  uint8_t *data;    /* Whole image */
+  uint32_t nblocks; /* Blocks in the image */
+  uint32_t isize;   /* First data block */
+  uint32_t next;    /* Next free data block */
+  int ninodes;      /* Inodes the i-list has room for */
+  int next_ino;     /* Next free inode */
+} Image;
+
+/* ONE DIRECTORY BEING FILLED */
+typedef struct rDir
+{
+  int inode;         /* Its inode number */
+  int count;         /* Entries so far */
+  int alloc;         /* Entries allocated */
+  uint8_t *entries;  /* Raw 16-byte dirents */
+} Dir;
+
+uint64_t large_hash = 0;   /* FNV-1a of the large file */
+uint64_t small_bytes = 0;  /* Bytes in all small files */
+
+/* STORE BIG-ENDIAN WORDS */
+void
+put_word(uint8_t *p, uint32_t v)
+{
+  p[0] = v >> 24;
+  p[1] = v >> 16;
+  p[2] = v >> 8;
+  p[3] = v;
+}
+
+void
+put_hword(uint8_t *p, uint16_t v)
+{
+  p[0] = v >> 8;
+  p[1] = v;
+}
+
+/* ALLOCATE ONE DATA BLOCK */
+uint32_t
+block_alloc(Image *img)
+{
+  if (img->next >= img->nblocks)
+    {
+      printf("unixbench: image full\n");
+      exit(-1);
+    }
+
+  return img->next++;
+}
+
+/* CHAIN THE UNUSED BLOCKS INTO A FREE LIST */
+/*
+ * The superblock holds the first list (nfree, then 50 addresses); entry
+ * 0 of each list names the free block holding the next, 0 ends it.
+ */
+void
+free_list_build(Image *img)
+{
+  uint8_t *list = img->data + BLOCK + 6;
+  uint32_t adr = img->next;
+
+  for (;;)
+    {
+      int n = 1;
+      while (n < 50 && adr < img->nblocks)
+        {
+          put_word(list + 2 + 4 * n++, adr++);
+        }
+
+      put_hword(list, n);
+      if (adr == img->nblocks)
+        {
+          put_word(list + 2, 0);
+          return;
+        }
+
+      put_word(list + 2, adr);
+      list = img->data + (size_t)adr++ * BLOCK;
+    }
+}
+
+/* DETERMINISTIC FILE CONTENTS */
+uint32_t
+fill_block(uint8_t *p, size_t len, uint32_t seed)
+{
+  size_t x;
+  for (x = 0; x < len; x++)
+    {
+      seed ^= seed << 13;
+      seed ^= seed >> 17;
+      seed ^= seed << 5;
+      p[x] = seed;
+    }
+
+  return seed;
+}
+
+/* BUILD AN INDIRECT BLOCK OVER n DATA BLOCKS */
+/* level 0 entries are data blocks; level 1 and 2 point at lower levels */
+uint32_t
+indirect_build(Image *img, const uint32_t *blocks, uint32_t n, int level)
+{
+  uint32_t adr = block_alloc(img);
+  uint32_t span = 1;
+  uint32_t e;
+  int x;
+
+  for (x = 0; x < level; x++)
+    {
+      span *= 256;
+    }
+
+  for (e = 0; e < 256 && e * span < n; e++)
+    {
+      uint32_t left = n - e * span;
+      uint32_t v = blocks[e * span];
+      if (level > 0)
+        {
+          v = indirect_build(img, blocks + e * span, left < span ? left : span,
+                             level - 1);
+        }
+
+      put_word(img->data + (size_t)adr * BLOCK + e * 4, v);
+    }
+
+  return adr;
+}
+
+/* WRITE AN INODE WHOSE DATA IS IN blocks[] */
+void
+inode_write(Image *img, int ino, int type, int mode, int nlink, uint32_t size,
+            const uint32_t *blocks, uint32_t n, uint32_t mtime)
+{
+  uint8_t *p = img->data + ILIST + (size_t)ino * 0x40;
+  uint32_t addr[13];
+  uint32_t span[3] = { 256, 65536, 16777216 };
+  uint32_t done;
+  int x;
+
+  memset(addr, 0, sizeof ( addr ));
+  for (x = 0; x < 10 && (uint32_t)x < n; x++)
+    {
+      addr[x] = blocks[x];
+    }
+
+  done = x;
+  for (x = 0; x < 3 && done < n; x++)
+    {
+      uint32_t count = n - done < span[x] ? n - done : span[x];
+      addr[10 + x] = indirect_build(img, blocks + done, count, x);
+      done += count;
+    }
+
+  put_hword(p, ( type << 12 ) | mode);
+  put_hword(p + 2, nlink);
+  put_hword(p + 4, 100);
+  put_hword(p + 6, 10);
+  put_word(p + 8, size);
+  for (x = 0; x < 13; x++)
+    {
+      p[12 + x * 3] = addr[x] >> 16;
+      p[13 + x * 3] = addr[x] >> 8;
+      p[14 + x * 3] = addr[x];
+    }
+
+  put_word(p + 52, mtime);
+  put_word(p + 56, mtime);
+  put_word(p + 60, mtime);
+}
+
+/* NEXT FREE INODE */
+int
+inode_alloc(Image *img)
+{
+  if (img->next_ino > img->ninodes)
+    {
+      printf("unixbench: out of inodes\n");
+      exit(-1);
+    }
+
+  return img->next_ino++;
+}
+
+/* ADD A REGULAR FILE OF size BYTES, RETURNING ITS INODE */
+int
+file_add(Image *img, uint32_t size, uint32_t seed, uint64_t *hash)
+{
+  uint32_t n = ( size + BLOCK - 1 ) / BLOCK;
+  uint32_t *blocks = calloc(n ? n : 1, sizeof ( uint32_t ));
+  int ino = inode_alloc(img);
+  uint32_t x;
+
+  if (blocks == NULL)
+    {
+      perror("unixbench: calloc()");
+      exit(-1);
+    }
+
+  for (x = 0; x < n; x++)
+    {
+      uint32_t len = size - x * BLOCK < BLOCK ? size - x * BLOCK : BLOCK;
+      uint8_t *p;
+      blocks[x] = block_alloc(img);
+      p = img->data + (size_t)blocks[x] * BLOCK;
+      seed = fill_block(p, len, seed | 1);
+      if (hash != NULL)
+        {
+          uint32_t y;
+          for (y = 0; y < len; y++)
+            {
+              *hash = ( *hash ^ p[y] ) * 0x100000001B3ULL;
+            }
+        }
+    }
+
+  inode_write(img, ino, TYPE_FILE, 0644, 1, size, blocks, n,
+              600000000 + ino * 3600);
+  free(blocks);
+  return ino;
+}
+
+/* APPEND A DIRECTORY ENTRY */
+void
+dir_add(Dir *dir, int ino, const char *name)
+{
+  uint8_t *p;
+  if (dir->count == dir->alloc)
+    {
+      dir->alloc = dir->alloc ? dir->alloc * 2 : 64;
+      dir->entries = realloc(dir->entries, (size_t)dir->alloc * 16);
+      if (dir->entries == NULL)
+        {
+          perror("unixbench: realloc()");
+          exit(-1);
+        }
+    }
+
+  p = dir->entries + (size_t)dir->count++ * 16;
+  memset(p, 0, 16);
+  put_hword(p, ino);
+  strncpy((char *)p + 2, name, 14);
+}
+
+/* START A DIRECTORY WITH . AND .. */
+void
+dir_begin(Image *img, Dir *dir, int ino, int parent)
+{
+  memset(dir, 0, sizeof ( *dir ));
+  dir->inode = ino ? ino : inode_alloc(img);
+  dir_add(dir, dir->inode, ".");
+  dir_add(dir, parent ? parent : dir->inode, "..");
+}
+
+/* WRITE OUT A FINISHED DIRECTORY */
+void
+dir_end(Image *img, Dir *dir, int nlink)
+{
+  uint32_t size = dir->count * 16;
+  uint32_t n = ( size + BLOCK - 1 ) / BLOCK;
+  uint32_t *blocks = calloc(n, sizeof ( uint32_t ));
+  uint32_t x;
+
+  if (blocks == NULL)
+    {
+      perror("unixbench: calloc()");
+      exit(-1);
+    }
+
+  for (x = 0; x < n; x++)
+    {
+      uint32_t len = size - x * BLOCK < BLOCK ? size - x * BLOCK : BLOCK;
+      blocks[x] = block_alloc(img);
+      memcpy(img->data + (size_t)blocks[x] * BLOCK, dir->entries + x * BLOCK,
+             len);
+    }
+
+  inode_write(img, dir->inode, TYPE_DIR, 0755, nlink, size, blocks, n,
+              590000000);
+  free(blocks);
+  free(dir->entries);
+}
+
+/* BUILD THE BENCHMARK IMAGE */
+/*
+ * /hello                    one tiny file
+ * /big/single               single indirect
+ * /big/double               double indirect
+ * /big/triple               triple indirect, large_mib MiB
+ * /small/dNNN/fNNNNN        small_files files of 1-8 KiB
+ * /deep/level00/.../leaf    DEEP_LEVELS directories down
+ */
+int
+image_build(const char *fname, int small_files, uint32_t large_mib)
+{
+  Image img;
+  Dir root, big, small, sub, deep[DEEP_LEVELS];
+  uint32_t large_size = large_mib * 0x100000 + 99;
+  int ndirs = ( small_files + DIR_FILES - 1 ) / DIR_FILES;
+  int inodes = small_files + ndirs + DEEP_LEVELS + 16;
+  uint32_t data = large_size / BLOCK + (uint32_t)small_files * 8 + 24 * 1024;
+  char name[16];
+  int fd, x, ino;
+
+  memset(&img, 0, sizeof ( img ));
+  img.isize = 2 + ( inodes + 16 ) / 16;
+  img.ninodes = ( img.isize - 2 ) * 16;
+  img.nblocks = img.isize + data + data / 200;
+  img.next = img.isize;
+  img.next_ino = 3;
+  img.data = calloc(img.nblocks, BLOCK);
+  if (img.data == NULL)
+    {
+      perror("unixbench: calloc()");
+      return -1;
+    }
+
+  dir_begin(&img, &root, 2, 0);
+  dir_add(&root, file_add(&img, 13, 1, NULL), "hello");
+
+  dir_begin(&img, &big, 0, root.inode);
+  dir_add(&big, file_add(&img, 200 * BLOCK + 17, 2, NULL), "single");
+  dir_add(&big, file_add(&img, 4 * 0x100000 + 5, 3, NULL), "double");
+  large_hash = 0xCBF29CE484222325ULL;
+  dir_add(&big, file_add(&img, large_size, 4, &large_hash), "triple");
+  dir_end(&img, &big, 2);
+  dir_add(&root, big.inode, "big");
+
+  dir_begin(&img, &small, 0, root.inode);
+  for (x = 0; x < ndirs; x++)
+    {
+      int y;
+      dir_begin(&img, &sub, 0, small.inode);
+      for (y = x * DIR_FILES; y < small_files && y < ( x + 1 ) * DIR_FILES; y++)
+        {
+          uint32_t size = 1024 + ( y * 2654435761U ) % ( 7 * 1024 );
+          small_bytes += size;
+          snprintf(name, sizeof ( name ), "f%05d", y);
+          dir_add(&sub, file_add(&img, size, 100 + y, NULL), name);
+        }
+
+      dir_end(&img, &sub, 2);
+      snprintf(name, sizeof ( name ), "d%03d", x);
+      dir_add(&small, sub.inode, name);
+    }
+
+  dir_end(&img, &small, 2 + ndirs);
+  dir_add(&root, small.inode, "small");
+
+  /* /deep: each level links to the next, the last holds the leaf */
+  for (x = 0; x < DEEP_LEVELS; x++)
+    {
+      dir_begin(&img, &deep[x], 0, x ? deep[x - 1].inode : root.inode);
+    }
+
+  dir_add(&deep[DEEP_LEVELS - 1], file_add(&img, 512, 5, NULL), "leaf");
+  for (x = DEEP_LEVELS - 1; x >= 0; x--)
+    {
+      ino = deep[x].inode;
+      dir_end(&img, &deep[x], x == DEEP_LEVELS - 1 ? 2 : 3);
+      snprintf(name, sizeof ( name ), "level%02d", x);
+      dir_add(x ? &deep[x - 1] : &root, ino, x ? name : "deep");
+    }
+
+  dir_end(&img, &root, 2 + 3); /* big, small, deep */
+
+  /* Superblock */
+  put_hword(img.data + BLOCK, img.isize);
+  put_word(img.data + BLOCK + 2, img.nblocks);
+  free_list_build(&img);
+  put_word(img.data + BLOCK + 0x1AA, img.nblocks - img.next);
+  put_hword(img.data + BLOCK + 0x1AE, img.ninodes - ( img.next_ino - 2 ));
+  memcpy(img.data + BLOCK + 0x1B0, "bench", 5);
+  memcpy(img.data + BLOCK + 0x1B6, "synth", 5);
+  put_word(img.data + BLOCK + 0x3F8, SB_MAGIC);
+  put_word(img.data + BLOCK + 0x3FC, FS_TYPE);
+
+  fd = open(fname, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0 || write(fd, img.data, (size_t)img.nblocks * BLOCK)
+      != (ssize_t)img.nblocks * BLOCK)
+    {
+      perror("unixbench: writing image");
+      return -1;
+    }
+
+  close(fd);
+  free(img.data);
+  return 0;
+}
+
+/* ONE TIMED RUN */
+typedef struct rRun
+{
+  double seconds;     /* Wall clock */
+  double cpu;         /* User + system */
+  long long syscr;    /* read() family calls, -1 if unknown */
+  long long syscw;    /* write() family calls, -1 if unknown */
+  int status;         /* Exit status */
+} Run;
+
+double
+now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* RUN argv, OUTPUT DISCARDED */
+/* The child is left a zombie until its /proc/<pid>/io has been read */
+int
+run(char *argv[], Run *r)
+{
+  struct rusage ru;
+  siginfo_t info;
+  char path[64], line[128];
+  FILE *io;
+  double start = now();
+  pid_t pid = fork();
+  int status;
+
+  if (pid < 0)
+    {
+      perror("unixbench: fork()");
+      return -1;
+    }
+
+  if (pid == 0)
+    {
+      int null = open("/dev/null", O_WRONLY);
+      dup2(null, 1);
+      dup2(null, 2);
+      execv(argv[0], argv);
+      _exit(127);
+    }
+
+  memset(&info, 0, sizeof ( info ));
+  while (waitid(P_PID, pid, &info, WEXITED | WNOWAIT) < 0 && errno == EINTR)
+    {
+      ;
+    }
+
+  r->seconds = now() - start;
+  r->syscr = -1;
+  r->syscw = -1;
+  snprintf(path, sizeof ( path ), "/proc/%d/io", (int)pid);
+  io = fopen(path, "r");
+  while (io != NULL && fgets(line, sizeof ( line ), io) != NULL)
+    {
+      sscanf(line, "syscr: %lld", &r->syscr);
+      sscanf(line, "syscw: %lld", &r->syscw);
+    }
+
+  if (io != NULL)
+    {
+      fclose(io);
+    }
+
+  if (wait4(pid, &status, 0, &ru) < 0)
+    {
+      perror("unixbench: wait4()");
+      return -1;
+    }
+
+  r->cpu = ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6
+           + ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+  r->status = WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+  return 0;
+}
+
+/* BEST OF passes RUNS, PRINTED AS ONE LINE */
+/* reset, if given, is a shell command run untimed before each pass */
+int
+bench(const char *label, char *argv[], int passes, double bytes, double ops,
+      const char *unit, const char *reset)
+{
+  Run best, r;
+  int x;
+
+  memset(&best, 0, sizeof ( best ));
+  for (x = 0; x < passes; x++)
+    {
+      if (( reset != NULL && system(reset) != 0 ) || run(argv, &r) < 0)
+        {
+          return -1;
+        }
+
+      if (r.status != 0)
+        {
+          printf("%-8s  failed (exit status %d)\n", label, r.status);
+          return -1;
+        }
+
+      if (x == 0 || r.seconds < best.seconds)
+        {
+          best = r;
+        }
+    }
+
+  printf("%-8s %8.3f s %8.3f s %9.1f", label, best.seconds, best.cpu,
+         bytes / 0x100000 / best.seconds);
+  printf(" %11.0f %-7s", ops / best.seconds, unit);
+  if (best.syscr >= 0)
+    {
+      printf(" %9lld %9lld\n", best.syscr, best.syscw);
+    }
+  else
+    {
+      printf(" %9s %9s\n", "-", "-");
+    }
+
+  return 0;
+}
+
+/* FNV-1a OF A HOST FILE */
+uint64_t
+file_hash(const char *fname)
+{
+  uint64_t hash = 0xCBF29CE484222325ULL;
+  uint8_t buf[65536];
+  ssize_t len;
+  int fd = open(fname, O_RDONLY);
+
+  if (fd < 0)
+    {
+      return 0;
+    }
+
+  while (( len = read(fd, buf, sizeof ( buf ))) > 0)
+    {
+      ssize_t x;
+      for (x = 0; x < len; x++)
+        {
+          hash = ( hash ^ buf[x] ) * 0x100000001B3ULL;
+        }
+    }
+
+  close(fd);
+  return hash;
+}
+
+int
+main(int argc, char *argv[])
+{
+  char image[4096], manifest[4096], output[4096], command[4200];
+  int small_files = 4096;
+  uint32_t large_mib = 72;
+  int ndirs, x, rv = 0;
+  FILE *fp;
+
+  if (argc < 3)
+    {
+      printf("Usage: unixbench UNIXTOOL WORKDIR [SMALL_FILES [LARGE_MIB]]\n");
+      return 1;
+    }
+
+  if (argc > 3)
+    {
+      small_files = atoi(argv[3]);
+    }
+
+  if (argc > 4)
+    {
+      large_mib = atoi(argv[4]);
+    }
+
+  /* The large file must reach the triple indirect block */
+  if (small_files < 1 || large_mib < 65 || large_mib > 4000)
+    {
+      printf("unixbench: need SMALL_FILES >= 1 and 65 <= LARGE_MIB <= 4000\n");
+      return 1;
+    }
+
+  ndirs = ( small_files + DIR_FILES - 1 ) / DIR_FILES;
+  mkdir(argv[2], 0755);
+  snprintf(image, sizeof ( image ), "%s/bench.img", argv[2]);
+  snprintf(manifest, sizeof ( manifest ), "%s/lookup.txt", argv[2]);
+  snprintf(output, sizeof ( output ), "%s/out", argv[2]);
+
+  printf("Building %s (%d small files, %u MiB large file)\n", image,
+         small_files, large_mib);
+  if (image_build(image, small_files, large_mib) < 0)
+    {
+      return 1;
+    }
+
+  fp = fopen(manifest, "w");
+  if (fp == NULL)
+    {
+      perror("unixbench: manifest");
+      return 1;
+    }
+
+  for (x = 0; x < small_files; x++)
+    {
+      fprintf(fp, "read /small/d%03d/f%05d /dev/null\n", x / DIR_FILES, x);
+    }
+
+  for (x = 0; x < DEEP_LEVELS; x++)
+    {
+      int y;
+      fprintf(fp, "read /deep");
+      for (y = 1; y < DEEP_LEVELS; y++)
+        {
+          fprintf(fp, "/level%02d", y);
+        }
+
+      fprintf(fp, "/leaf /dev/null\n");
+    }
+
+  fclose(fp);
+
+  printf("\n%-8s %10s %10s %9s %19s %9s %9s\n", "test", "wall", "cpu",
+         "MB/s", "rate", "syscr", "syscw");
+  {
+    char *ls[] = { argv[1], "-R", "ls", image, "/", NULL };
+    double entries = small_files + ndirs + DEEP_LEVELS + 10;
+    rv |= bench("ls", ls, 3, 0, entries, "ent/s", NULL);
+  }
+
+  {
+    char *lookup[] = { argv[1], "batch", image, manifest, NULL };
+    rv |= bench("lookup", lookup, 3, small_bytes, small_files + DEEP_LEVELS,
+                "ops/s", NULL);
+  }
+
+  {
+    char *copy[] = { argv[1], "read", image, "/big/triple", output, NULL };
+    double size = large_mib * 0x100000 + 99.0;
+    snprintf(command, sizeof ( command ), "rm -f '%s'", output);
+    rv |= bench("read", copy, 3, size, 1, "files/s", command);
+    if (rv == 0 && file_hash(output) != large_hash)
+      {
+        printf("unixbench: %s does not match /big/triple\n", output);
+        rv = -1;
+      }
+
+    unlink(output);
+  }
+
+  {
+    char *extract[] = { argv[1], "extract", image, "/small", output, NULL };
+    snprintf(command, sizeof ( command ), "rm -rf '%s'", output);
+    rv |= bench("extract", extract, 3, small_bytes, small_files, "files/s",
+                command);
+    if (system(command) != 0)
+      {
+        rv = -1;
+      }
+  }
+
+  return rv ? 1 : 0;
+}
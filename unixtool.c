@@ -8,20 +8,152 @@
  *  Modified for TI S1500 by Jeffrey H. Johnson <trnsz@pobox.com>
  */
 
+#define _GNU_SOURCE /* copy_file_range(), fallocate() */
+
+#include <errno.h>
 #include <fcntl.h>
+#include <fnmatch.h>
+#include <limits.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#if defined(__linux__)
+# include <sys/sendfile.h>
+#endif
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <time.h>
 #include <unistd.h>
 
-int disk_fd = -1;         /* FD for band image */
-int file_fd = -1;         /* FD for source/target file */
-char *disk_fname = NULL;  /* Band image filename */
-uint8_t DISK_BLOCK[1024]; /* One disk block */
+#include "unixtool.h"
+
+#if defined(UNIXTOOL_ZLIB)
+# include <zlib.h>
+#endif
+
+#if defined(UNIXTOOL_FUSE) && !defined(UNIXTOOL_LIBRARY)
+# define FUSE_USE_VERSION 31
+# include <fuse.h>
+#endif
+
+#if defined(__GNUC__) && ( defined(__x86_64__) || defined(__i386__) )
+# include <tmmintrin.h>
+# define DECODE_SSSE3 1 /* Runtime-selected SSSE3 decode kernels */
+#endif
+
+int verbose = 0;           /* Tracing level (-v, -vv) */
+long extract_threads = 0;  /* Worker threads for extract (-j, 0 = per CPU) */
+int ls_recursive = 0;      /* List subdirectories too (ls -R) */
+int copy_depth = 4;        /* Reads in flight when copying out (--qd) */
+int copy_direct = 0;       /* Write copies with O_DIRECT (--direct) */
+char *hash_manifest = NULL; /* Manifest of files copied (--hash, "-" = stdout) */
+FILE *manifest_file = NULL; /* ... once open */
+int extract_incremental = 0; /* Skip files already extracted (--incremental) */
+int namei_quiet = 0;        /* No message for paths that don't resolve (mount) */
+off_t image_offset = 0;     /* Filesystem starts here in the file (--offset) */
+long image_band = -1;       /* ... or at the Nth one found after it (--band) */
+int image_raw = 0;          /* Don't look for a filesystem at all (scan) */
+
+#define COPY_BUFFER_SIZE 0x100000 /* Bytes per pread() when copying out */
+#define COPY_GATHER_EXTENT 0x10000 /* Gather files averaging smaller extents */
+#define DIRECT_ALIGN 4096         /* O_DIRECT buffer, offset and size unit */
+
+/* Debug tracing, formatted only when asked for */
+#define TRACE(level, ...) \
+  do \
+    { \
+      if (verbose >= ( level )) \
+        { \
+          printf(__VA_ARGS__); \
+        } \
+    } \
+  while (0)
+
+/* HOT-PATH COUNTERS AND PHASE TIMERS (--stats) */
+/*
+ * Bumped with relaxed atomics, since extract workers share them, and only
+ * when --stats asked for them.  Phase times are summed over threads and
+ * phases may nest (a lookup can build a directory index), so they need
+ * not add up to the total.
+ */
+enum
+{
+  PHASE_OPEN,      /* Opening the image, superblock, inode table */
+  PHASE_LOOKUP,    /* Path lookups */
+  PHASE_DIR,       /* Reading and indexing directories */
+  PHASE_MAP,       /* Building block maps */
+  PHASE_COPY,      /* Copying file data out */
+  PHASE_COUNT
+};
+
+const char *phase_name[PHASE_COUNT] = { "open", "lookup", "dir", "map", "copy" };
+
+typedef struct rStats
+{
+  uint64_t disk_block_reads;   /* disk_block_read() CALLS */
+  uint64_t disk_reads;         /* READ SYSTEM CALLS ON THE IMAGE */
+  uint64_t disk_read_bytes;    /* BYTES THEY RETURNED */
+  uint64_t inode_reads;        /* read_inode() CALLS */
+  uint64_t ilist_loads;        /* I-LIST BLOCKS DECODED INTO THE TABLE */
+  uint64_t block_reads[4];     /* inode_block_read() BY DIRECT/SINGLE/DOUBLE/TRIPLE */
+  uint64_t indirect_reads[3];  /* INDIRECT BLOCKS READ BY LEVEL */
+  uint64_t host_writes;        /* write() CALLS ON HOST FILES */
+  uint64_t host_write_bytes;   /* BYTES WRITTEN */
+  uint64_t host_hole_bytes;    /* BYTES LEFT AS HOLES INSTEAD */
+  uint64_t host_alloc_bytes;   /* BYTES RESERVED BEFORE COPYING */
+  uint64_t map_hits;           /* BLOCK MAP CACHE */
+  uint64_t map_misses;
+  uint64_t dir_hits;           /* DIRECTORY INDEX CACHE */
+  uint64_t dir_misses;
+  uint64_t path_hits;          /* PATH PREFIX CACHE */
+  uint64_t path_misses;
+  uint64_t gz_frames;          /* COMPRESSED IMAGES: FRAMES DECODED */
+  uint64_t gz_frame_hits;      /* ... READS SERVED FROM DECODED ONES */
+  uint64_t gz_read_bytes;      /* ... COMPRESSED BYTES READ */
+  uint64_t phase_ns[PHASE_COUNT];
+} Stats;
+
+int stats_enabled = 0;  /* --stats: 1 = text, 2 = JSON */
+Stats stats;
+uint64_t stats_start;   /* Clock at startup */
+
+#define STAT_ADD(field, n) \
+  do \
+    { \
+      if (stats_enabled) \
+        { \
+          __atomic_fetch_add(&stats.field, ( n ), __ATOMIC_RELAXED); \
+        } \
+    } \
+  while (0)
+
+/* MONOTONIC CLOCK IN NANOSECONDS, 0 IF NOT COLLECTING */
+uint64_t
+stats_clock(void)
+{
+  struct timespec ts;
+
+  if (!stats_enabled)
+    {
+      return 0;
+    }
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* CHARGE TIME SINCE start (FROM stats_clock()) TO phase */
+void
+stats_phase(int phase, uint64_t start)
+{
+  if (stats_enabled)
+    {
+      STAT_ADD(phase_ns[phase], stats_clock() - start);
+    }
+}
 
 /* SYSV (68K) SUPERBLOCK - ON-DISK STRUCTURE */
 /* ALL WORDS NEED BYTE-SWAPPED */
@@ -48,9 +180,6 @@ typedef struct rSuperBlock
   uint32_t type;       /* FILESYSTEM TYPE */
 } __attribute__ (( packed )) SuperBlock;
 
-uint8_t superblock_buffer[1024]; /* BUFFER FOR HOLDING SUPERBLOCK */
-SuperBlock *superblock = (SuperBlock *)&superblock_buffer;
-
 /* INODE (on-disk representation) */
 /* ALL WORDS NEED BYTE-SWAPPED */
 typedef struct rInodeODR
@@ -69,6 +198,7 @@ typedef struct rInodeODR
 /* Inode (in-memory representation) */
 typedef struct rInode
 {
+  int number;        /* INODE NUMBER */
   uint16_t mode;     /* MODE BITS */
   uint16_t type;     /* TYPE BITS */
   uint16_t nlink;    /* NUMBER OF LINKS TO HERE */
@@ -95,6 +225,67 @@ typedef struct rDirent
   unsigned char name[14];
 } __attribute__ (( packed )) Dirent;
 
+/* DIRECTORY ENTRY (in-memory representation) */
+typedef struct rDirEntry
+{
+  uint16_t inode;
+  char name[15];   /* NUL-TERMINATED */
+} DirEntry;
+
+/* Defined with the code that uses them */
+typedef struct rBufCacheLine BufCacheLine;
+typedef struct rBufCacheShard BufCacheShard;
+typedef struct rBlockMap BlockMap;
+typedef struct rDirIndex DirIndex;
+typedef struct rPathCacheEntry PathCacheEntry;
+typedef struct rIndexHeader IndexHeader;
+typedef struct rIndexSpan IndexSpan;
+typedef struct rIndexPath IndexPath;
+typedef struct rExtent Extent;
+
+/* ONE OPEN BAND IMAGE */
+/*
+ * Everything belonging to one image - its fd or mapping, superblock and
+ * caches - so that a process can have many open (see unixtool.h).  Code
+ * works on the current image, disk, which is per thread.  The library
+ * calls point disk at their handle and hold lock around anything that
+ * touches the caches, which are otherwise single-threaded; the buffer
+ * cache and the data paths (disk_ptr() and below) need no lock.
+ */
+typedef struct rImage
+{
+  int fd;                           /* FD FOR BAND IMAGE */
+  char *fname;                      /* BAND IMAGE FILENAME */
+  uint8_t *map;                     /* CONTENTS (MAPPED OR BUFFERED) */
+  struct rGzIndex *gz;              /* READER FOR A GZIP'ED IMAGE */
+  off_t base;                       /* FILESYSTEM STARTS HERE IN THE FILE */
+  off_t size;                       /* SIZE IN BYTES, WHEN KNOWN */
+  int map_owned;                    /* NONZERO IF map IS malloc()ED */
+  uint8_t superblock_buffer[1024];  /* BUFFER FOR HOLDING SUPERBLOCK */
+  SuperBlock *superblock;           /* ... AS A STRUCTURE */
+  BufCacheLine *bcache;             /* bcache_sets * BCACHE_WAYS LINES */
+  uint32_t bcache_sets;             /* POWER OF TWO */
+  BufCacheShard *bcache_shard;      /* BCACHE_LOCKS SHARDS */
+  Inode *inode_table;               /* DECODED INODES, INDEXED BY NUMBER */
+  uint8_t *inode_table_loaded;      /* PER I-LIST BLOCK: DECODED YET? */
+  int inode_count;                  /* INODES COVERED BY THE TABLE */
+  BlockMap *block_map_cache;        /* BLOCK_MAP_SLOTS RECENT BLOCK MAPS */
+  DirIndex **dir_index_cache;       /* BUILT INDEXES, BY DIRECTORY INODE */
+  PathCacheEntry *path_cache;       /* OPEN-ADDRESSED, POWER-OF-TWO SIZED */
+  uint32_t path_cache_size;         /* SLOTS ALLOCATED */
+  uint32_t path_cache_used;         /* SLOTS IN USE */
+  const IndexHeader *index;         /* MAPPED METADATA INDEX, IF VALID */
+  const IndexSpan *index_map;       /* ITS SECTIONS */
+  const IndexSpan *index_dir;
+  const Extent *index_extent;
+  const DirEntry *index_dirent;
+  const IndexPath *index_path;
+  const char *index_name;
+  pthread_mutex_t lock;             /* SERIALISES LIBRARY CALLS */
+} Image;
+
+_Thread_local Image *disk = NULL; /* Image being worked on */
+
 /* SWAP BYTES OF 32-BIT WORD */
 uint32_t
 swap_word(uint32_t in)
@@ -116,611 +307,8370 @@ swap_hword(uint16_t in)
   return out;
 }
 
-/* READ INODE */
-int
-read_inode(int number, Inode *inode)
+/* BULK DECODE KERNELS */
+/*
+ * swap_words() byte-swaps a run of big-endian words (an indirect block),
+ * unpack_addrs() the 13 three-byte block addresses of an on-disk inode.
+ * The portable versions compile to bswap and shifts; on x86 CPUs with
+ * SSSE3 they are swapped for pshufb versions, four words per shuffle, by
+ * decode_kernels_init().
+ */
+void
+swap_words_scalar(const uint32_t *in, uint32_t *out, uint32_t count)
+{
+  uint32_t x = 0;
+
+  while (x < count)
+    {
+      out[x] = __builtin_bswap32(in[x]);
+      x++;
+    }
+}
+
+void
+unpack_addrs_scalar(const uint8_t *in, uint32_t *addr)
 {
-  /* Read the given inode */
-  ssize_t io_res;
-  off_t seek_res;
-  off_t inode_disk_offset = 0x7C0;
   int x = 0;
-  InodeODR raw_inode;
 
-  inode_disk_offset += ( number * 0x40 );
-  /* printf("read_inode(%d): diskaddr 0x%.8llx\n",number,inode_disk_offset); */
-  seek_res = lseek(disk_fd, inode_disk_offset, SEEK_SET);
-  if (seek_res < 0)
+  while (x < 13)
     {
-      /* Seek error! */
-      perror("read_inode():lseek()");
-      return -1;
+      addr[x] = ( in[x * 3] << 16 ) | ( in[x * 3 + 1] << 8 ) | in[x * 3 + 2];
+      x++;
     }
+}
 
-  /* Read raw inode */
-  io_res = read(disk_fd, (uint8_t *)&raw_inode, 0x40);
-  if (io_res < 0)
+#if defined(DECODE_SSSE3)
+__attribute__ (( target("ssse3") )) void
+swap_words_ssse3(const uint32_t *in, uint32_t *out, uint32_t count)
+{
+  const __m128i mask = _mm_setr_epi8(
+    3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+  uint32_t x = 0;
+
+  while (x + 4 <= count)
     {
-      /* Read error! */
-      perror("read_inode():read()");
-      return -1;
+      __m128i v = _mm_loadu_si128((const __m128i *)( in + x ));
+      _mm_storeu_si128((__m128i *)( out + x ), _mm_shuffle_epi8(v, mask));
+      x += 4;
     }
+  swap_words_scalar(in + x, out + x, count - x);
+}
 
-  /* Read in inode particulars */
-  inode->mode = ( raw_inode.mode & 0xFF00 ) >> 8;
-  inode->mode |= (( raw_inode.mode & 0x000F ) << 8 );
-  inode->type = ( raw_inode.mode & 0x00F0 ) >> 4;
-  inode->nlink = swap_hword(raw_inode.nlink);
-  inode->uid = swap_hword(raw_inode.uid);
-  inode->gid = swap_hword(raw_inode.gid);
-  inode->size = swap_word(raw_inode.size);
-  inode->atime = swap_word(raw_inode.atime);
-  inode->mtime = swap_word(raw_inode.mtime);
-  inode->ctime = swap_word(raw_inode.ctime);
-  /*
-   * printf("inode %d: type %o mode %.5o owner %.6o:%.6o size %d\n",
-   *  number,inode->type,inode->mode,inode->uid,inode->gid,inode->size);
-   */
+/* in must have 40 readable bytes (InodeODR.addr) */
+__attribute__ (( target("ssse3") )) void
+unpack_addrs_ssse3(const uint8_t *in, uint32_t *addr)
+{
+  /* Each group of 3 bytes becomes a zero-extended little-endian word */
+  const __m128i mask = _mm_setr_epi8(
+    2, 1, 0, -1, 5, 4, 3, -1, 8, 7, 6, -1, 11, 10, 9, -1);
+  int x = 0;
 
-   /* Read in block addresses */
-  while (x < 13)
+  while (x < 3)
     {
-      inode->addr[x] = ( raw_inode.addr[x * 3] << 16 );
-      inode->addr[x] |= ( raw_inode.addr[x * 3 + 1] << 8 );
-      inode->addr[x] |= raw_inode.addr[x * 3 + 2];
-      /*
-       * if (inode->addr[x] > 0) {
-       *   printf("block %d: %.6x\n",x,inode->addr[x]); }
-       */
+      __m128i v = _mm_loadu_si128((const __m128i *)( in + x * 12 ));
+      _mm_storeu_si128((__m128i *)( addr + x * 4 ), _mm_shuffle_epi8(v, mask));
       x++;
     }
-  /* Done */
-  return 0;
+  addr[12] = ( in[36] << 16 ) | ( in[37] << 8 ) | in[38];
 }
+#endif
 
-int
-disk_block_read(int adr, uint8_t *buf)
+void (*swap_words)(const uint32_t *in, uint32_t *out, uint32_t count)
+  = swap_words_scalar;
+void (*unpack_addrs)(const uint8_t *in, uint32_t *addr) = unpack_addrs_scalar;
+
+/* PICK THE FASTEST DECODE KERNELS THIS CPU RUNS */
+void
+decode_kernels_init(void)
+{
+#if defined(DECODE_SSSE3)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("ssse3"))
+    {
+      swap_words = swap_words_ssse3;
+      unpack_addrs = unpack_addrs_ssse3;
+    }
+#endif
+}
+
+/* SHA-256 (FIPS 180-4), FOR hash AND --hash */
+typedef struct rSha256
+{
+  uint32_t state[8];   /* CHAINING VALUE */
+  uint64_t length;     /* BYTES HASHED */
+  uint8_t block[64];   /* PARTIAL INPUT BLOCK */
+  size_t used;         /* BYTES IN block */
+} Sha256;
+
+const uint32_t sha256_k[64] = {
+  0x428A2F98, 0x71374491, 0xB5C0FBCF, 0xE9B5DBA5, 0x3956C25B, 0x59F111F1,
+  0x923F82A4, 0xAB1C5ED5, 0xD807AA98, 0x12835B01, 0x243185BE, 0x550C7DC3,
+  0x72BE5D74, 0x80DEB1FE, 0x9BDC06A7, 0xC19BF174, 0xE49B69C1, 0xEFBE4786,
+  0x0FC19DC6, 0x240CA1CC, 0x2DE92C6F, 0x4A7484AA, 0x5CB0A9DC, 0x76F988DA,
+  0x983E5152, 0xA831C66D, 0xB00327C8, 0xBF597FC7, 0xC6E00BF3, 0xD5A79147,
+  0x06CA6351, 0x14292967, 0x27B70A85, 0x2E1B2138, 0x4D2C6DFC, 0x53380D13,
+  0x650A7354, 0x766A0ABB, 0x81C2C92E, 0x92722C85, 0xA2BFE8A1, 0xA81A664B,
+  0xC24B8B70, 0xC76C51A3, 0xD192E819, 0xD6990624, 0xF40E3585, 0x106AA070,
+  0x19A4C116, 0x1E376C08, 0x2748774C, 0x34B0BCB5, 0x391C0CB3, 0x4ED8AA4A,
+  0x5B9CCA4F, 0x682E6FF3, 0x748F82EE, 0x78A5636F, 0x84C87814, 0x8CC70208,
+  0x90BEFFFA, 0xA4506CEB, 0xBEF9A3F7, 0xC67178F2
+};
+
+#define SHA256_ROR(x, n) ((( x ) >> ( n )) | (( x ) << ( 32 - ( n ))))
+
+/* START A DIGEST */
+void
+sha256_init(Sha256 *ctx)
 {
-  ssize_t io_res; /* Result of read/write operations */
-  /* Reposition the file pointer. */
-  off_t seek_res = lseek(disk_fd, ( adr * 0x400 ), SEEK_SET);
+  ctx->state[0] = 0x6A09E667;
+  ctx->state[1] = 0xBB67AE85;
+  ctx->state[2] = 0x3C6EF372;
+  ctx->state[3] = 0xA54FF53A;
+  ctx->state[4] = 0x510E527F;
+  ctx->state[5] = 0x9B05688C;
+  ctx->state[6] = 0x1F83D9AB;
+  ctx->state[7] = 0x5BE0CD19;
+  ctx->length = 0;
+  ctx->used = 0;
+}
+
+/* MIX ONE 64-BYTE BLOCK INTO THE STATE */
+void
+sha256_compress(uint32_t *state, const uint8_t *block)
+{
+  uint32_t w[64];
+  uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+  uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+  int x;
 
-  if (seek_res < 0)
+  for (x = 0; x < 16; x++)
     {
-      /* Seek error! */
-      perror("unixtool: disk lseek()");
-      return -1;
+      w[x] = (uint32_t)block[x * 4] << 24 | (uint32_t)block[x * 4 + 1] << 16
+             | (uint32_t)block[x * 4 + 2] << 8 | block[x * 4 + 3];
     }
 
-  /* Read in a sector. */
-  io_res = read(disk_fd, buf, 1024);
-  if (io_res < 0)
+  for (; x < 64; x++)
     {
-      perror("unixtool: disk read()");
-      return -1;
+      uint32_t s0 = SHA256_ROR(w[x - 15], 7) ^ SHA256_ROR(w[x - 15], 18)
+                    ^ ( w[x - 15] >> 3 );
+      uint32_t s1 = SHA256_ROR(w[x - 2], 17) ^ SHA256_ROR(w[x - 2], 19)
+                    ^ ( w[x - 2] >> 10 );
+      w[x] = w[x - 16] + s0 + w[x - 7] + s1;
     }
 
-  return io_res;
+  for (x = 0; x < 64; x++)
+    {
+      uint32_t t1 = h + ( SHA256_ROR(e, 6) ^ SHA256_ROR(e, 11)
+                          ^ SHA256_ROR(e, 25))
+                    + (( e & f ) ^ ( ~e & g )) + sha256_k[x] + w[x];
+      uint32_t t2 = ( SHA256_ROR(a, 2) ^ SHA256_ROR(a, 13)
+                      ^ SHA256_ROR(a, 22))
+                    + (( a & b ) ^ ( a & c ) ^ ( b & c ));
+      h = g;
+      g = f;
+      f = e;
+      e = d + t1;
+      d = c;
+      c = b;
+      b = a;
+      a = t1 + t2;
+    }
+
+  state[0] += a;
+  state[1] += b;
+  state[2] += c;
+  state[3] += d;
+  state[4] += e;
+  state[5] += f;
+  state[6] += g;
+  state[7] += h;
 }
 
-int
-inode_block_read(int adr, Inode *inode, uint8_t *buf)
+/* ADD BYTES (NULL: ZEROES) TO A DIGEST */
+void
+sha256_update(Sha256 *ctx, const uint8_t *data, size_t len)
 {
-  int block = 0;
-  int rv = 0;
+  static const uint8_t zeros[64];
 
-  if (adr < 10)
+  ctx->length += len;
+  while (len > 0)
     {
-      /* Direct */
-      block = inode->addr[adr];
-      if (block > 0)
+      const uint8_t *in = data != NULL ? data : zeros;
+      size_t chunk = 64 - ctx->used;
+
+      if (ctx->used == 0 && len >= 64)
         {
-          printf("inode_block_read(%d) => disk_block_read(%d)\n", adr, block);
-          return disk_block_read(block, buf);
+          /* Whole blocks straight from the input */
+          sha256_compress(ctx->state, in);
+          chunk = 64;
         }
       else
         {
-          return 0; /* EOF */
-        }
-    }
-  else
-    {
-      if (adr < 266)
-        {
-          /* One-level indirection */
-          uint32_t indirect_block[256];
-          int indirect_offset = ( adr - 10 );
-          rv = disk_block_read(inode->addr[10], (uint8_t *)indirect_block);
-          if (rv < 0)
-            {
-              return rv;
-            }
-
-          block = swap_word(indirect_block[indirect_offset]);
-          printf(
-            "inode_block_read(%d) => %d(%d) => disk_block_read(%d)\n",
-            adr,
-            inode->addr[10],
-            indirect_offset,
-            block);
-          return disk_block_read(block, buf);
-        }
-
-      if (adr < 65802)
-        {
-          /* Two-level indirection */
-          uint32_t first_indirect_block[256];
-          int first_indirect_offset = ( adr - 266 ) / 256;
-          uint32_t second_indirect_block[256];
-          int second_indirect_offset = ( adr - 266 ) - ( first_indirect_offset * 256 );
-          rv = disk_block_read(inode->addr[11], (uint8_t *)first_indirect_block);
-          if (rv < 0)
+          if (chunk > len)
             {
-              return rv;
+              chunk = len;
             }
 
-          rv = disk_block_read(
-            swap_word(first_indirect_block[first_indirect_offset]),
-            (uint8_t *)second_indirect_block);
-          if (rv < 0)
+          memcpy(ctx->block + ctx->used, in, chunk);
+          ctx->used += chunk;
+          if (ctx->used == 64)
             {
-              return rv;
+              sha256_compress(ctx->state, ctx->block);
+              ctx->used = 0;
             }
+        }
 
-          block = swap_word(second_indirect_block[second_indirect_offset]);
-          printf(
-            "inode_block_read(%d) => %d(%d) => %d(%d) => disk_block_read(%d)\n",
-            adr,
-            inode->addr[11],
-            first_indirect_offset,
-            swap_word(first_indirect_block[first_indirect_offset]),
-            second_indirect_offset,
-            block);
-          return disk_block_read(block, buf);
+      if (data != NULL)
+        {
+          data += chunk;
         }
 
-      printf("Further indirection required\n");
-      return -1;
+      len -= chunk;
     }
-
-  /* Shouldn't get here! */
-  printf("inode_block_read(): Fell off end!\n");
-  return -1;
 }
 
-int
-unix_ls(char *path)
+/* FINISH A DIGEST INTO 32 BYTES */
+void
+sha256_final(Sha256 *ctx, uint8_t *digest)
 {
-  /* List the given path */
-  Inode dir_inode;
-  Inode next_dir_inode;
-  char *pathpart;
-  uint8_t dir_buffer[1024];
-  int x = 0;        /* index into directory */
-  int dirblock = 0; /* Block index into directory inode */
-  int rv = 0;
-  int done = 0;
+  uint64_t bits = ctx->length * 8;
+  int x;
 
-  if (path[0] != '/')
+  ctx->block[ctx->used++] = 0x80;
+  if (ctx->used > 56)
     {
-      printf("unixtool: ls: Invalid path\n");
-      return -1;
+      memset(ctx->block + ctx->used, 0, 64 - ctx->used);
+      sha256_compress(ctx->state, ctx->block);
+      ctx->used = 0;
     }
 
-  /* Load the root directory */
-  rv = read_inode(2, &dir_inode);
-  if (rv < 0)
+  memset(ctx->block + ctx->used, 0, 56 - ctx->used);
+  for (x = 0; x < 8; x++)
     {
-      return rv;
+      ctx->block[56 + x] = bits >> ( 56 - x * 8 );
     }
 
-  /* Walk path */
-  pathpart = strtok(path, "/");
-  while (pathpart != NULL)
+  sha256_compress(ctx->state, ctx->block);
+  for (x = 0; x < 32; x++)
     {
-      uint16_t dir_inode_number = 0;
-      printf("pathpart: %s\n", pathpart);
-      done = 0;
-      while (!done)
-        {
-          Dirent *dir_entry = (Dirent *)&dir_buffer;
-          rv = inode_block_read(dirblock, &dir_inode, dir_buffer);
-          if (rv < 0)
-            {
-              return rv;
-            }
+      digest[x] = ctx->state[x / 4] >> ( 24 - ( x % 4 ) * 8 );
+    }
+}
 
-          if (rv == 0)
-            {
-              return 0;
-            } /* EOF, we are done */
+_Thread_local Sha256 *copy_hash = NULL; /* Digest of data being copied */
 
-          x = 0;
-          dir_inode_number = 0;
-          while (dir_entry->inode != 0 && x < 64)
-            {
-              /* Stuff */
-              if (strlen(pathpart) > 14)
-                {
-                  /* Very funny. */
-                  printf("unixtool: No such file or directory (in image).\n");
-                  return 0;
-                }
+/* FEED COPIED BYTES (NULL: ZEROES) TO copy_hash, IF HASHING */
+void
+copy_hash_data(const uint8_t *data, size_t len)
+{
+  if (copy_hash != NULL)
+    {
+      sha256_update(copy_hash, data, len);
+    }
+}
 
-              /* printf("ent %d: %s\n",x,dir_entry->name); */
-              if (strncmp(pathpart, (const char *)dir_entry->name, 14) == 0)
-                {
-                  /* FOUND! */
-                  rv = read_inode(swap_hword(dir_entry->inode), &next_dir_inode);
-                  if (rv < 0)
-                    {
-                      return rv;
-                    }
+/* COMPRESSED IMAGES (make ZLIB=1) */
+/*
+ * A gzip'ed image is read in place.  The first open inflates it once,
+ * noting a point about every GZ_SPAN bytes of output where inflate can
+ * start again: a deflate block boundary, its bit position in the input
+ * and the 32 KiB of output before it (zlib's zran scheme).  The points
+ * are saved as <image>.gzi for later opens.  The output between two
+ * points is a frame; reads decode only the frames they touch, and the
+ * last GZ_FRAMES decoded are kept.  Images made of many gzip members
+ * (pigz -i, bgzip) restart at member starts, which need no window.
+ */
+#if defined(UNIXTOOL_ZLIB)
 
-                  if (next_dir_inode.type == INODE_FT_DIR)
-                    {
-                      /* Subdirectory */
-                      dir_inode_number = swap_hword(dir_entry->inode);
-                      /* printf("SUBDIRECTORY at %.4X\n",dir_inode_number); */
-                      rv = read_inode(dir_inode_number, &dir_inode);
-                      if (rv < 0)
-                        {
-                          printf("subdirectory read_inode() blew it!\n");
-                          return rv;
-                        }
-
-                      dirblock = 0;
-                    }
+#define GZ_SPAN 0x100000  /* Uncompressed bytes between points */
+#define GZ_WINDOW 0x8000  /* Deflate history */
+#define GZ_INPUT 0x10000  /* Compressed bytes per pread() */
+#define GZ_FRAMES 16      /* Decoded frames kept */
+#define GZ_INDEX_MAGIC "UTXGZIDX"
+#define GZ_INDEX_VERSION 1
 
-                  done = 1;
-                  break;
-                }
+/* PLACE INFLATE CAN START FROM */
+typedef struct rGzPoint
+{
+  uint64_t out;         /* UNCOMPRESSED OFFSET */
+  uint64_t in;          /* COMPRESSED OFFSET OF THE NEXT WHOLE BYTE */
+  uint32_t bits;        /* BITS OF THE BYTE BEFORE in NOT YET INFLATED */
+  uint32_t window;      /* DICTIONARY BYTES; 0 = START OF A GZIP MEMBER */
+  uint64_t window_off;  /* ... AT THIS OFFSET INTO GzIndex.window */
+} GzPoint;
 
-              dir_entry++;
-              x++;
-            }
-          if (x < 64)
-            {
-              /* We are done! */
-              done = 1;
-            }
-          else
-            {
-              /* Read next block */
-              dirblock++;
-            }
-        }
-      if (dir_inode_number == 0)
+/* DECODED FRAME */
+typedef struct rGzFrame
+{
+  uint64_t used;        /* TICK AT LAST USE, 0 = EMPTY */
+  uint32_t point;       /* FRAME (THE POINT IT STARTS AT) */
+  uint8_t *data;        /* ITS BYTES */
+} GzFrame;
+
+/* <image>.gzi HEADER; POINTS AND WINDOWS FOLLOW */
+typedef struct rGzIndexHeader
+{
+  char magic[8];        /* GZ_INDEX_MAGIC */
+  uint32_t version;     /* GZ_INDEX_VERSION */
+  uint32_t points;
+  uint64_t gz_size;     /* COMPRESSED IMAGE IT DESCRIBES */
+  int64_t gz_mtime;
+  uint64_t size;        /* UNCOMPRESSED SIZE */
+  uint64_t window_size; /* BYTES OF WINDOWS */
+} GzIndexHeader;
+
+typedef struct rGzIndex
+{
+  int fd;               /* COMPRESSED IMAGE */
+  uint64_t size;        /* UNCOMPRESSED SIZE */
+  GzPoint *point;       /* IN out ORDER, point[0].out = 0 */
+  uint32_t points;
+  uint32_t point_alloc;
+  uint8_t *window;      /* DICTIONARIES, PACKED */
+  uint64_t window_size;
+  uint64_t window_alloc;
+  GzFrame frame[GZ_FRAMES];
+  uint64_t tick;        /* FRAME USE CLOCK */
+  pthread_mutex_t lock; /* PROTECTS frame AND tick */
+} GzIndex;
+
+/* FREE GZIP READER */
+void
+gz_free(GzIndex *gz)
+{
+  int x = 0;
+
+  if (gz == NULL)
+    {
+      return;
+    }
+
+  while (x < GZ_FRAMES)
+    {
+      free(gz->frame[x++].data);
+    }
+  free(gz->point);
+  free(gz->window);
+  pthread_mutex_destroy(&gz->lock);
+  free(gz);
+}
+
+/* ADD A POINT, WITH window BYTES OF ring ENDING AT ring_end */
+int
+gz_point_add(GzIndex *gz, uint64_t out, uint64_t in, uint32_t bits,
+             const uint8_t *ring, uint32_t ring_end, uint32_t window)
+{
+  GzPoint *pt;
+
+  if (gz->points == gz->point_alloc)
+    {
+      uint32_t grow = gz->point_alloc ? gz->point_alloc * 2 : 256;
+      GzPoint *grown = realloc(gz->point, grow * sizeof ( GzPoint ));
+      if (grown == NULL)
         {
-          printf(
-            "unixtool: No such file or directory (in image, path search).\n");
+          perror("unixtool: gzip index realloc()");
           return -1;
         }
 
-      pathpart = strtok(NULL, "/");
+      gz->point = grown;
+      gz->point_alloc = grow;
     }
-  /* Print loaded directory */
-  done = 0;
-  printf("%s:\n", path);
-  while (!done)
+
+  if (gz->window_size + window > gz->window_alloc)
     {
-      Inode file_inode;
-      Dirent *dir_entry = (Dirent *)&dir_buffer;
-      rv = inode_block_read(dirblock, &dir_inode, dir_buffer);
-      if (rv < 0)
+      uint64_t grow = gz->window_alloc ? gz->window_alloc * 2 : 64 * GZ_WINDOW;
+      uint8_t *grown = realloc(gz->window, grow);
+      if (grown == NULL)
         {
-          return rv;
+          perror("unixtool: gzip index realloc()");
+          return -1;
         }
 
-      if (rv == 0)
-        {
-          return 0;
-        } /* EOF, we are done */
+      gz->window = grown;
+      gz->window_alloc = grow;
+    }
 
-      x = 0;
-      while (dir_entry->inode != 0 && x < 64)
-        {
-          char permbuf[10] = "----------";
-          char modtimebuf[32] = "";
-          struct tm *modtime;
-          rv = read_inode(swap_hword(dir_entry->inode), &file_inode);
-          if (rv < 0)
-            {
-              return rv;
-            }
+  pt = &gz->point[gz->points++];
+  pt->out = out;
+  pt->in = in;
+  pt->bits = bits;
+  pt->window = window;
+  pt->window_off = gz->window_size;
+  if (window > 0)
+    {
+      /* Oldest first: ring is GZ_WINDOW bytes, written circularly */
+      uint32_t start = ( ring_end + GZ_WINDOW - window ) % GZ_WINDOW;
+      uint32_t first = GZ_WINDOW - start < window ? GZ_WINDOW - start : window;
+      memcpy(gz->window + gz->window_size, ring + start, first);
+      memcpy(gz->window + gz->window_size + first, ring, window - first);
+      gz->window_size += window;
+    }
 
-          if (file_inode.type == INODE_FT_DIR)
-            {
-              permbuf[0] = 'd';
-            } /* Directory */
+  return 0;
+}
 
-          if (file_inode.type == INODE_FT_CHAR)
-            {
-              permbuf[0] = 'c';
-            } /* Char special */
+/* REFILL INFLATE INPUT FROM THE COMPRESSED IMAGE; 0 AT EOF, -1 ON ERROR */
+ssize_t
+gz_fill(GzIndex *gz, z_stream *strm, uint8_t *in, uint64_t *pos)
+{
+  ssize_t io_res;
 
-          if (file_inode.type == INODE_FT_BLK)
-            {
-              permbuf[0] = 'b';
-            } /* Block special */
+  do
+    {
+      io_res = pread(gz->fd, in, GZ_INPUT, *pos);
+    }
+  while (io_res < 0 && errno == EINTR);
+  if (io_res < 0)
+    {
+      perror("unixtool: gzip pread()");
+      return -1;
+    }
 
-          if (file_inode.type == INODE_FT_FIFO)
-            {
-              permbuf[0] = 'p';
-            } /* FIFO */
+  STAT_ADD(gz_read_bytes, io_res);
+  *pos += io_res;
+  strm->next_in = in;
+  strm->avail_in = io_res;
+  return io_res;
+}
 
-          if (file_inode.mode & 0400)
-            {
-              permbuf[1] = 'r';
-            }
+/* INFLATE THE WHOLE IMAGE ONCE, SETTING POINTS */
+int
+gz_build(GzIndex *gz)
+{
+  z_stream strm;
+  uint8_t *in = malloc(GZ_INPUT);
+  uint8_t *ring = malloc(GZ_WINDOW);
+  uint64_t pos = 0;        /* Compressed bytes read */
+  uint64_t total = 0;      /* Uncompressed bytes so far */
+  uint64_t member = 0;     /* ... in this gzip member */
+  uint64_t last = 0;       /* ... at the last point */
+  int rv = -1;
 
-          if (file_inode.mode & 0200)
-            {
-              permbuf[2] = 'w';
-            }
+  memset(&strm, 0, sizeof ( strm ));
+  if (in == NULL || ring == NULL || inflateInit2(&strm, 31) != Z_OK)
+    {
+      printf("unixtool: gzip index: out of memory\n");
+      free(in);
+      free(ring);
+      return -1;
+    }
 
-          if (file_inode.mode & 0100)
-            {
-              permbuf[3] = 'x';
-            }
+  if (gz_point_add(gz, 0, 0, 0, ring, 0, 0) < 0)
+    {
+      goto done;
+    }
 
-          if (file_inode.mode & 0040)
-            {
-              permbuf[4] = 'r';
-            }
+  for (;;)
+    {
+      uint32_t at = total % GZ_WINDOW;
+      int zr;
 
-          if (file_inode.mode & 0020)
+      if (strm.avail_in == 0)
+        {
+          ssize_t got = gz_fill(gz, &strm, in, &pos);
+          if (got < 0)
             {
-              permbuf[5] = 'w';
+              goto done;
             }
 
-          if (file_inode.mode & 0010)
+          if (got == 0)
             {
-              permbuf[6] = 'x';
+              printf("unixtool: %s: compressed image is truncated\n",
+                     disk->fname);
+              goto done;
             }
+        }
 
-          if (file_inode.mode & 0004)
-            {
-              permbuf[7] = 'r';
-            }
+      strm.next_out = ring + at;
+      strm.avail_out = GZ_WINDOW - at;
+      zr = inflate(&strm, Z_BLOCK);
+      total += GZ_WINDOW - at - strm.avail_out;
+      member += GZ_WINDOW - at - strm.avail_out;
+      if (zr != Z_OK && zr != Z_STREAM_END && zr != Z_BUF_ERROR)
+        {
+          printf("unixtool: %s: bad compressed data (%s)\n", disk->fname,
+                 strm.msg != NULL ? strm.msg : "inflate failed");
+          goto done;
+        }
 
-          if (file_inode.mode & 0002)
+      if (zr == Z_STREAM_END)
+        {
+          /* End of a member; another may follow, or trailing junk */
+          ssize_t got = strm.avail_in;
+          if (got == 0 && ( got = gz_fill(gz, &strm, in, &pos)) < 0)
             {
-              permbuf[8] = 'w';
+              goto done;
             }
 
-          if (file_inode.mode & 0001)
+          if (got == 0)
             {
-              permbuf[9] = 'x';
+              break;
             }
 
-          modtime = localtime(&file_inode.mtime);
-          if (modtime == NULL)
+          if (strm.next_in[0] != 0x1f)
             {
-              printf("localtime() blew it!\n");
-              return -1;
+              TRACE(1, "gzip: data after the last member ignored\n");
+              break;
             }
 
-          if (strftime(modtimebuf, 31, "%b %e  %Y", modtime) == 0)
+          inflateReset(&strm);
+          member = 0;
+          if (total - last >= GZ_SPAN)
             {
-              printf("strftime() blew it!\n");
-              return -1;
+              if (gz_point_add(gz, total, pos - strm.avail_in, 0, ring, 0, 0)
+                  < 0)
+                {
+                  goto done;
+                }
+
+              last = total;
             }
 
-          printf(
-            "%s  %2d %.6o  %.6o  %7d %s %s\n",
-            permbuf,
-            file_inode.nlink,
-            file_inode.uid,
-            file_inode.gid,
-            file_inode.size,
-            modtimebuf,
-            dir_entry->name);
-          dir_entry++;
-          x++;
+          continue;
         }
-      if (x < 64)
+
+      /* Between deflate blocks (not after the last) */
+      if (( strm.data_type & 128 ) && !( strm.data_type & 64 ) && member > 0
+          && total - last >= GZ_SPAN)
         {
-          /* We are done! */
-          done = 1;
+          if (gz_point_add(gz, total, pos - strm.avail_in, strm.data_type & 7,
+                           ring, total % GZ_WINDOW,
+                           member < GZ_WINDOW ? member : GZ_WINDOW) < 0)
+            {
+              goto done;
+            }
+
+          last = total;
         }
-      else
+    }
+
+  gz->size = total;
+  rv = 0;
+  TRACE(1, "gzip: %llu bytes in %u frames\n", (unsigned long long)total,
+        gz->points);
+
+done:
+  inflateEnd(&strm);
+  free(in);
+  free(ring);
+  return rv;
+}
+
+/* INDEX FILE NAME FOR THE IMAGE (malloc()ed) */
+char *
+gz_index_name(void)
+{
+  char *name = malloc(strlen(disk->fname) + 5);
+
+  if (name != NULL)
+    {
+      strcpy(name, disk->fname);
+      strcat(name, ".gzi");
+    }
+
+  return name;
+}
+
+/* LOAD POINTS FROM <image>.gzi IF IT MATCHES THE IMAGE */
+int
+gz_index_load(GzIndex *gz, const struct stat *st)
+{
+  GzIndexHeader hdr;
+  char *fname = gz_index_name();
+  FILE *in = fname != NULL ? fopen(fname, "rb") : NULL;
+  uint32_t x = 0;
+  int rv = -1;
+
+  free(fname);
+  if (in == NULL)
+    {
+      return -1;
+    }
+
+  if (fread(&hdr, sizeof ( hdr ), 1, in) == 1
+      && memcmp(hdr.magic, GZ_INDEX_MAGIC, 8) == 0
+      && hdr.version == GZ_INDEX_VERSION && hdr.points > 0
+      && hdr.gz_size == (uint64_t)st->st_size
+      && hdr.gz_mtime == (int64_t)st->st_mtime
+      && hdr.points <= hdr.size / GZ_SPAN + 1
+      && hdr.window_size <= (uint64_t)st->st_size + hdr.points * GZ_WINDOW)
+    {
+      gz->point = malloc(hdr.points * sizeof ( GzPoint ));
+      gz->window = malloc(hdr.window_size ? hdr.window_size : 1);
+      if (gz->point != NULL && gz->window != NULL
+          && fread(gz->point, sizeof ( GzPoint ), hdr.points, in) == hdr.points
+          && fread(gz->window, 1, hdr.window_size, in) == hdr.window_size)
+        {
+          gz->points = gz->point_alloc = hdr.points;
+          gz->window_size = gz->window_alloc = hdr.window_size;
+          gz->size = hdr.size;
+          rv = 0;
+        }
+    }
+
+  fclose(in);
+
+  /* Points are used as they are from here on: any one out of range and
+   * the file is rebuilt */
+  while (rv == 0 && x < gz->points)
+    {
+      GzPoint *pt = &gz->point[x];
+      if (pt->window > GZ_WINDOW || pt->window_off > gz->window_size
+          || pt->window > gz->window_size - pt->window_off || pt->bits >= 8
+          || pt->in > (uint64_t)st->st_size || ( pt->bits > 0 && pt->in == 0 )
+          || pt->out >= gz->size
+          || ( x == 0 ? pt->out != 0 : pt->out <= gz->point[x - 1].out ))
+        {
+          rv = -1;
+        }
+
+      x++;
+    }
+
+  if (rv < 0)
+    {
+      free(gz->point);
+      free(gz->window);
+      gz->point = NULL;
+      gz->window = NULL;
+      gz->points = gz->point_alloc = 0;
+      gz->window_size = gz->window_alloc = 0;
+    }
+
+  return rv;
+}
+
+/* SAVE POINTS AS <image>.gzi, IF THE DIRECTORY IS WRITABLE */
+/* Written aside and renamed, like index files */
+void
+gz_index_save(GzIndex *gz, const struct stat *st)
+{
+  GzIndexHeader hdr;
+  char *fname = gz_index_name();
+  char *tmpname = fname != NULL ? malloc(strlen(fname) + 5) : NULL;
+  FILE *out;
+
+  if (tmpname == NULL)
+    {
+      free(fname);
+      return;
+    }
+
+  strcpy(tmpname, fname);
+  strcat(tmpname, ".tmp");
+  memset(&hdr, 0, sizeof ( hdr ));
+  memcpy(hdr.magic, GZ_INDEX_MAGIC, 8);
+  hdr.version = GZ_INDEX_VERSION;
+  hdr.points = gz->points;
+  hdr.gz_size = st->st_size;
+  hdr.gz_mtime = st->st_mtime;
+  hdr.size = gz->size;
+  hdr.window_size = gz->window_size;
+  out = fopen(tmpname, "wb");
+  if (out != NULL)
+    {
+      int ok = fwrite(&hdr, sizeof ( hdr ), 1, out) == 1
+        && fwrite(gz->point, sizeof ( GzPoint ), gz->points, out) == gz->points
+        && fwrite(gz->window, 1, gz->window_size, out) == gz->window_size;
+      if (fclose(out) != 0 || !ok || rename(tmpname, fname) < 0)
+        {
+          unlink(tmpname);
+          out = NULL;
+        }
+    }
+
+  TRACE(1, "gzip: %s %s\n", fname, out != NULL ? "written" : "not written");
+  free(tmpname);
+  free(fname);
+}
+
+/* SET UP READER FOR A GZIP'ED IMAGE ON fd */
+GzIndex *
+gz_open(int fd, const struct stat *st)
+{
+  GzIndex *gz = calloc(1, sizeof ( GzIndex ));
+
+  if (gz == NULL)
+    {
+      perror("unixtool: gzip calloc()");
+      return NULL;
+    }
+
+  gz->fd = fd;
+  pthread_mutex_init(&gz->lock, NULL);
+  if (gz_index_load(gz, st) == 0)
+    {
+      return gz;
+    }
+
+  if (gz_build(gz) < 0)
+    {
+      gz_free(gz);
+      return NULL;
+    }
+
+  gz_index_save(gz, st);
+  return gz;
+}
+
+/* DECODE FRAME k INTO out (len BYTES, THE WHOLE FRAME) */
+int
+gz_frame_decode(GzIndex *gz, uint32_t k, uint8_t *out, size_t len)
+{
+  GzPoint *pt = &gz->point[k];
+  z_stream strm;
+  uint8_t *in = malloc(GZ_INPUT);
+  uint64_t pos = pt->in;
+  int raw = pt->window > 0;  /* Mid-member: raw deflate, no header */
+  int rv = -1;
+
+  memset(&strm, 0, sizeof ( strm ));
+  if (in == NULL || inflateInit2(&strm, raw ? -15 : 31) != Z_OK)
+    {
+      printf("unixtool: gzip: out of memory\n");
+      free(in);
+      return -1;
+    }
+
+  STAT_ADD(gz_frames, 1);
+  if (pt->bits > 0)
+    {
+      uint8_t byte;
+      if (pread(gz->fd, &byte, 1, pos - 1) != 1)
+        {
+          perror("unixtool: gzip pread()");
+          goto done;
+        }
+
+      inflatePrime(&strm, pt->bits, byte >> ( 8 - pt->bits ));
+    }
+
+  if (raw)
+    {
+      inflateSetDictionary(&strm, gz->window + pt->window_off, pt->window);
+    }
+
+  strm.next_out = out;
+  strm.avail_out = len;
+  while (strm.avail_out > 0)
+    {
+      int zr;
+
+      if (strm.avail_in == 0 && gz_fill(gz, &strm, in, &pos) <= 0)
+        {
+          printf("unixtool: %s: compressed image is truncated\n", disk->fname);
+          goto done;
+        }
+
+      zr = inflate(&strm, Z_NO_FLUSH);
+      if (zr == Z_STREAM_END)
+        {
+          /* Next member: skip the trailer (gzip mode reads its own) */
+          uint32_t skip = raw ? 8 : 0;
+          while (skip > 0 && strm.avail_out > 0)
+            {
+              uint32_t take;
+              if (strm.avail_in == 0 && gz_fill(gz, &strm, in, &pos) <= 0)
+                {
+                  printf("unixtool: %s: compressed image is truncated\n",
+                         disk->fname);
+                  goto done;
+                }
+
+              take = strm.avail_in < skip ? strm.avail_in : skip;
+              strm.next_in += take;
+              strm.avail_in -= take;
+              skip -= take;
+            }
+
+          inflateReset2(&strm, 31);
+          raw = 0;
+        }
+      else if (zr != Z_OK && zr != Z_BUF_ERROR)
+        {
+          printf("unixtool: %s: bad compressed data (%s)\n", disk->fname,
+                 strm.msg != NULL ? strm.msg : "inflate failed");
+          goto done;
+        }
+    }
+
+  rv = 0;
+
+done:
+  inflateEnd(&strm);
+  free(in);
+  return rv;
+}
+
+/* COPY len BYTES OF FRAME k, FROM within, DECODING IT IF NOT KEPT */
+int
+gz_frame_copy(GzIndex *gz, uint32_t k, uint8_t *buf, size_t within,
+              size_t len)
+{
+  uint64_t end = k + 1 < gz->points ? gz->point[k + 1].out : gz->size;
+  size_t size = end - gz->point[k].out;
+  GzFrame *victim = &gz->frame[0];
+  uint8_t *data;
+  int x;
+
+  pthread_mutex_lock(&gz->lock);
+  for (x = 0; x < GZ_FRAMES; x++)
+    {
+      if (gz->frame[x].used != 0 && gz->frame[x].point == k)
+        {
+          gz->frame[x].used = ++gz->tick;
+          memcpy(buf, gz->frame[x].data + within, len);
+          pthread_mutex_unlock(&gz->lock);
+          STAT_ADD(gz_frame_hits, 1);
+          return 0;
+        }
+    }
+  pthread_mutex_unlock(&gz->lock);
+
+  /* Decoded without the lock, so other frames can be read meanwhile */
+  data = malloc(size);
+  if (data == NULL)
+    {
+      perror("unixtool: gzip malloc()");
+      return -1;
+    }
+
+  if (gz_frame_decode(gz, k, data, size) < 0)
+    {
+      free(data);
+      return -1;
+    }
+
+  memcpy(buf, data + within, len);
+  pthread_mutex_lock(&gz->lock);
+  for (x = 0; x < GZ_FRAMES; x++)
+    {
+      if (gz->frame[x].used != 0 && gz->frame[x].point == k)
+        {
+          /* Someone else decoded it too */
+          victim = NULL;
+          break;
+        }
+
+      if (gz->frame[x].used < victim->used)
+        {
+          victim = &gz->frame[x];
+        }
+    }
+
+  if (victim != NULL)
+    {
+      free(victim->data);
+      victim->data = data;
+      victim->point = k;
+      victim->used = ++gz->tick;
+      data = NULL;
+    }
+
+  pthread_mutex_unlock(&gz->lock);
+  free(data);
+  return 0;
+}
+
+/* READ UNCOMPRESSED BYTES (see disk_pread) */
+ssize_t
+gz_pread(GzIndex *gz, uint8_t *buf, size_t len, uint64_t offset)
+{
+  size_t done = 0;
+
+  if (offset >= gz->size)
+    {
+      return 0;
+    }
+
+  if (len > gz->size - offset)
+    {
+      len = gz->size - offset;
+    }
+
+  while (done < len)
+    {
+      uint64_t at = offset + done;
+      uint32_t lo = 0;
+      uint32_t hi = gz->points;
+      uint64_t end;
+      size_t chunk;
+
+      /* Last point at or before at */
+      while (hi - lo > 1)
+        {
+          uint32_t mid = lo + ( hi - lo ) / 2;
+          if (gz->point[mid].out <= at)
+            {
+              lo = mid;
+            }
+          else
+            {
+              hi = mid;
+            }
+        }
+
+      end = lo + 1 < gz->points ? gz->point[lo + 1].out : gz->size;
+      chunk = end - at < len - done ? end - at : len - done;
+      if (gz_frame_copy(gz, lo, buf + done, at - gz->point[lo].out, chunk) < 0)
+        {
+          errno = EIO;
+          return -1;
+        }
+
+      done += chunk;
+    }
+  return done;
+}
+
+#endif /* defined(UNIXTOOL_ZLIB) */
+
+/* READ IMAGE BYTES AT offset, AS pread() DOES */
+/*
+ * offset counts from the start of the filesystem (disk->base into the
+ * file).  Compressed images are decoded through the frame cache.
+ */
+ssize_t
+disk_pread(uint8_t *buf, size_t len, off_t offset)
+{
+#if defined(UNIXTOOL_ZLIB)
+  if (disk->gz != NULL)
+    {
+      return gz_pread(disk->gz, buf, len, offset + disk->base);
+    }
+#endif
+
+  return pread(disk->fd, buf, len, offset + disk->base);
+}
+
+/* BUFFER CACHE FOR THE pread() PATH */
+/*
+ * Mapped images are served by the kernel page cache; everything else
+ * keeps recently read metadata blocks (i-list, directories, indirect
+ * blocks) here.  The cache is set-associative: a block can only live in
+ * the BCACHE_WAYS lines of set (adr & (bcache_sets - 1)), and the least
+ * recently used line of the set is replaced.  Sets are guarded by
+ * BCACHE_LOCKS sharded mutexes, so extract workers can share it.
+ */
+#define BCACHE_WAYS 8
+#define BCACHE_LOCKS 16
+
+typedef struct rBufCacheLine
+{
+  uint64_t used;        /* SHARD TICK AT LAST USE, 0 = EMPTY */
+  uint32_t adr;         /* DISK BLOCK HELD */
+  uint32_t len;         /* VALID BYTES (SHORT AT END OF DEVICE) */
+  uint8_t data[1024];
+} BufCacheLine;
+
+typedef struct rBufCacheShard
+{
+  pthread_mutex_t lock; /* PROTECTS THE SETS OF THIS SHARD */
+  uint64_t tick;        /* USE CLOCK */
+  uint64_t hits;        /* LOOKUPS SATISFIED */
+  uint64_t misses;      /* LOOKUPS THAT WENT TO DISK */
+} BufCacheShard;
+
+long bcache_blocks = 4096;      /* Buffer cache size in blocks (--cache) */
+
+/* ALLOCATE BUFFER CACHE */
+/* A failure just leaves the cache off */
+void
+bcache_init(void)
+{
+  uint32_t sets = BCACHE_LOCKS;
+  int x = 0;
+
+  while ((long)sets * BCACHE_WAYS < bcache_blocks && sets < 0x1000000)
+    {
+      sets *= 2;
+    }
+
+  disk->bcache = calloc((size_t)sets * BCACHE_WAYS, sizeof ( BufCacheLine ));
+  disk->bcache_shard = calloc(BCACHE_LOCKS, sizeof ( BufCacheShard ));
+  if (disk->bcache == NULL || disk->bcache_shard == NULL)
+    {
+      free(disk->bcache);
+      free(disk->bcache_shard);
+      disk->bcache = NULL;
+      disk->bcache_shard = NULL;
+      return;
+    }
+
+  disk->bcache_sets = sets;
+  while (x < BCACHE_LOCKS)
+    {
+      pthread_mutex_init(&disk->bcache_shard[x++].lock, NULL);
+    }
+}
+
+/* READ DISK BLOCK THROUGH THE BUFFER CACHE */
+/* Same contract as pread() of one block into buf */
+ssize_t
+bcache_read(uint32_t adr, uint8_t *buf)
+{
+  uint32_t set = adr & ( disk->bcache_sets - 1 );
+  BufCacheShard *shard = &disk->bcache_shard[set % BCACHE_LOCKS];
+  BufCacheLine *line = &disk->bcache[(size_t)set * BCACHE_WAYS];
+  BufCacheLine *victim = line;
+  ssize_t io_res;
+  int x = 0;
+
+  pthread_mutex_lock(&shard->lock);
+  while (x < BCACHE_WAYS)
+    {
+      if (line[x].used != 0 && line[x].adr == adr)
+        {
+          /* Hit */
+          line[x].used = ++shard->tick;
+          shard->hits++;
+          memcpy(buf, line[x].data, line[x].len);
+          io_res = line[x].len;
+          pthread_mutex_unlock(&shard->lock);
+          return io_res;
+        }
+
+      x++;
+    }
+  shard->misses++;
+  pthread_mutex_unlock(&shard->lock);
+
+  do
+    {
+      io_res = disk_pread(buf, 1024, (off_t)adr * 0x400);
+      STAT_ADD(disk_reads, 1);
+    }
+  while (io_res < 0 && errno == EINTR);
+  if (io_res <= 0)
+    {
+      return io_res;
+    }
+
+  STAT_ADD(disk_read_bytes, io_res);
+
+  /* Fill the least recently used line, unless someone beat us to it */
+  pthread_mutex_lock(&shard->lock);
+  x = 0;
+  while (x < BCACHE_WAYS)
+    {
+      if (line[x].used != 0 && line[x].adr == adr)
+        {
+          victim = NULL;
+          break;
+        }
+
+      if (line[x].used < victim->used)
+        {
+          victim = &line[x];
+        }
+
+      x++;
+    }
+  if (victim != NULL)
+    {
+      victim->used = ++shard->tick;
+      victim->adr = adr;
+      victim->len = io_res;
+      memcpy(victim->data, buf, io_res);
+    }
+
+  pthread_mutex_unlock(&shard->lock);
+  return io_res;
+}
+
+/* BUFFER CACHE TOTALS */
+void
+bcache_counts(uint64_t *hits, uint64_t *misses)
+{
+  int x = 0;
+
+  *hits = *misses = 0;
+  while (x < BCACHE_LOCKS && disk->bcache != NULL)
+    {
+      pthread_mutex_lock(&disk->bcache_shard[x].lock);
+      *hits += disk->bcache_shard[x].hits;
+      *misses += disk->bcache_shard[x].misses;
+      pthread_mutex_unlock(&disk->bcache_shard[x].lock);
+      x++;
+    }
+}
+
+/* REPORT BUFFER CACHE EFFECTIVENESS AT EXIT (-v) */
+void
+bcache_report(void)
+{
+  uint64_t hits;
+  uint64_t misses;
+
+  if (disk->bcache == NULL)
+    {
+      return;
+    }
+
+  bcache_counts(&hits, &misses);
+  fflush(stdout);
+  fprintf(
+    stderr,
+    "buffer cache: %u blocks, %llu hits, %llu misses\n",
+    disk->bcache_sets * BCACHE_WAYS,
+    (unsigned long long)hits,
+    (unsigned long long)misses);
+}
+
+/* PRINT --stats REPORT AT EXIT */
+/* On stderr, so it stays out of tar and cat output */
+void
+stats_report(void)
+{
+  uint64_t bhits = 0;
+  uint64_t bmisses = 0;
+  double total = ( stats_clock() - stats_start ) / 1e9;
+  int x = 0;
+
+  bcache_counts(&bhits, &bmisses);
+  fflush(stdout);
+  if (stats_enabled == 2)
+    {
+      fprintf(stderr, "{\"seconds\": {\"total\": %.6f", total);
+      while (x < PHASE_COUNT)
+        {
+          fprintf(stderr, ", \"%s\": %.6f", phase_name[x],
+                  stats.phase_ns[x] / 1e9);
+          x++;
+        }
+      fprintf(
+        stderr,
+        "},\n \"disk\": {\"block_reads\": %llu, \"reads\": %llu, \"bytes\": %llu},\n",
+        (unsigned long long)stats.disk_block_reads,
+        (unsigned long long)stats.disk_reads,
+        (unsigned long long)stats.disk_read_bytes);
+      fprintf(
+        stderr,
+        " \"inodes\": {\"reads\": %llu, \"ilist_loads\": %llu},\n",
+        (unsigned long long)stats.inode_reads,
+        (unsigned long long)stats.ilist_loads);
+      fprintf(
+        stderr,
+        " \"block_reads\": {\"direct\": %llu, \"single\": %llu, \"double\": %llu, \"triple\": %llu},\n",
+        (unsigned long long)stats.block_reads[0],
+        (unsigned long long)stats.block_reads[1],
+        (unsigned long long)stats.block_reads[2],
+        (unsigned long long)stats.block_reads[3]);
+      fprintf(
+        stderr,
+        " \"indirect_reads\": {\"single\": %llu, \"double\": %llu, \"triple\": %llu},\n",
+        (unsigned long long)stats.indirect_reads[0],
+        (unsigned long long)stats.indirect_reads[1],
+        (unsigned long long)stats.indirect_reads[2]);
+      fprintf(
+        stderr,
+        " \"host\": {\"writes\": %llu, \"bytes\": %llu, \"hole_bytes\": %llu, "
+        "\"reserved_bytes\": %llu},\n",
+        (unsigned long long)stats.host_writes,
+        (unsigned long long)stats.host_write_bytes,
+        (unsigned long long)stats.host_hole_bytes,
+        (unsigned long long)stats.host_alloc_bytes);
+      if (disk != NULL && disk->gz != NULL)
+        {
+          fprintf(
+            stderr,
+            " \"gzip\": {\"frames_decoded\": %llu, \"frame_hits\": %llu, "
+            "\"bytes\": %llu},\n",
+            (unsigned long long)stats.gz_frames,
+            (unsigned long long)stats.gz_frame_hits,
+            (unsigned long long)stats.gz_read_bytes);
+        }
+
+      fprintf(
+        stderr,
+        " \"cache\": {\"buffer\": [%llu, %llu], \"block_map\": [%llu, %llu], "
+        "\"dir_index\": [%llu, %llu], \"path\": [%llu, %llu]}}\n",
+        (unsigned long long)bhits,
+        (unsigned long long)bmisses,
+        (unsigned long long)stats.map_hits,
+        (unsigned long long)stats.map_misses,
+        (unsigned long long)stats.dir_hits,
+        (unsigned long long)stats.dir_misses,
+        (unsigned long long)stats.path_hits,
+        (unsigned long long)stats.path_misses);
+      return;
+    }
+
+  fprintf(stderr, "time:      %.3f s total", total);
+  while (x < PHASE_COUNT)
+    {
+      fprintf(stderr, ", %s %.3f s", phase_name[x], stats.phase_ns[x] / 1e9);
+      x++;
+    }
+  fprintf(
+    stderr,
+    "\ndisk:      %llu block reads, %llu read calls, %llu bytes\n",
+    (unsigned long long)stats.disk_block_reads,
+    (unsigned long long)stats.disk_reads,
+    (unsigned long long)stats.disk_read_bytes);
+  fprintf(
+    stderr,
+    "inodes:    %llu reads, %llu i-list blocks decoded\n",
+    (unsigned long long)stats.inode_reads,
+    (unsigned long long)stats.ilist_loads);
+  fprintf(
+    stderr,
+    "blocks:    %llu direct, %llu single, %llu double, %llu triple\n",
+    (unsigned long long)stats.block_reads[0],
+    (unsigned long long)stats.block_reads[1],
+    (unsigned long long)stats.block_reads[2],
+    (unsigned long long)stats.block_reads[3]);
+  fprintf(
+    stderr,
+    "indirect:  %llu single, %llu double, %llu triple blocks read\n",
+    (unsigned long long)stats.indirect_reads[0],
+    (unsigned long long)stats.indirect_reads[1],
+    (unsigned long long)stats.indirect_reads[2]);
+  fprintf(
+    stderr,
+    "host:      %llu write calls, %llu bytes, %llu bytes of holes, "
+    "%llu reserved\n",
+    (unsigned long long)stats.host_writes,
+    (unsigned long long)stats.host_write_bytes,
+    (unsigned long long)stats.host_hole_bytes,
+    (unsigned long long)stats.host_alloc_bytes);
+  if (disk != NULL && disk->gz != NULL)
+    {
+      fprintf(
+        stderr,
+        "gzip:      %llu frames decoded, %llu reads from decoded frames, "
+        "%llu compressed bytes read\n",
+        (unsigned long long)stats.gz_frames,
+        (unsigned long long)stats.gz_frame_hits,
+        (unsigned long long)stats.gz_read_bytes);
+    }
+
+  fprintf(
+    stderr,
+    "caches:    buffer %llu/%llu, block map %llu/%llu, "
+    "dir index %llu/%llu, path %llu/%llu (hits/misses)\n",
+    (unsigned long long)bhits,
+    (unsigned long long)bmisses,
+    (unsigned long long)stats.map_hits,
+    (unsigned long long)stats.map_misses,
+    (unsigned long long)stats.dir_hits,
+    (unsigned long long)stats.dir_misses,
+    (unsigned long long)stats.path_hits,
+    (unsigned long long)stats.path_misses);
+}
+
+/* REPORT FAILED DISK CALL */
+/* glibc's perror() may itself change errno; keep the caller's */
+void
+disk_perror(const char *what)
+{
+  int error = errno;
+
+  perror(what);
+  errno = error;
+}
+
+/* OPEN BAND IMAGE */
+int
+disk_open(const char *fname)
+{
+  /* Open the image read-only and map it if we can */
+  struct stat st;
+
+  disk->fd = open(fname, O_RDONLY);
+  if (disk->fd < 0)
+    {
+      disk_perror("unixtool: disk open()");
+      return -1;
+    }
+
+  if (fstat(disk->fd, &st) < 0)
+    {
+      disk_perror("unixtool: disk fstat()");
+      return -1;
+    }
+
+  if (S_ISREG(st.st_mode) && st.st_size > 1)
+    {
+      /* gzip magic: read it in place (see gz_open) */
+      uint8_t magic[2];
+      if (pread(disk->fd, magic, 2, 0) == 2 && magic[0] == 0x1f
+          && magic[1] == 0x8b)
+        {
+#if defined(UNIXTOOL_ZLIB)
+          disk->gz = gz_open(disk->fd, &st);
+          if (disk->gz == NULL)
+            {
+              return -1;
+            }
+
+          disk->size = disk->gz->size;
+          bcache_init();
+          return 0;
+#else
+          printf("unixtool: %s: gzip'ed image; unixtool was built without "
+                 "zlib (make ZLIB=1)\n", fname);
+          return -1;
+#endif
+        }
+    }
+
+  if (S_ISREG(st.st_mode) && st.st_size > 0
+      && (uintmax_t)st.st_size <= (uintmax_t)SIZE_MAX)
+    {
+      /* Regular file: map the whole thing */
+      void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, disk->fd, 0);
+      if (map != MAP_FAILED)
+        {
+          disk->map = map;
+          disk->size = st.st_size;
+          return 0;
+        }
+    }
+  else if (lseek(disk->fd, 0, SEEK_CUR) < 0 && errno == ESPIPE)
+    {
+      /* Pipe or socket: no pread() either, so buffer the whole stream */
+      size_t alloc = 0;
+      ssize_t io_res;
+
+      do
+        {
+          if ((size_t)disk->size == alloc)
+            {
+              uint8_t *grown;
+              alloc = alloc ? alloc * 2 : 0x100000;
+              grown = realloc(disk->map, alloc);
+              if (grown == NULL)
+                {
+                  disk_perror("unixtool: disk realloc()");
+                  return -1;
+                }
+
+              disk->map = grown;
+            }
+
+          io_res = read(disk->fd, disk->map + disk->size, alloc - disk->size);
+          if (io_res < 0)
+            {
+              if (errno == EINTR)
+                {
+                  continue;
+                }
+
+              disk_perror("unixtool: disk read()");
+              return -1;
+            }
+
+          disk->size += io_res;
+        }
+      while (io_res > 0);
+      disk->map_owned = 1;
+    }
+
+  /* Otherwise (devices, or mmap() refused) we stay on the pread() path */
+  if (disk->map == NULL)
+    {
+      bcache_init();
+    }
+
+  return 0;
+}
+
+/* GET POINTER TO IMAGE BYTES */
+/*
+ * Points *ptr at up to len bytes of the image at offset.  With a mapped
+ * image this is a pointer into the mapping and buf is not touched;
+ * otherwise the bytes are pread() into buf.  Returns the number of bytes
+ * available (short at end of image, 0 past it) or -1 on error.
+ */
+ssize_t
+disk_ptr(off_t offset, size_t len, uint8_t *buf, const uint8_t **ptr)
+{
+  ssize_t io_res;
+
+  if (disk->map != NULL)
+    {
+      if (offset >= disk->size)
+        {
+          return 0;
+        }
+
+      if ((off_t)len > disk->size - offset)
+        {
+          len = disk->size - offset;
+        }
+
+      *ptr = disk->map + offset;
+      return len;
+    }
+
+  do
+    {
+      io_res = disk_pread(buf, len, offset);
+      STAT_ADD(disk_reads, 1);
+    }
+  while (io_res < 0 && errno == EINTR);
+  if (io_res < 0)
+    {
+      disk_perror("unixtool: disk pread()");
+      return -1;
+    }
+
+  STAT_ADD(disk_read_bytes, io_res);
+  *ptr = buf;
+  return io_res;
+}
+
+/* GET POINTER TO DISK BLOCK (see disk_ptr) */
+/* Unmapped images go through the buffer cache */
+int
+disk_block_ptr(int adr, uint8_t *buf, const uint8_t **ptr)
+{
+  if (disk->map == NULL && disk->bcache != NULL)
+    {
+      ssize_t io_res = bcache_read(adr, buf);
+      if (io_res < 0)
+        {
+          disk_perror("unixtool: disk pread()");
+          return -1;
+        }
+
+      *ptr = buf;
+      return io_res;
+    }
+
+  return disk_ptr((off_t)adr * 0x400, 1024, buf, ptr);
+}
+
+/* DECODE ON-DISK INODE */
+void
+decode_inode(int number, const InodeODR *raw_inode, Inode *inode)
+{
+  /* Read in inode particulars */
+  inode->number = number;
+  inode->mode = ( raw_inode->mode & 0xFF00 ) >> 8;
+  inode->mode |= (( raw_inode->mode & 0x000F ) << 8 );
+  inode->type = ( raw_inode->mode & 0x00F0 ) >> 4;
+  inode->nlink = swap_hword(raw_inode->nlink);
+  inode->uid = swap_hword(raw_inode->uid);
+  inode->gid = swap_hword(raw_inode->gid);
+  inode->size = swap_word(raw_inode->size);
+  inode->atime = swap_word(raw_inode->atime);
+  inode->mtime = swap_word(raw_inode->mtime);
+  inode->ctime = swap_word(raw_inode->ctime);
+  /*
+   * printf("inode %d: type %o mode %.5o owner %.6o:%.6o size %d\n",
+   *  number,inode->type,inode->mode,inode->uid,inode->gid,inode->size);
+   */
+
+   /* Read in block addresses */
+  unpack_addrs(raw_inode->addr, inode->addr);
+}
+
+/* DECODE A RUN OF ON-DISK INODES (an i-list block) */
+void
+decode_inodes(int first, const InodeODR *raw_inodes, Inode *inodes, int count)
+{
+  int x = 0;
+
+  while (x < count)
+    {
+      decode_inode(first + x, &raw_inodes[x], &inodes[x]);
+      x++;
+    }
+}
+
+/* DECODED I-LIST */
+/*
+ * Inode 1 starts i-list block 0 (disk block 2); each 1 KiB i-list block
+ * holds 16 inodes and is decoded in one go the first time any of them is
+ * asked for.
+ */
+/* SIZE THE INODE TABLE FROM THE SUPERBLOCK */
+int
+inode_table_init(void)
+{
+  int iblocks = swap_hword(disk->superblock->isize) - 2;
+
+  if (iblocks <= 0)
+    {
+      /* Nonsense i-list size; read_inode() goes to disk every time */
+      return 0;
+    }
+
+  if (iblocks > 4096)
+    {
+      /* Dirents can't name more than 65535 inodes */
+      iblocks = 4096;
+    }
+
+  disk->inode_table = calloc(iblocks * 16 + 1, sizeof ( Inode ));
+  disk->inode_table_loaded = calloc(iblocks, 1);
+  if (disk->inode_table == NULL || disk->inode_table_loaded == NULL)
+    {
+      perror("unixtool: inode table calloc()");
+      free(disk->inode_table);
+      free(disk->inode_table_loaded);
+      disk->inode_table = NULL;
+      disk->inode_table_loaded = NULL;
+      return -1;
+    }
+
+  disk->inode_count = iblocks * 16;
+  return 0;
+}
+
+/* DECODE ONE I-LIST BLOCK INTO THE TABLE */
+int
+inode_table_load(int iblock)
+{
+  InodeODR raw_buffer[16];
+  const InodeODR *raw_inodes;
+  int rv;
+
+  rv = disk_block_ptr(
+    2 + iblock,
+    (uint8_t *)raw_buffer,
+    (const uint8_t **)&raw_inodes);
+  if (rv < 0)
+    {
+      return rv;
+    }
+
+  if (rv < 1024)
+    {
+      printf("read_inode(): i-list block %d is beyond the end of the image\n",
+             iblock);
+      return -1;
+    }
+
+  decode_inodes(iblock * 16 + 1, raw_inodes, &disk->inode_table[iblock * 16 + 1], 16);
+  disk->inode_table_loaded[iblock] = 1;
+  STAT_ADD(ilist_loads, 1);
+  return 0;
+}
+
+/* READ INODE */
+int
+read_inode(int number, Inode *inode)
+{
+  /* Read the given inode */
+  ssize_t io_res;
+  off_t inode_disk_offset = 0x7C0;
+  InodeODR raw_buffer;
+  const InodeODR *raw_inode;
+
+  STAT_ADD(inode_reads, 1);
+  if (number > 0 && number <= disk->inode_count)
+    {
+      /* From the decoded table */
+      int iblock = ( number - 1 ) / 16;
+      if (!disk->inode_table_loaded[iblock] && inode_table_load(iblock) < 0)
+        {
+          return -1;
+        }
+
+      *inode = disk->inode_table[number];
+      return 0;
+    }
+
+  inode_disk_offset += ( (off_t)number * 0x40 );
+  /* printf("read_inode(%d): diskaddr 0x%.8llx\n",number,inode_disk_offset); */
+  io_res = disk_ptr(
+    inode_disk_offset,
+    0x40,
+    (uint8_t *)&raw_buffer,
+    (const uint8_t **)&raw_inode);
+  if (io_res < 0)
+    {
+      /* Read error! */
+      return -1;
+    }
+
+  if (io_res < 0x40)
+    {
+      printf("read_inode(): inode %d is beyond the end of the image\n", number);
+      return -1;
+    }
+
+  decode_inode(number, raw_inode, inode);
+  /* Done */
+  return 0;
+}
+
+int
+disk_block_read(int adr, uint8_t *buf)
+{
+  const uint8_t *ptr;
+  int io_res;
+
+  STAT_ADD(disk_block_reads, 1);
+  io_res = disk_block_ptr(adr, buf, &ptr);
+  if (io_res > 0 && ptr != buf)
+    {
+      /* Mapped; copy out of the image */
+      memcpy(buf, ptr, io_res);
+    }
+
+  return io_res;
+}
+
+/* READ len IMAGE BYTES AT offset INTO buf */
+int
+disk_range_read(off_t offset, size_t len, uint8_t *buf)
+{
+  while (len > 0)
+    {
+      const uint8_t *ptr;
+      ssize_t io_res = disk_ptr(offset, len, buf, &ptr);
+      if (io_res < 0)
+        {
+          return -1;
+        }
+
+      if (io_res == 0)
+        {
+          printf("unixtool: Unexpected end-of-file\n");
+          return -1;
+        }
+
+      if (ptr != buf)
+        {
+          memcpy(buf, ptr, io_res);
+        }
+
+      buf += io_res;
+      offset += io_res;
+      len -= io_res;
+    }
+  return 0;
+}
+
+/* HINT THAT A RUN OF DISK BLOCKS WILL BE READ SOON */
+void
+disk_prefetch(uint32_t adr, uint32_t count)
+{
+  off_t offset = (off_t)adr * 0x400;
+  off_t len = (off_t)count * 0x400;
+
+  if (disk->map != NULL)
+    {
+      /* madvise() wants a page-aligned start */
+      long page = sysconf(_SC_PAGESIZE);
+      off_t skew = (uintptr_t)( disk->map + offset ) % page;
+
+      if (disk->map_owned || offset >= disk->size)
+        {
+          return; /* Already in memory, or nothing there */
+        }
+
+      if (len > disk->size - offset)
+        {
+          len = disk->size - offset;
+        }
+
+      madvise(disk->map + offset - skew, len + skew, MADV_WILLNEED);
+      return;
+    }
+
+#if defined(POSIX_FADV_WILLNEED)
+  if (disk->gz == NULL)
+    {
+      posix_fadvise(disk->fd, offset + disk->base, len, POSIX_FADV_WILLNEED);
+    }
+#endif
+}
+
+/* WRITE WHOLE BUFFER TO HOST FD */
+int
+host_write(int fd, const uint8_t *buf, size_t len)
+{
+  while (len > 0)
+    {
+      ssize_t io_res = write(fd, buf, len);
+      STAT_ADD(host_writes, 1);
+      if (io_res < 0)
+        {
+          if (errno == EINTR)
+            {
+              continue;
+            }
+
+          perror("unixtool:write()");
+          return -1;
+        }
+
+      STAT_ADD(host_write_bytes, io_res);
+      buf += io_res;
+      len -= io_res;
+    }
+  return 0;
+}
+
+/* SKIP A HOLE OF len BYTES IN HOST FD */
+/*
+ * Leaves the host file sparse: seeks past the hole, extending the file so
+ * a trailing hole is kept, after punching out anything already there (as
+ * when reading over an existing file).  Falls back to writing zeros when
+ * fd can't seek or the punch is refused.
+ */
+int
+host_hole(int fd, size_t len)
+{
+  static const uint8_t zeros[0x10000];
+  off_t pos = lseek(fd, 0, SEEK_CUR);
+  struct stat st;
+
+  if (pos >= 0 && fstat(fd, &st) == 0 && S_ISREG(st.st_mode))
+    {
+      int sparse = 1;
+      if (pos < st.st_size)
+        {
+#if defined(FALLOC_FL_PUNCH_HOLE)
+          sparse = fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                             pos, len) == 0;
+#else
+          sparse = 0;
+#endif
+        }
+
+      if (sparse
+          && ( pos + (off_t)len <= st.st_size
+               || ftruncate(fd, pos + len) == 0 )
+          && lseek(fd, len, SEEK_CUR) >= 0)
+        {
+          STAT_ADD(host_hole_bytes, len);
+          return 0;
+        }
+    }
+
+  while (len > 0)
+    {
+      size_t chunk = len < sizeof ( zeros ) ? len : sizeof ( zeros );
+      if (host_write(fd, zeros, chunk) < 0)
+        {
+          return -1;
+        }
+
+      len -= chunk;
+    }
+  return 0;
+}
+
+/* CREATE (OR TRUNCATE) HOST FILE FOR A COPY */
+/*
+ * With --direct the file is opened O_DIRECT, unless the host filesystem
+ * refuses that.  Returns the fd, or -1 with errno set.
+ */
+int
+host_create(const char *path)
+{
+#if defined(O_DIRECT)
+  if (copy_direct)
+    {
+      int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT, 0660);
+      if (fd >= 0 || errno != EINVAL)
+        {
+          return fd;
+        }
+    }
+#endif
+  return open(path, O_WRONLY | O_CREAT | O_TRUNC, 0660);
+}
+
+/* IS HOST FD OPEN O_DIRECT? */
+int
+host_direct(int fd)
+{
+#if defined(O_DIRECT)
+  int flags = fcntl(fd, F_GETFL);
+  return flags >= 0 && ( flags & O_DIRECT ) != 0;
+#else
+  (void)fd;
+  return 0;
+#endif
+}
+
+/* GIVE HOST FILE THE MODE AND TIMES OF ITS INODE */
+/* Set-id and sticky bits are not carried over */
+int
+host_restore(int fd, const char *path, Inode *inode)
+{
+  struct timespec times[2];
+
+  times[0].tv_sec = inode->atime;
+  times[0].tv_nsec = 0;
+  times[1].tv_sec = inode->mtime;
+  times[1].tv_nsec = 0;
+  if (fd >= 0 ? fchmod(fd, inode->mode & 0777) < 0 || futimens(fd, times) < 0
+      : chmod(path, inode->mode & 0777) < 0
+      || utimensat(AT_FDCWD, path, times, 0) < 0)
+    {
+      printf("unixtool: %s: can't set mode and times: %s\n", path,
+             strerror(errno));
+      return -1;
+    }
+
+  return 0;
+}
+
+/* COPY A RANGE OF IMAGE BYTES TO HOST FD */
+/*
+ * Copies len bytes starting at image offset to the current position of
+ * fd.  Mapped images are written straight out of the mapping; otherwise
+ * copy_file_range() is tried, then sendfile() (which also takes pipes and
+ * sockets), then pread() through buf (buflen bytes).  When hashing, the
+ * bytes have to pass through buf, so the kernel copies are skipped.
+ */
+int
+disk_range_copy(int fd, off_t offset, size_t len, uint8_t *buf, size_t buflen)
+{
+  if (disk->map != NULL)
+    {
+      if (offset > disk->size || (off_t)len > disk->size - offset)
+        {
+          printf("unixtool: Unexpected end-of-file\n");
+          return -1;
+        }
+
+      copy_hash_data(disk->map + offset, len);
+      return host_write(fd, disk->map + offset, len);
+    }
+
+#if defined(__linux__)
+  /* The kernel copies take file offsets */
+  offset += disk->base;
+  while (len > 0 && copy_hash == NULL && disk->gz == NULL)
+    {
+      ssize_t io_res = copy_file_range(disk->fd, &offset, fd, NULL, len, 0);
+      STAT_ADD(disk_reads, 1);
+      if (io_res < 0 && errno == EINTR)
+        {
+          continue;
+        }
+
+      if (io_res <= 0)
+        {
+          /* Not supported between these files (or EOF); use pread() */
+          break;
+        }
+
+      STAT_ADD(disk_read_bytes, io_res);
+      STAT_ADD(host_write_bytes, io_res);
+      len -= io_res;
+    }
+
+  while (len > 0 && copy_hash == NULL && disk->gz == NULL)
+    {
+      ssize_t io_res = sendfile(fd, disk->fd, &offset, len);
+      STAT_ADD(disk_reads, 1);
+      if (io_res < 0 && errno == EINTR)
+        {
+          continue;
+        }
+
+      if (io_res <= 0)
+        {
+          break;
+        }
+
+      STAT_ADD(disk_read_bytes, io_res);
+      STAT_ADD(host_write_bytes, io_res);
+      len -= io_res;
+    }
+  offset -= disk->base;
+#endif
+
+  while (len > 0)
+    {
+      size_t chunk = len < buflen ? len : buflen;
+      ssize_t io_res = disk_pread(buf, chunk, offset);
+      STAT_ADD(disk_reads, 1);
+      if (io_res < 0)
+        {
+          if (errno == EINTR)
+            {
+              continue;
+            }
+
+          perror("unixtool: disk pread()");
+          return -1;
+        }
+
+      if (io_res == 0)
+        {
+          printf("unixtool: Unexpected end-of-file\n");
+          return -1;
+        }
+
+      STAT_ADD(disk_read_bytes, io_res);
+      copy_hash_data(buf, io_res);
+      if (host_write(fd, buf, io_res) < 0)
+        {
+          return -1;
+        }
+
+      offset += io_res;
+      len -= io_res;
+    }
+  return 0;
+}
+
+/* COPY A RUN OF CONTIGUOUS DISK BLOCKS TO HOST FD (see disk_range_copy) */
+int
+disk_extent_copy(int fd, uint32_t adr, size_t len, uint8_t *buf, size_t buflen)
+{
+  return disk_range_copy(fd, (off_t)adr * 0x400, len, buf, buflen);
+}
+
+/* RUN OF PHYSICALLY CONTIGUOUS BLOCKS */
+typedef struct rExtent
+{
+  uint32_t logical;   /* FIRST LOGICAL BLOCK */
+  uint32_t start;     /* FIRST PHYSICAL BLOCK (0 = UNALLOCATED) */
+  uint32_t length;    /* LENGTH IN BLOCKS */
+} Extent;
+
+/* LOGICAL-TO-PHYSICAL BLOCK MAP OF AN INODE */
+typedef struct rBlockMap
+{
+  int number;         /* INODE NUMBER (0 IF SLOT UNUSED) */
+  uint32_t size;      /* INODE SIZE WHEN MAP WAS BUILT */
+  uint32_t addr[13];  /* INODE ADDRESSES WHEN MAP WAS BUILT */
+  uint32_t nblocks;   /* NUMBER OF LOGICAL BLOCKS MAPPED */
+  uint32_t *block;    /* PHYSICAL BLOCK OF EACH LOGICAL BLOCK (0 = NONE) */
+  uint32_t nextents;  /* NUMBER OF EXTENTS */
+  Extent *extent;     /* BLOCKS COALESCED INTO CONTIGUOUS RUNS */
+} BlockMap;
+
+#define BLOCK_MAP_SLOTS 16 /* Recently used block maps kept per image */
+
+/* READ INDIRECT BLOCK */
+/* Decodes the first count entries of indirect block adr into out */
+int
+indirect_block_read(uint32_t adr, uint32_t *out, uint32_t count)
+{
+  uint32_t indirect_buffer[256];
+  const uint32_t *indirect_block;
+  int rv;
+
+  if (adr == 0)
+    {
+      /* Nothing allocated below this pointer */
+      memset(out, 0, count * sizeof ( uint32_t ));
+      return 0;
+    }
+
+  rv = disk_block_ptr(
+    adr,
+    (uint8_t *)indirect_buffer,
+    (const uint8_t **)&indirect_block);
+  if (rv < 0)
+    {
+      return rv;
+    }
+
+  if (rv < 1024)
+    {
+      printf("indirect_block_read(): Indirect block %u past end of image\n", adr);
+      return -1;
+    }
+
+  swap_words(indirect_block, out, count);
+  return 0;
+}
+
+/* RESOLVE BLOCKS BELOW AN INDIRECT BLOCK */
+/*
+ * Fills out[0..count-1] with the data blocks reached through indirect
+ * block adr, which has the given level of indirection (1 = single).
+ */
+int
+indirect_block_map(uint32_t adr, int level, uint32_t *out, uint32_t count)
+{
+  uint32_t entries[256];
+  uint32_t span = 1;
+  uint32_t x = 0;
+  int y = 1;
+
+  if (adr != 0)
+    {
+      STAT_ADD(indirect_reads[level - 1], 1);
+    }
+
+  if (level == 1)
+    {
+      return indirect_block_read(adr, out, count);
+    }
+
+  while (y < level)
+    {
+      span *= 256;
+      y++;
+    }
+
+  if (indirect_block_read(adr, entries, ( count + span - 1 ) / span) < 0)
+    {
+      return -1;
+    }
+
+  while (count > 0)
+    {
+      uint32_t part = count < span ? count : span;
+      if (indirect_block_map(entries[x], level - 1, out, part) < 0)
+        {
+          return -1;
+        }
+
+      out += part;
+      count -= part;
+      x++;
+    }
+  return 0;
+}
+
+/* FREE BLOCK MAP CONTENTS */
+void
+block_map_free(BlockMap *map)
+{
+  free(map->block);
+  free(map->extent);
+  memset(map, 0, sizeof ( BlockMap ));
+}
+
+/* METADATA INDEX (unixtool index) */
+/*
+ * A sidecar file, <image>.idx unless --index names another, holding what
+ * path lookup, listing and block mapping would otherwise read from the
+ * image: every decoded inode, each directory's entries, each file's
+ * extents and a sorted table of all paths.  "unixtool index" writes it;
+ * later runs mmap() it and serve metadata from it without touching the
+ * image.  It is in host byte order and is ignored unless this build wrote
+ * it for an image with the same superblock time, size and i-list size.
+ */
+#define INDEX_MAGIC "UTXINDEX"
+#define INDEX_VERSION 1
+#define INDEX_NONE 0xFFFFFFFF /* IndexSpan.first: not in the index */
+
+/* RUN OF RECORDS BELONGING TO ONE INODE */
+typedef struct rIndexSpan
+{
+  uint32_t first;     /* FIRST RECORD, INDEX_NONE IF NOT INDEXED */
+  uint32_t count;     /* NUMBER OF RECORDS */
+} IndexSpan;
+
+/* ONE PATH, AS namei() NORMALISES IT ("/a/b") */
+typedef struct rIndexPath
+{
+  uint32_t name;      /* OFFSET INTO THE NAME STRINGS */
+  uint32_t inode;     /* INODE NUMBER */
+} IndexPath;
+
+typedef struct rIndexHeader
+{
+  char magic[8];         /* INDEX_MAGIC */
+  uint32_t version;      /* INDEX_VERSION */
+  uint32_t layout;       /* sizeof ( Inode ), ( Extent ) AND ( DirEntry ) */
+  uint32_t sb_time;      /* SUPERBLOCK time, fsize AND isize, AS STORED */
+  uint32_t sb_fsize;
+  uint32_t sb_isize;
+  uint32_t ninodes;      /* INODES 0..ninodes-1 */
+  uint32_t nextents;
+  uint32_t ndirents;
+  uint32_t npaths;
+  uint32_t pad;
+  uint64_t inode_off;    /* Inode[ninodes] */
+  uint64_t map_off;      /* IndexSpan[ninodes] INTO THE EXTENTS */
+  uint64_t dir_off;      /* IndexSpan[ninodes] INTO THE DIRECTORY ENTRIES */
+  uint64_t extent_off;   /* Extent[nextents] */
+  uint64_t dirent_off;   /* DirEntry[ndirents] */
+  uint64_t path_off;     /* IndexPath[npaths], IN strcmp() ORDER */
+  uint64_t name_off;     /* NUL-TERMINATED PATH STRINGS */
+  uint64_t size;         /* SIZE OF THE WHOLE FILE */
+} IndexHeader;
+
+#define INDEX_LAYOUT \
+  (( sizeof ( Inode ) << 16 ) | ( sizeof ( Extent ) << 8 ) | sizeof ( DirEntry ))
+
+char *index_fname = NULL;              /* Index file (--index) */
+int index_disabled = 0;                /* Don't use one (--no-index) */
+
+/* INDEX FILE NAME FOR THE IMAGE (malloc()ed) */
+char *
+index_file_name(void)
+{
+  char *name;
+
+  if (index_fname != NULL)
+    {
+      return strdup(index_fname);
+    }
+
+  name = malloc(strlen(disk->fname) + 5);
+  if (name != NULL)
+    {
+      strcpy(name, disk->fname);
+      strcat(name, ".idx");
+    }
+
+  return name;
+}
+
+/* CHECK THAT SECTION [off, off + count * size) LIES IN THE INDEX */
+int
+index_section_ok(const IndexHeader *hdr, uint64_t off, uint64_t count,
+                 size_t size)
+{
+  return off % 8 == 0 && off <= hdr->size
+         && count <= ( hdr->size - off ) / size;
+}
+
+/* MAP INDEX FILE, IF THERE IS A CURRENT ONE */
+/*
+ * Called once the superblock and inode table are set up.  A missing index
+ * is not an error; a stale or damaged one is reported and ignored.  The
+ * decoded inodes become the inode table directly.
+ */
+void
+index_open(void)
+{
+  const IndexHeader *hdr;
+  struct stat st;
+  char *fname;
+  void *map;
+  int fd;
+
+  if (index_disabled || disk->inode_count == 0 || ( fname = index_file_name()) == NULL)
+    {
+      return;
+    }
+
+  fd = open(fname, O_RDONLY);
+  if (fd < 0)
+    {
+      free(fname);
+      return;
+    }
+
+  if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof ( IndexHeader )
+      || ( map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0))
+      == MAP_FAILED)
+    {
+      fprintf(stderr, "unixtool: %s: unreadable index ignored\n", fname);
+      close(fd);
+      free(fname);
+      return;
+    }
+
+  close(fd);
+  hdr = map;
+  if (memcmp(hdr->magic, INDEX_MAGIC, 8) != 0 || hdr->version != INDEX_VERSION
+      || hdr->layout != INDEX_LAYOUT || hdr->size != (uint64_t)st.st_size
+      || hdr->ninodes != (uint32_t)disk->inode_count + 1
+      || !index_section_ok(hdr, hdr->inode_off, hdr->ninodes, sizeof ( Inode ))
+      || !index_section_ok(hdr, hdr->map_off, hdr->ninodes, sizeof ( IndexSpan ))
+      || !index_section_ok(hdr, hdr->dir_off, hdr->ninodes, sizeof ( IndexSpan ))
+      || !index_section_ok(hdr, hdr->extent_off, hdr->nextents, sizeof ( Extent ))
+      || !index_section_ok(hdr, hdr->dirent_off, hdr->ndirents,
+                           sizeof ( DirEntry ))
+      || !index_section_ok(hdr, hdr->path_off, hdr->npaths, sizeof ( IndexPath ))
+      || hdr->name_off >= hdr->size || ((const char *)map )[hdr->size - 1] != 0)
+    {
+      fprintf(stderr, "unixtool: %s: not an index this version can use, "
+              "ignored\n", fname);
+      munmap(map, st.st_size);
+      free(fname);
+      return;
+    }
+
+  if (hdr->sb_time != disk->superblock->time || hdr->sb_fsize != disk->superblock->fsize
+      || hdr->sb_isize != disk->superblock->isize)
+    {
+      fprintf(stderr, "unixtool: %s: image has changed, index ignored "
+              "(rerun unixtool index)\n", fname);
+      munmap(map, st.st_size);
+      free(fname);
+      return;
+    }
+
+  TRACE(1, "index: using %s\n", fname);
+  free(fname);
+  disk->index = hdr;
+  disk->index_map = (const IndexSpan *)((const uint8_t *)map + hdr->map_off );
+  disk->index_dir = (const IndexSpan *)((const uint8_t *)map + hdr->dir_off );
+  disk->index_extent = (const Extent *)((const uint8_t *)map + hdr->extent_off );
+  disk->index_dirent = (const DirEntry *)((const uint8_t *)map + hdr->dirent_off );
+  disk->index_path = (const IndexPath *)((const uint8_t *)map + hdr->path_off );
+  disk->index_name = (const char *)map + hdr->name_off;
+
+  /* Never written through: inode_table_load() is only called for blocks
+   * not yet loaded, and now they all are */
+  free(disk->inode_table);
+  disk->inode_table = (Inode *)((uint8_t *)map + hdr->inode_off );
+  memset(disk->inode_table_loaded, 1, disk->inode_count / 16);
+}
+
+/* BLOCK MAP FROM THE INDEX */
+/* Returns 1 if map was filled, 0 if the inode isn't indexed, -1 on error */
+int
+index_block_map(Inode *inode, BlockMap *map)
+{
+  const IndexSpan *span;
+  const Inode *indexed;
+  uint32_t x = 0;
+
+  if (disk->index == NULL || inode->number <= 0
+      || (uint32_t)inode->number >= disk->index->ninodes)
+    {
+      return 0;
+    }
+
+  span = &disk->index_map[inode->number];
+  indexed = &disk->inode_table[inode->number];
+  if (span->first == INDEX_NONE || span->first > disk->index->nextents
+      || span->count > disk->index->nextents - span->first
+      || indexed->size != inode->size
+      || memcmp(indexed->addr, inode->addr, sizeof ( inode->addr )) != 0)
+    {
+      return 0;
+    }
+
+  map->nblocks = ( inode->size + 1023 ) / 1024;
+  map->nextents = span->count;
+  map->block = calloc(map->nblocks ? map->nblocks : 1, sizeof ( uint32_t ));
+  map->extent = malloc(( span->count ? span->count : 1 ) * sizeof ( Extent ));
+  if (map->block == NULL || map->extent == NULL)
+    {
+      perror("unixtool: block map malloc()");
+      block_map_free(map);
+      return -1;
+    }
+
+  memcpy(map->extent, &disk->index_extent[span->first], span->count * sizeof ( Extent ));
+  while (x < span->count)
+    {
+      const Extent *ext = &map->extent[x++];
+      uint32_t y = 0;
+      while (y < ext->length && ext->logical + y < map->nblocks)
+        {
+          map->block[ext->logical + y] = ext->start ? ext->start + y : 0;
+          y++;
+        }
+    }
+
+  map->number = inode->number;
+  map->size = inode->size;
+  memcpy(map->addr, inode->addr, sizeof ( map->addr ));
+  return 1;
+}
+
+/* DIRECTORY ENTRIES FROM THE INDEX (see dir_read) */
+/* Returns -2 if the directory isn't indexed */
+int
+index_dir_read(Inode *dir, DirEntry **entries)
+{
+  const IndexSpan *span;
+
+  if (disk->index == NULL || dir->number <= 0
+      || (uint32_t)dir->number >= disk->index->ninodes)
+    {
+      return -2;
+    }
+
+  span = &disk->index_dir[dir->number];
+  if (span->first == INDEX_NONE || span->first > disk->index->ndirents
+      || span->count > disk->index->ndirents - span->first)
+    {
+      return -2;
+    }
+
+  *entries = malloc(( span->count ? span->count : 1 ) * sizeof ( DirEntry ));
+  if (*entries == NULL)
+    {
+      perror("unixtool: directory malloc()");
+      return -1;
+    }
+
+  memcpy(*entries, &disk->index_dirent[span->first], span->count * sizeof ( DirEntry ));
+  return span->count;
+}
+
+/* FIND NORMALISED PATH IN THE INDEX */
+/* Returns the inode number, or 0 if not there */
+int
+index_path_find(const char *path)
+{
+  uint32_t low = 0;
+  uint32_t high;
+
+  if (disk->index == NULL)
+    {
+      return 0;
+    }
+
+  high = disk->index->npaths;
+  while (low < high)
+    {
+      uint32_t mid = low + ( high - low ) / 2;
+      const char *name = disk->index_name + disk->index_path[mid].name;
+      int cmp;
+
+      if (disk->index_path[mid].name >= disk->index->size - disk->index->name_off)
+        {
+          return 0; /* Damaged */
+        }
+
+      cmp = strcmp(path, name);
+
+      if (cmp == 0)
+        {
+          return disk->index_path[mid].inode;
+        }
+
+      if (cmp < 0)
+        {
+          high = mid;
+        }
+      else
+        {
+          low = mid + 1;
+        }
+    }
+  return 0;
+}
+
+/* BUILD BLOCK MAP FOR INODE */
+/* Fills an unused map; touches no shared state, so is safe from threads */
+int
+block_map_build(Inode *inode, BlockMap *map)
+{
+  uint32_t nblocks = ( inode->size + 1023 ) / 1024;
+  uint32_t span = 256;
+  uint32_t x = 0;
+  int level = 1;
+  uint64_t start = stats_clock();
+  int rv;
+
+  memset(map, 0, sizeof ( BlockMap ));
+  rv = index_block_map(inode, map);
+  if (rv != 0)
+    {
+      stats_phase(PHASE_MAP, start);
+      return rv < 0 ? -1 : 0;
+    }
+
+  map->block = calloc(nblocks ? nblocks : 1, sizeof ( uint32_t ));
+  if (map->block == NULL)
+    {
+      perror("unixtool: block map calloc()");
+      return -1;
+    }
+
+  /* Direct */
+  while (x < nblocks && x < 10)
+    {
+      map->block[x] = inode->addr[x];
+      x++;
+    }
+
+  /* Single, double and triple indirection through addr[10..12] */
+  while (x < nblocks && level <= 3)
+    {
+      uint32_t count = nblocks - x < span ? nblocks - x : span;
+      if (indirect_block_map(inode->addr[9 + level], level, &map->block[x], count)
+          < 0)
+        {
+          block_map_free(map);
+          return -1;
+        }
+
+      x += count;
+      span *= 256;
+      level++;
+    }
+
+  /* Coalesce into extents */
+  map->extent = malloc(( nblocks ? nblocks : 1 ) * sizeof ( Extent ));
+  if (map->extent == NULL)
+    {
+      perror("unixtool: block map malloc()");
+      block_map_free(map);
+      return -1;
+    }
+
+  x = 0;
+  while (x < nblocks)
+    {
+      Extent *ext = &map->extent[map->nextents];
+      ext->logical = x;
+      ext->start = map->block[x];
+      ext->length = 1;
+      x++;
+      while (x < nblocks
+             && (( ext->start == 0 && map->block[x] == 0 )
+                 || ( ext->start != 0 && map->block[x] == ext->start + ext->length )))
+        {
+          ext->length++;
+          x++;
+        }
+      map->nextents++;
+    }
+  if (map->nextents > 0 && map->nextents < nblocks)
+    {
+      /* Give back what the coalescing saved */
+      Extent *shrunk = realloc(map->extent, map->nextents * sizeof ( Extent ));
+      if (shrunk != NULL)
+        {
+          map->extent = shrunk;
+        }
+    }
+
+  map->number = inode->number;
+  map->size = inode->size;
+  memcpy(map->addr, inode->addr, sizeof ( map->addr ));
+  map->nblocks = nblocks;
+  TRACE(
+    2,
+    "block_map_build(%d): %u blocks in %u extents\n",
+    inode->number,
+    nblocks,
+    map->nextents);
+  stats_phase(PHASE_MAP, start);
+  return 0;
+}
+
+/* FETCH CACHED (OR BUILD) BLOCK MAP FOR INODE */
+BlockMap *
+inode_block_map(Inode *inode)
+{
+  BlockMap *map = &disk->block_map_cache[inode->number % BLOCK_MAP_SLOTS];
+
+  if (map->number == inode->number && map->size == inode->size
+      && memcmp(map->addr, inode->addr, sizeof ( map->addr )) == 0)
+    {
+      /* Cache hit */
+      STAT_ADD(map_hits, 1);
+      return map;
+    }
+
+  STAT_ADD(map_misses, 1);
+  block_map_free(map);
+  if (block_map_build(inode, map) < 0)
+    {
+      return NULL;
+    }
+
+  return map;
+}
+
+int
+inode_block_read(int adr, Inode *inode, uint8_t *buf)
+{
+  int block = 0;
+  BlockMap *map;
+
+  map = inode_block_map(inode);
+  if (map == NULL)
+    {
+      return -1;
+    }
+
+  if ((uint32_t)adr >= map->nblocks)
+    {
+      return 0; /* EOF */
+    }
+
+  /* Direct, single, double or triple indirect */
+  STAT_ADD(block_reads[adr < 10 ? 0 : adr < 266 ? 1 : adr < 65802 ? 2 : 3], 1);
+  block = map->block[adr];
+  if (block > 0)
+    {
+      TRACE(2, "inode_block_read(%d) => disk_block_read(%d)\n", adr, block);
+      return disk_block_read(block, buf);
+    }
+
+  /* Hole; reads as zeros */
+  memset(buf, 0, 1024);
+  return 1024;
+}
+
+/* HINT EXTENTS UP TO (NOT INCLUDING) upto AS SOON TO BE READ */
+/* *ahead tracks how far hints have gone; each hint is bounded in size */
+void
+copy_readahead(BlockMap *map, uint32_t *ahead, uint32_t upto)
+{
+  uint32_t limit = (uint32_t)( copy_depth * ( COPY_BUFFER_SIZE / 1024 ));
+
+  while (*ahead < upto && *ahead < map->nextents)
+    {
+      Extent *ext = &map->extent[( *ahead )++];
+      if (ext->start != 0)
+        {
+          disk_prefetch(ext->start, ext->length < limit ? ext->length : limit);
+        }
+    }
+}
+
+/* READ-AHEAD PIPELINE BETWEEN IMAGE AND HOST FILE */
+typedef struct rCopyPipe
+{
+  Inode *inode;          /* FILE BEING COPIED */
+  BlockMap *map;         /* ITS BLOCK MAP */
+  uint8_t **buf;         /* copy_depth BUFFERS OF COPY_BUFFER_SIZE */
+  size_t *len;           /* BYTES HELD IN EACH BUFFER */
+  uint8_t *hole;         /* NONZERO IF THE BUFFER STANDS FOR A HOLE OF len */
+  int head;              /* NEXT BUFFER THE READER FILLS */
+  int tail;              /* NEXT BUFFER THE WRITER DRAINS */
+  int count;             /* FILLED BUFFERS WAITING FOR THE WRITER */
+  int failed;            /* READER HIT AN ERROR */
+  int finished;          /* READER HAS NOTHING MORE TO POST */
+  int stop;              /* WRITER GAVE UP; READER SHOULD TOO */
+  Image *image;          /* IMAGE BEING READ */
+  pthread_mutex_t lock;  /* PROTECTS head..stop */
+  pthread_cond_t cond;   /* SIGNALS ANY CHANGE */
+} CopyPipe;
+
+/* READER STAGE: pread() EXTENTS INTO FREE BUFFERS */
+void *
+copy_pipe_reader(void *arg)
+{
+  CopyPipe *pipe = arg;
+  BlockMap *map = pipe->map;
+  uint32_t extent = 0;
+  uint32_t ahead = 0;
+  uint32_t x = 0;
+  int failed = 0;
+
+  disk = pipe->image;
+  while (!failed && extent < map->nextents && x < pipe->inode->size)
+    {
+      Extent *ext = &map->extent[extent];
+      size_t left = (size_t)ext->length * 1024;
+      off_t offset = (off_t)ext->start * 0x400;
+
+      if (( pipe->inode->size - x ) < left)
+        {
+          left = pipe->inode->size - x;
+        }
+
+      x += left;
+      copy_readahead(map, &ahead, extent + copy_depth + 1);
+      extent++;
+      while (!failed && left > 0)
+        {
+          /* A hole goes through as one empty buffer */
+          size_t chunk = left < COPY_BUFFER_SIZE || ext->start == 0
+                         ? left : COPY_BUFFER_SIZE;
+          size_t got = ext->start == 0 ? chunk : 0;
+          int slot;
+
+          pthread_mutex_lock(&pipe->lock);
+          while (pipe->count == copy_depth && !pipe->stop)
+            {
+              pthread_cond_wait(&pipe->cond, &pipe->lock);
+            }
+
+          slot = pipe->head;
+          failed = pipe->stop;
+          pthread_mutex_unlock(&pipe->lock);
+          while (!failed && got < chunk)
+            {
+              ssize_t io_res = disk_pread(pipe->buf[slot] + got, chunk - got,
+                                          offset + got);
+              STAT_ADD(disk_reads, 1);
+              if (io_res < 0 && errno == EINTR)
+                {
+                  continue;
+                }
+
+              if (io_res < 0)
+                {
+                  perror("unixtool: disk pread()");
+                  failed = 1;
+                }
+              else if (io_res == 0)
+                {
+                  printf("unixtool: Unexpected end-of-file\n");
+                  failed = 1;
+                }
+              else
+                {
+                  STAT_ADD(disk_read_bytes, io_res);
+                  got += io_res;
+                }
+            }
+
+          if (failed)
+            {
+              break;
+            }
+
+          pthread_mutex_lock(&pipe->lock);
+          pipe->len[slot] = chunk;
+          pipe->hole[slot] = ext->start == 0;
+          pipe->head = ( slot + 1 ) % copy_depth;
+          pipe->count++;
+          pthread_cond_signal(&pipe->cond);
+          pthread_mutex_unlock(&pipe->lock);
+          offset += chunk;
+          left -= chunk;
+        }
+    }
+
+  pthread_mutex_lock(&pipe->lock);
+  pipe->failed = failed;
+  pipe->finished = 1;
+  pthread_cond_signal(&pipe->cond);
+  pthread_mutex_unlock(&pipe->lock);
+  return NULL;
+}
+
+/* COPY INODE THROUGH THE READ-AHEAD PIPELINE */
+/*
+ * The reader stage keeps up to copy_depth buffers of reads in flight
+ * (plus kernel readahead hints further on) while this thread, the writer
+ * stage, drains completed buffers to fd, so image latency and host write
+ * latency overlap instead of adding up.  Returns 1 if the pipeline could
+ * not be set up (caller copies serially), 0 on success, -1 on error.
+ */
+int
+inode_copy_pipelined(Inode *inode, BlockMap *map, int fd)
+{
+  CopyPipe pipe;
+  pthread_t reader;
+  int rv = 0;
+  int x = 0;
+
+  memset(&pipe, 0, sizeof ( pipe ));
+  pipe.inode = inode;
+  pipe.map = map;
+  pipe.image = disk;
+  pipe.buf = calloc(copy_depth, sizeof ( uint8_t * ));
+  pipe.len = calloc(copy_depth, sizeof ( size_t ));
+  pipe.hole = calloc(copy_depth, 1);
+  while (pipe.buf != NULL && x < copy_depth
+         && ( pipe.buf[x] = malloc(COPY_BUFFER_SIZE)) != NULL)
+    {
+      x++;
+    }
+
+  if (pipe.len == NULL || pipe.hole == NULL || x < copy_depth)
+    {
+      rv = 1;
+      goto out;
+    }
+
+  pthread_mutex_init(&pipe.lock, NULL);
+  pthread_cond_init(&pipe.cond, NULL);
+  if (pthread_create(&reader, NULL, copy_pipe_reader, &pipe) != 0)
+    {
+      pthread_mutex_destroy(&pipe.lock);
+      pthread_cond_destroy(&pipe.cond);
+      rv = 1;
+      goto out;
+    }
+
+  for (;;)
+    {
+      int slot;
+
+      pthread_mutex_lock(&pipe.lock);
+      while (pipe.count == 0 && !pipe.finished)
+        {
+          pthread_cond_wait(&pipe.cond, &pipe.lock);
+        }
+
+      if (pipe.count == 0)
+        {
+          pthread_mutex_unlock(&pipe.lock);
+          break;
+        }
+
+      slot = pipe.tail;
+      pthread_mutex_unlock(&pipe.lock);
+      copy_hash_data(pipe.hole[slot] ? NULL : pipe.buf[slot], pipe.len[slot]);
+      if (( pipe.hole[slot] ? host_hole(fd, pipe.len[slot])
+            : host_write(fd, pipe.buf[slot], pipe.len[slot]))
+          < 0)
+        {
+          pthread_mutex_lock(&pipe.lock);
+          pipe.stop = 1;
+          pthread_cond_signal(&pipe.cond);
+          pthread_mutex_unlock(&pipe.lock);
+          rv = -1;
+          break;
+        }
+
+      pthread_mutex_lock(&pipe.lock);
+      pipe.tail = ( slot + 1 ) % copy_depth;
+      pipe.count--;
+      pthread_cond_signal(&pipe.cond);
+      pthread_mutex_unlock(&pipe.lock);
+    }
+
+  pthread_join(reader, NULL);
+  if (pipe.failed)
+    {
+      rv = -1;
+    }
+
+  pthread_mutex_destroy(&pipe.lock);
+  pthread_cond_destroy(&pipe.cond);
+out:
+  x = 0;
+  while (pipe.buf != NULL && x < copy_depth)
+    {
+      free(pipe.buf[x++]);
+    }
+  free(pipe.buf);
+  free(pipe.len);
+  free(pipe.hole);
+  return rv;
+}
+
+/* ALLOCATE A COPY BUFFER (COPY_BUFFER_SIZE, ALIGNED FOR O_DIRECT) */
+uint8_t *
+copy_buffer_alloc(void)
+{
+  void *buf = NULL;
+
+  if (posix_memalign(&buf, DIRECT_ALIGN, COPY_BUFFER_SIZE) != 0)
+    {
+      printf("unixtool: copy buffer allocation failed\n");
+      return NULL;
+    }
+
+  return buf;
+}
+
+/* RESERVE HOST SPACE FOR A COPY */
+/*
+ * Files without holes are given their full size as one allocation up
+ * front, so they don't fragment while the writes arrive.  Only the Linux
+ * call is used: posix_fallocate() would fall back to writing the whole
+ * file once over.  Failure is harmless; the writes allocate as usual.
+ */
+void
+host_prepare(int fd, Inode *inode, BlockMap *map)
+{
+#if defined(__linux__)
+  uint32_t x = 0;
+
+  while (x < map->nextents && map->extent[x].start != 0)
+    {
+      x++;
+    }
+
+  if (inode->size > 0 && x == map->nextents
+      && fallocate(fd, 0, 0, inode->size) == 0)
+    {
+      STAT_ADD(host_alloc_bytes, inode->size);
+    }
+#else
+  (void)fd;
+  (void)inode;
+  (void)map;
+#endif
+}
+
+/* COPY INODE CONTENTS TO HOST FD THROUGH buf */
+/*
+ * Extents are gathered into buf and written COPY_BUFFER_SIZE bytes at a
+ * time, so every write but the last is whole and buffer-aligned in the
+ * file.  For files in many small extents, and for O_DIRECT.  With
+ * O_DIRECT holes are written as zeros and the last write is padded to
+ * DIRECT_ALIGN, the file then being cut back to size; otherwise holes
+ * are left as holes.
+ */
+int
+inode_copy_gathered(Inode *inode, BlockMap *map, int fd, uint8_t *buf,
+                    int direct)
+{
+  uint32_t extent = 0; /* Extent index into source file */
+  uint32_t ahead = 0;  /* Extents hinted so far */
+  uint32_t x = 0;      /* Bytes copied so far */
+  size_t used = 0;     /* Bytes waiting in buf */
+
+  while (extent < map->nextents && x < inode->size)
+    {
+      Extent *ext = &map->extent[extent++];
+      off_t offset = (off_t)ext->start * 0x400;
+      size_t len = (size_t)ext->length * 1024;
+      if (( inode->size - x ) < len)
+        {
+          len = inode->size - x;
+        }
+
+      copy_readahead(map, &ahead, extent + copy_depth);
+      x += len;
+      if (ext->start == 0 && !direct)
+        {
+          copy_hash_data(NULL, len);
+          if (host_write(fd, buf, used) < 0 || host_hole(fd, len) < 0)
+            {
+              return -1;
+            }
+
+          used = 0;
+          continue;
+        }
+
+      while (len > 0)
+        {
+          size_t chunk = COPY_BUFFER_SIZE - used;
+          if (chunk > len)
+            {
+              chunk = len;
+            }
+
+          if (ext->start == 0)
+            {
+              memset(buf + used, 0, chunk);
+            }
+          else if (disk_range_read(offset, chunk, buf + used) < 0)
+            {
+              return -1;
+            }
+
+          copy_hash_data(buf + used, chunk);
+          used += chunk;
+          offset += chunk;
+          len -= chunk;
+          if (used == COPY_BUFFER_SIZE)
+            {
+              if (host_write(fd, buf, used) < 0)
+                {
+                  return -1;
+                }
+
+              used = 0;
+            }
+        }
+    }
+
+  if (direct && used % DIRECT_ALIGN != 0)
+    {
+      size_t padded = used + DIRECT_ALIGN - used % DIRECT_ALIGN;
+      memset(buf + used, 0, padded - used);
+      if (host_write(fd, buf, padded) < 0)
+        {
+          return -1;
+        }
+
+      if (ftruncate(fd, inode->size) < 0)
+        {
+          perror("unixtool: ftruncate()");
+          return -1;
+        }
+
+      return 0;
+    }
+
+  return host_write(fd, buf, used);
+}
+
+/* COPY INODE CONTENTS TO HOST FD */
+/*
+ * fd should be a new, empty file, whose space is reserved first.  One
+ * large copy per physically contiguous run of the block map; buf is a
+ * COPY_BUFFER_SIZE buffer from copy_buffer_alloc() for the pread()
+ * fallback.  Holes (zero block addresses) are left as holes in the host
+ * file.  O_DIRECT targets, and files whose extents would make small
+ * writes, are gathered through buf instead.  Large files on unmapped
+ * images go through the read-ahead pipeline; otherwise the next
+ * copy_depth extents are hinted to the kernel as each is copied.
+ */
+int
+inode_copy(Inode *inode, BlockMap *map, int fd, uint8_t *buf)
+{
+  uint32_t extent = 0; /* Extent index into source file */
+  uint32_t ahead = 0;  /* Extents hinted so far */
+  uint32_t x = 0;      /* Bytes copied so far */
+  int direct = host_direct(fd);
+
+  host_prepare(fd, inode, map);
+  if (direct
+      || ( map->nextents > 1
+           && inode->size / map->nextents < COPY_GATHER_EXTENT ))
+    {
+      return inode_copy_gathered(inode, map, fd, buf, direct);
+    }
+
+  if (disk->map == NULL && copy_depth > 1 && inode->size > COPY_BUFFER_SIZE)
+    {
+      int rv = inode_copy_pipelined(inode, map, fd);
+      if (rv <= 0)
+        {
+          return rv;
+        }
+    }
+
+  while (extent < map->nextents && x < inode->size)
+    {
+      Extent *ext = &map->extent[extent];
+      size_t osize = (size_t)ext->length * 1024;
+      if (( inode->size - x ) < osize)
+        {
+          osize = inode->size - x;
+        }
+
+      TRACE(
+        2,
+        "extent %u: logical %u => disk %u (%u blocks)\n",
+        extent,
+        ext->logical,
+        ext->start,
+        ext->length);
+      if (map->nextents > 1)
+        {
+          copy_readahead(map, &ahead, extent + copy_depth + 1);
+        }
+
+      if (ext->start == 0)
+        {
+          /* Hole */
+          copy_hash_data(NULL, osize);
+          if (host_hole(fd, osize) < 0)
+            {
+              return -1;
+            }
+        }
+      else if (disk_extent_copy(fd, ext->start, osize, buf, COPY_BUFFER_SIZE)
+               < 0)
+        {
+          return -1;
+        }
+
+      x += osize;
+      extent++;
+    }
+  return 0;
+}
+
+/* READ ALL ENTRIES OF A DIRECTORY */
+/*
+ * Returns the number of in-use entries (inode != 0) stored in a malloc()ed
+ * array at *entries, or -1 on error.  Entry names are copied out with a
+ * terminating NUL.  Uses the block map cache, so main thread only.
+ */
+int
+dir_read(Inode *dir, DirEntry **entries)
+{
+  uint8_t dir_buffer[1024];
+  uint32_t nslots = dir->size / sizeof ( Dirent );
+  uint32_t slot = 0;
+  int count = 0;
+  DirEntry *list;
+
+  *entries = NULL;
+  count = index_dir_read(dir, entries);
+  if (count != -2)
+    {
+      return count;
+    }
+
+  count = 0;
+  list = malloc(( nslots ? nslots : 1 ) * sizeof ( DirEntry ));
+  if (list == NULL)
+    {
+      perror("unixtool: directory malloc()");
+      return -1;
+    }
+
+  while (slot < nslots)
+    {
+      Dirent *dir_entry = (Dirent *)&dir_buffer;
+      int x = 0;
+      int rv = inode_block_read(slot / 64, dir, dir_buffer);
+      if (rv < 0)
+        {
+          free(list);
+          return rv;
+        }
+
+      if (rv == 0)
+        {
+          break;
+        } /* EOF, we are done */
+
+      while (x < rv / (int)sizeof ( Dirent ) && slot < nslots)
+        {
+          if (dir_entry->inode != 0)
+            {
+              list[count].inode = swap_hword(dir_entry->inode);
+              memcpy(list[count].name, dir_entry->name, 14);
+              list[count].name[14] = 0;
+              count++;
+            }
+
+          dir_entry++;
+          slot++;
+          x++;
+        }
+    }
+  *entries = list;
+  return count;
+}
+
+/* IS DIRECTORY ENTRY NAME USABLE AS A PATH COMPONENT? */
+/*
+ * Names come straight off the image; an empty one, or one with a '/' in
+ * it, would make walk (and host) paths point somewhere else entirely.
+ */
+int
+dir_name_valid(const char *name)
+{
+  return name[0] != 0 && strchr(name, '/') == NULL;
+}
+
+/* NAME-TO-INODE HASH INDEX OF ONE DIRECTORY */
+typedef struct rDirIndex
+{
+  int count;            /* NUMBER OF ENTRIES */
+  DirEntry *entry;      /* ENTRIES AS READ BY dir_read() */
+  uint32_t mask;        /* BUCKET COUNT - 1 (POWER OF TWO) */
+  int32_t *bucket;      /* ENTRY INDEX PER BUCKET, -1 = EMPTY */
+} DirIndex;
+
+
+/* HASH A DIRECTORY ENTRY NAME (FNV-1a, AT MOST 14 BYTES) */
+uint32_t
+dir_name_hash(const char *name)
+{
+  uint32_t hash = 2166136261u;
+  int x = 0;
+
+  while (x < 14 && name[x] != 0)
+    {
+      hash ^= (uint8_t)name[x++];
+      hash *= 16777619u;
+    }
+  return hash;
+}
+
+/* FETCH (OR BUILD) HASH INDEX FOR DIRECTORY */
+/* Built on first visit and kept for the run; main thread only */
+DirIndex *
+dir_index_get(Inode *dir)
+{
+  DirIndex *index;
+  uint32_t nbuckets = 16;
+  uint64_t start;
+  int x = 0;
+
+  if (dir->number <= 0 || dir->number > 0xFFFF)
+    {
+      return NULL;
+    }
+
+  if (disk->dir_index_cache == NULL)
+    {
+      disk->dir_index_cache = calloc(0x10000, sizeof ( DirIndex * ));
+      if (disk->dir_index_cache == NULL)
+        {
+          perror("unixtool: directory index calloc()");
+          return NULL;
+        }
+    }
+
+  if (disk->dir_index_cache[dir->number] != NULL)
+    {
+      STAT_ADD(dir_hits, 1);
+      return disk->dir_index_cache[dir->number];
+    }
+
+  STAT_ADD(dir_misses, 1);
+  start = stats_clock();
+  index = calloc(1, sizeof ( DirIndex ));
+  if (index == NULL)
+    {
+      perror("unixtool: directory index calloc()");
+      return NULL;
+    }
+
+  index->count = dir_read(dir, &index->entry);
+  if (index->count < 0)
+    {
+      free(index);
+      return NULL;
+    }
+
+  /* Keep the load factor at or under one half */
+  while (nbuckets < (uint32_t)index->count * 2)
+    {
+      nbuckets *= 2;
+    }
+
+  index->mask = nbuckets - 1;
+  index->bucket = malloc(nbuckets * sizeof ( int32_t ));
+  if (index->bucket == NULL)
+    {
+      perror("unixtool: directory index malloc()");
+      free(index->entry);
+      free(index);
+      return NULL;
+    }
+
+  memset(index->bucket, 0xFF, nbuckets * sizeof ( int32_t ));
+  while (x < index->count)
+    {
+      uint32_t slot = dir_name_hash(index->entry[x].name) & index->mask;
+      while (index->bucket[slot] >= 0)
+        {
+          slot = ( slot + 1 ) & index->mask;
+        }
+
+      index->bucket[slot] = x++;
+    }
+  TRACE(
+    2,
+    "dir_index_get(%d): %d entries in %u buckets\n",
+    dir->number,
+    index->count,
+    nbuckets);
+  disk->dir_index_cache[dir->number] = index;
+  stats_phase(PHASE_DIR, start);
+  return index;
+}
+
+/* LOOK UP NAME IN DIRECTORY */
+/* Returns the inode number, 0 if not present, or -1 on error */
+int
+dir_lookup(Inode *dir, const char *name)
+{
+  DirIndex *index;
+  uint32_t slot;
+
+  if (strlen(name) > 14)
+    {
+      /* Very funny. */
+      return 0;
+    }
+
+  index = dir_index_get(dir);
+  if (index == NULL)
+    {
+      return -1;
+    }
+
+  slot = dir_name_hash(name) & index->mask;
+  while (index->bucket[slot] >= 0)
+    {
+      DirEntry *ent = &index->entry[index->bucket[slot]];
+      if (strncmp(name, ent->name, 14) == 0)
+        {
+          return ent->inode;
+        }
+
+      slot = ( slot + 1 ) & index->mask;
+    }
+  return 0;
+}
+
+/* RESOLVED PATH PREFIX */
+typedef struct rPathCacheEntry
+{
+  char *path;   /* NORMALISED PATH ("/usr/lib"), NULL = EMPTY SLOT */
+  int number;   /* INODE NUMBER IT RESOLVED TO */
+} PathCacheEntry;
+
+
+/* HASH A PATH (FNV-1a) */
+uint32_t
+path_hash(const char *path, size_t len)
+{
+  uint32_t hash = 2166136261u;
+  size_t x = 0;
+
+  while (x < len)
+    {
+      hash ^= (uint8_t)path[x++];
+      hash *= 16777619u;
+    }
+  return hash;
+}
+
+/* FIND RESOLVED PREFIX (first len bytes of path) */
+/* Returns the inode number, or 0 if not cached */
+int
+path_cache_find(const char *path, size_t len)
+{
+  uint32_t slot;
+
+  if (disk->path_cache == NULL)
+    {
+      return 0;
+    }
+
+  slot = path_hash(path, len) & ( disk->path_cache_size - 1 );
+  while (disk->path_cache[slot].path != NULL)
+    {
+      if (strncmp(disk->path_cache[slot].path, path, len) == 0
+          && disk->path_cache[slot].path[len] == 0)
+        {
+          return disk->path_cache[slot].number;
+        }
+
+      slot = ( slot + 1 ) & ( disk->path_cache_size - 1 );
+    }
+  return 0;
+}
+
+/* REMEMBER RESOLVED PREFIX (first len bytes of path) */
+/* Failure to remember is not an error; the next lookup just walks */
+void
+path_cache_add(const char *path, size_t len, int number)
+{
+  uint32_t slot;
+  char *copy;
+
+  if (disk->path_cache_used * 2 >= disk->path_cache_size)
+    {
+      /* Grow, keeping the load factor at or under one half */
+      uint32_t size = disk->path_cache_size ? disk->path_cache_size * 2 : 256;
+      PathCacheEntry *grown = calloc(size, sizeof ( PathCacheEntry ));
+      uint32_t x = 0;
+      if (grown == NULL)
+        {
+          return;
+        }
+
+      while (x < disk->path_cache_size)
+        {
+          if (disk->path_cache[x].path != NULL)
+            {
+              slot = path_hash(disk->path_cache[x].path, strlen(disk->path_cache[x].path))
+                     & ( size - 1 );
+              while (grown[slot].path != NULL)
+                {
+                  slot = ( slot + 1 ) & ( size - 1 );
+                }
+
+              grown[slot] = disk->path_cache[x];
+            }
+
+          x++;
+        }
+      free(disk->path_cache);
+      disk->path_cache = grown;
+      disk->path_cache_size = size;
+    }
+
+  copy = malloc(len + 1);
+  if (copy == NULL)
+    {
+      return;
+    }
+
+  memcpy(copy, path, len);
+  copy[len] = 0;
+  slot = path_hash(path, len) & ( disk->path_cache_size - 1 );
+  while (disk->path_cache[slot].path != NULL)
+    {
+      slot = ( slot + 1 ) & ( disk->path_cache_size - 1 );
+    }
+
+  disk->path_cache[slot].path = copy;
+  disk->path_cache[slot].number = number;
+  disk->path_cache_used++;
+}
+
+/* RESOLVE IMAGE PATH TO INODE */
+/*
+ * Does not modify path.  Repeated slashes and a trailing slash are
+ * ignored.  The longest previously resolved prefix is taken from the path
+ * cache and only the remaining components are looked up, each new prefix
+ * being remembered in turn.  Uses the current image's caches, so callers
+ * serialise per image.  Returns the inode number and fills inode, or -1
+ * (with a message, errno set for a bad path) if the path does not resolve.
+ */
+int
+namei_walk(const char *path, Inode *inode)
+{
+  char norm[1024];
+  size_t len = 0;
+  size_t done = 0;
+  int number = 2;
+  const char *in = path;
+
+  if (path[0] != '/')
+    {
+      printf("unixtool: Invalid path\n");
+      errno = EINVAL;
+      return -1;
+    }
+
+  /* Normalise to "/a/b/c" ("" for the root) */
+  while (*in != 0)
+    {
+      while (*in == '/')
+        {
+          in++;
+        }
+
+      if (*in == 0)
+        {
+          break;
+        }
+
+      if (len + 1 >= sizeof ( norm ))
+        {
+          printf("unixtool: Invalid path\n");
+          errno = EINVAL;
+          return -1;
+        }
+
+      norm[len++] = '/';
+      while (*in != 0 && *in != '/' && len + 1 < sizeof ( norm ))
+        {
+          norm[len++] = *in++;
+        }
+    }
+  norm[len] = 0;
+
+  /* The whole path, if there's an index */
+  number = index_path_find(norm);
+  if (number > 0)
+    {
+      return read_inode(number, inode) < 0 ? -1 : number;
+    }
+
+  number = 2;
+
+  /* Longest cached prefix */
+  done = len;
+  while (done > 0)
+    {
+      int cached = path_cache_find(norm, done);
+      if (cached > 0)
+        {
+          TRACE(1, "namei: %.*s cached\n", (int)done, norm);
+          number = cached;
+          break;
+        }
+
+      while (norm[--done] != '/')
+        {
+          ;
+        }
+    }
+
+  if (len > 0 && done == len)
+    {
+      STAT_ADD(path_hits, 1);
+    }
+  else if (len > 0)
+    {
+      STAT_ADD(path_misses, 1);
+    }
+
+  if (read_inode(number, inode) < 0)
+    {
+      return -1;
+    }
+
+  /* Walk the rest */
+  while (done < len)
+    {
+      char pathpart[15];
+      size_t start = done + 1;
+      size_t end = start;
+
+      while (end < len && norm[end] != '/')
+        {
+          end++;
+        }
+
+      if (inode->type != INODE_FT_DIR)
+        {
+          if (!namei_quiet)
+            {
+              printf("unixtool: Not a directory (in image, path search).\n");
+            }
+
+          errno = ENOTDIR;
+          return -1;
+        }
+
+      if (end - start > 14)
+        {
+          /* Very funny. */
+          if (!namei_quiet)
+            {
+              printf("unixtool: No such file or directory (in image).\n");
+            }
+
+          errno = ENOENT;
+          return -1;
+        }
+
+      memcpy(pathpart, norm + start, end - start);
+      pathpart[end - start] = 0;
+      TRACE(1, "pathpart: %s\n", pathpart);
+      number = dir_lookup(inode, pathpart);
+      if (number < 0)
+        {
+          return -1;
+        }
+
+      if (number == 0)
+        {
+          if (!namei_quiet)
+            {
+              printf(
+                "unixtool: No such file or directory (in image, path "
+                "search).\n");
+            }
+
+          errno = ENOENT;
+          return -1;
+        }
+
+      if (read_inode(number, inode) < 0)
+        {
+          return -1;
+        }
+
+      path_cache_add(norm, end, number);
+      done = end;
+    }
+  return number;
+}
+
+/* RESOLVE PATH (see namei_walk), TIMED */
+int
+namei(const char *path, Inode *inode)
+{
+  uint64_t start = stats_clock();
+  int rv = namei_walk(path, inode);
+
+  stats_phase(PHASE_LOOKUP, start);
+  return rv;
+}
+
+/* FILESYSTEMS AT AN OFFSET INTO THE FILE (--offset, --band, scan) */
+/*
+ * A whole-disk dump holds several bands, each a filesystem of its own.
+ * Every image access is relative to disk->base, so pointing base at a
+ * band serves it in place.  Bands are found by the superblock magic,
+ * looked for every SCAN_STRIDE bytes; each band found is stepped over
+ * whole (fsize blocks), so its contents are neither read nor taken for
+ * more superblocks.
+ */
+#define SCAN_STRIDE 512      /* Bands start on a sector */
+#define SCAN_WINDOW 0x400000 /* Bytes looked at per disk_ptr() */
+
+/* FILESYSTEM FOUND BY band_scan() */
+typedef struct rBand
+{
+  off_t offset;        /* START IN THE FILE; SUPERBLOCK IS BLOCK 1 */
+  int truncated;       /* fsize RUNS PAST THE END OF THE FILE */
+  SuperBlock sb;       /* ITS SUPERBLOCK, AS STORED */
+} Band;
+
+/* MOVE FILESYSTEM START TO base BYTES INTO THE FILE */
+int
+disk_base_set(off_t base)
+{
+  off_t delta = base - disk->base;
+
+  if (base < 0 || ( disk->size > 0 && delta >= disk->size ))
+    {
+      printf("unixtool: offset %lld is past the end of the image\n",
+             (long long)base);
+      return -1;
+    }
+
+  if (disk->map != NULL)
+    {
+      disk->map += delta;
+    }
+
+  if (disk->size > 0)
+    {
+      disk->size -= delta;
+    }
+
+  disk->base = base;
+  return 0;
+}
+
+/* DOES sb LOOK LIKE A SUPERBLOCK? */
+int
+band_superblock_ok(const SuperBlock *sb)
+{
+  uint32_t isize = swap_hword(sb->isize);
+  uint32_t fsize = swap_word(sb->fsize);
+
+  return sb->magic == 0x207E18FD && isize > 2 && isize < fsize
+         && swap_hword(sb->nfree) <= 50 && swap_hword(sb->ninode) <= 100;
+}
+
+/* FIND UP TO max FILESYSTEMS FROM THE CURRENT BASE ON */
+/*
+ * Offsets found are relative to the base.  *bands is malloc()ed for the
+ * caller to free; returns the number found, or -1.
+ */
+int
+band_scan(Band **bands, int max)
+{
+  uint8_t *buf = malloc(SCAN_WINDOW + 2048);
+  off_t window = 0;
+  off_t next = 0;     /* Next candidate start */
+  int alloc = 0;
+  int count = 0;
+
+  *bands = NULL;
+  if (buf == NULL)
+    {
+      perror("unixtool: scan malloc()");
+      return -1;
+    }
+
+  while (count < max)
+    {
+      const uint8_t *ptr;
+      ssize_t got;
+      size_t at;
+
+      /* Each window covers candidates [window, window + SCAN_WINDOW) */
+      window = next - next % SCAN_WINDOW;
+      disk_prefetch(( window + SCAN_WINDOW ) / 0x400, SCAN_WINDOW / 0x400);
+      got = disk_ptr(window, SCAN_WINDOW + 2048, buf, &ptr);
+      if (got < 0)
+        {
+          free(buf);
+          free(*bands);
+          *bands = NULL;
+          return -1;
+        }
+
+      if (got < 2048)
+        {
+          break;
+        }
+
+      at = next - window;
+      while (at + 2048 <= (size_t)got && at < SCAN_WINDOW)
+        {
+          const SuperBlock *sb = (const SuperBlock *)( ptr + at + 1024 );
+          uint32_t magic;
+
+          memcpy(&magic, ptr + at + 1024 + offsetof(SuperBlock, magic), 4);
+          if (magic != 0x207E18FD)
+            {
+              at += SCAN_STRIDE;
+              continue;
+            }
+
+          if (!band_superblock_ok(sb))
+            {
+              TRACE(1, "scan: magic at %lld, but not a superblock\n",
+                    (long long)( window + at + 1024 ));
+              at += SCAN_STRIDE;
+              continue;
+            }
+
+          if (count == alloc)
+            {
+              Band *grown;
+              alloc = alloc ? alloc * 2 : 8;
+              grown = realloc(*bands, alloc * sizeof ( Band ));
+              if (grown == NULL)
+                {
+                  perror("unixtool: scan realloc()");
+                  free(buf);
+                  free(*bands);
+                  *bands = NULL;
+                  return -1;
+                }
+
+              *bands = grown;
+            }
+
+          memcpy(&( *bands )[count].sb, sb, sizeof ( SuperBlock ));
+          ( *bands )[count].offset = window + at;
+          ( *bands )[count].truncated = disk->size > 0
+            && (off_t)swap_word(sb->fsize) * 0x400 > disk->size - ( window + at );
+          if (( *bands )[count].truncated)
+            {
+              /* Keep looking inside it; the dump may have been cut short */
+              at += SCAN_STRIDE;
+            }
+          else
+            {
+              at += (size_t)swap_word(sb->fsize) * 0x400;
+              at += ( SCAN_STRIDE - at % SCAN_STRIDE ) % SCAN_STRIDE;
+            }
+
+          count++;
+          if (count == max)
+            {
+              break;
+            }
+        }
+
+      next = window + at;
+      if (at < SCAN_WINDOW && at + 2048 > (size_t)got)
+        {
+          /* End of the image */
+          break;
+        }
+    }
+  free(buf);
+  return count;
+}
+
+/* SET BASE FROM --offset AND --band */
+int
+disk_band_select(void)
+{
+  Band *bands = NULL;
+  int count;
+
+  if (image_offset != 0 && disk_base_set(image_offset) < 0)
+    {
+      return -1;
+    }
+
+  if (image_band < 0)
+    {
+      return 0;
+    }
+
+  count = band_scan(&bands, image_band + 1);
+  if (count < 0)
+    {
+      return -1;
+    }
+
+  if (count <= image_band)
+    {
+      printf("unixtool: band %ld not found (%d in image)\n", image_band,
+             count);
+      free(bands);
+      return -1;
+    }
+
+  TRACE(1, "band %ld at %lld\n", image_band,
+        (long long)( disk->base + bands[image_band].offset ));
+  count = disk_base_set(disk->base + bands[image_band].offset);
+  free(bands);
+  return count;
+}
+
+/* CLOSE BAND IMAGE, FREEING EVERYTHING IT HOLDS */
+void
+image_close(Image *image)
+{
+  Image *prev = disk;
+  uint32_t x = 0;
+
+  if (image == NULL)
+    {
+      return;
+    }
+
+  disk = image;
+  while (image->block_map_cache != NULL && x < BLOCK_MAP_SLOTS)
+    {
+      block_map_free(&image->block_map_cache[x++]);
+    }
+
+  x = 0;
+  while (image->dir_index_cache != NULL && x < 0x10000)
+    {
+      DirIndex *index = image->dir_index_cache[x++];
+      if (index != NULL)
+        {
+          free(index->entry);
+          free(index->bucket);
+          free(index);
+        }
+    }
+
+  x = 0;
+  while (x < image->path_cache_size)
+    {
+      free(image->path_cache[x++].path);
+    }
+
+  x = 0;
+  while (image->bcache_shard != NULL && x < BCACHE_LOCKS)
+    {
+      pthread_mutex_destroy(&image->bcache_shard[x++].lock);
+    }
+
+  if (image->index != NULL)
+    {
+      /* The inode table is part of the index */
+      munmap((void *)image->index, image->index->size);
+    }
+  else
+    {
+      free(image->inode_table);
+    }
+
+  /* map and size were moved up to base (see disk_base_set) */
+  if (image->map != NULL && image->map_owned)
+    {
+      free(image->map - image->base);
+    }
+  else if (image->map != NULL)
+    {
+      munmap(image->map - image->base, image->size + image->base);
+    }
+
+#if defined(UNIXTOOL_ZLIB)
+  gz_free(image->gz);
+#endif
+  if (image->fd >= 0)
+    {
+      close(image->fd);
+    }
+
+  free(image->block_map_cache);
+  free(image->dir_index_cache);
+  free(image->path_cache);
+  free(image->bcache);
+  free(image->bcache_shard);
+  free(image->inode_table_loaded);
+  free(image->fname);
+  pthread_mutex_destroy(&image->lock);
+  free(image);
+  disk = prev == image ? NULL : prev;
+}
+
+/* OPEN BAND IMAGE AND MAKE IT CURRENT */
+/*
+ * Opens the image, checks its superblock and sets up the inode table and
+ * any index.  The new image is left as disk; on failure (reported) NULL
+ * is returned, disk is unchanged and errno says why: that of the failing
+ * call, or EINVAL if the file opened but holds no usable filesystem.
+ */
+Image *
+image_open(const char *fname)
+{
+  Image *prev = disk;
+  Image *image = calloc(1, sizeof ( Image ));
+  int error = EINVAL; /* errno to fail with: not a filesystem, unless set */
+  int rv = -1;
+
+  if (image == NULL)
+    {
+      perror("unixtool: image calloc()");
+      return NULL;
+    }
+
+  image->fd = -1;
+  image->superblock = (SuperBlock *)image->superblock_buffer;
+  image->fname = strdup(fname);
+  image->block_map_cache = calloc(BLOCK_MAP_SLOTS, sizeof ( BlockMap ));
+  pthread_mutex_init(&image->lock, NULL);
+  disk = image;
+  if (image->fname == NULL || image->block_map_cache == NULL)
+    {
+      error = ENOMEM;
+      perror("unixtool: image calloc()");
+    }
+  else
+    {
+      errno = 0;
+      rv = disk_open(image->fname);
+      if (rv < 0 && errno != 0)
+        {
+          error = errno;
+        }
+    }
+
+  if (rv == 0 && image_raw)
+    {
+      return image;
+    }
+
+  if (rv == 0)
+    {
+      errno = 0;
+      rv = disk_band_select();
+      if (rv < 0 && errno != 0)
+        {
+          error = errno;
+        }
+    }
+
+  /* Read in and check superblock (a short read: not a filesystem) */
+  if (rv == 0)
+    {
+      errno = 0;
+      if (disk_block_read(1, disk->superblock_buffer) < 0)
+        {
+          rv = -1;
+          if (errno != 0)
+            {
+              error = errno;
+            }
+        }
+    }
+
+  if (rv == 0 && disk->superblock->magic != 0x207E18FD)
+    {
+      printf(
+        "unixtool: Bad superblock magic: Expected 0x207E18FD, got 0x%.8X\n",
+        disk->superblock->magic);
+      rv = -1;
+    }
+
+  if (rv == 0)
+    {
+      errno = 0;
+      rv = inode_table_init();
+      if (rv < 0 && errno == ENOMEM)
+        {
+          error = ENOMEM;
+        }
+    }
+
+  if (rv < 0)
+    {
+      /* Cleanup may clobber errno */
+      image_close(image);
+      disk = prev;
+      errno = error;
+      return NULL;
+    }
+
+  index_open();
+  return image;
+}
+
+/* "rwxrwxrwx" FOR EACH OF THE 512 PERMISSION VALUES */
+char ls_perm_table[512][9];
+int ls_perm_table_ready = 0;
+
+/* BUILD PERMISSION STRING TABLE */
+void
+ls_perm_table_init(void)
+{
+  int mode = 0;
+
+  while (mode < 512)
+    {
+      int bit = 0;
+      while (bit < 9)
+        {
+          ls_perm_table[mode][bit] =
+            ( mode & ( 0400 >> bit )) ? "rwx"[bit % 3] : '-';
+          bit++;
+        }
+      mode++;
+    }
+  ls_perm_table_ready = 1;
+}
+
+/* MEMOISED DATE STRING OF ONE LOCAL DAY */
+typedef struct rLsDate
+{
+  time_t start;   /* LOCAL MIDNIGHT STARTING THE DAY */
+  time_t end;     /* LOCAL MIDNIGHT ENDING IT (start == end: EMPTY) */
+  char text[32];  /* strftime() OUTPUT FOR THE DAY */
+} LsDate;
+
+#define LS_DATE_SLOTS 256
+LsDate ls_date_cache[LS_DATE_SLOTS];
+
+/* FORMAT MODIFICATION DATE */
+/* localtime()/strftime() run once per distinct local day, not per entry */
+const char *
+ls_date(time_t when)
+{
+  LsDate *slot = &ls_date_cache[(uint32_t)( when / 86400 ) % LS_DATE_SLOTS];
+  struct tm *modtime;
+  struct tm day;
+
+  if (when >= slot->start && when < slot->end)
+    {
+      return slot->text;
+    }
+
+  modtime = localtime(&when);
+  if (modtime == NULL)
+    {
+      printf("localtime() blew it!\n");
+      return NULL;
+    }
+
+  if (strftime(slot->text, 31, "%b %e  %Y", modtime) == 0)
+    {
+      printf("strftime() blew it!\n");
+      return NULL;
+    }
+
+  /* Remember the whole day, whatever DST does to its length */
+  day = *modtime;
+  day.tm_hour = day.tm_min = day.tm_sec = 0;
+  day.tm_isdst = -1;
+  slot->start = mktime(&day);
+  day.tm_mday++;
+  day.tm_hour = day.tm_min = day.tm_sec = 0;
+  day.tm_isdst = -1;
+  slot->end = mktime(&day);
+  if (slot->start == (time_t)-1 || slot->end == (time_t)-1
+      || when < slot->start || when >= slot->end)
+    {
+      /* Can't bound the day; don't let the slot match anything else */
+      slot->start = slot->end = when;
+      slot->end++;
+    }
+
+  return slot->text;
+}
+
+/* DECODE THE I-LIST BLOCKS HOLDING A SET OF INODES, IN DISK ORDER */
+int
+inode_table_prefetch(const DirEntry *entries, int count)
+{
+  uint8_t *wanted;
+  int iblocks = disk->inode_count / 16;
+  int x = 0;
+
+  if (disk->inode_count == 0)
+    {
+      return 0;
+    }
+
+  wanted = calloc(iblocks, 1);
+  if (wanted == NULL)
+    {
+      return 0; /* Just go inode by inode */
+    }
+
+  while (x < count)
+    {
+      int number = entries[x++].inode;
+      if (number > 0 && number <= disk->inode_count)
+        {
+          wanted[( number - 1 ) / 16] = 1;
+        }
+    }
+
+  x = 0;
+  while (x < iblocks)
+    {
+      if (wanted[x] && !disk->inode_table_loaded[x] && inode_table_load(x) < 0)
+        {
+          free(wanted);
+          return -1;
+        }
+
+      x++;
+    }
+  free(wanted);
+  return 0;
+}
+
+/* LISTING OUTPUT BUFFER */
+char ls_out[0x10000];
+size_t ls_out_used = 0;
+
+/* WRITE OUT BUFFERED LISTING */
+int
+ls_flush(void)
+{
+  int rv;
+
+  /* Anything printf()ed so far goes first */
+  fflush(stdout);
+  rv = host_write(STDOUT_FILENO, (uint8_t *)ls_out, ls_out_used);
+  ls_out_used = 0;
+  return rv;
+}
+
+/* APPEND RIGHT-ALIGNED NUMBER */
+char *
+ls_number(char *out, uint32_t value, unsigned base, int width, char pad)
+{
+  char digits[12];
+  int len = 0;
+
+  do
+    {
+      digits[len++] = "0123456789"[value % base];
+      value /= base;
+    }
+  while (value != 0);
+  while (width-- > len)
+    {
+      *out++ = pad;
+    }
+
+  while (len > 0)
+    {
+      *out++ = digits[--len];
+    }
+  return out;
+}
+
+/* PRINT ONE DIRECTORY LISTING */
+int
+ls_print_dir(const char *path, DirIndex *index)
+{
+  int x = 0;        /* index into directory */
+  int rv = 0;
+
+  if (!ls_perm_table_ready)
+    {
+      ls_perm_table_init();
+    }
+
+  if (inode_table_prefetch(index->entry, index->count) < 0)
+    {
+      return -1;
+    }
+
+  /* Print loaded directory */
+  printf("%s:\n", path);
+  while (x < index->count)
+    {
+      Inode file_inode;
+      DirEntry *ent = &index->entry[x++];
+      const char *modtime;
+      char *out;
+      size_t namelen = strlen(ent->name);
+
+      rv = read_inode(ent->inode, &file_inode);
+      if (rv < 0)
+        {
+          ls_flush();
+          return rv;
+        }
+
+      modtime = ls_date(file_inode.mtime);
+      if (modtime == NULL)
+        {
+          ls_flush();
+          return -1;
+        }
+
+      /* Longest line: 10 + 2 + 5 + 1 + 6 + 2 + 6 + 2 + 10 + 1 + 31 + 1 + 14 + 1 */
+      if (ls_out_used + 128 > sizeof ( ls_out ) && ls_flush() < 0)
+        {
+          return -1;
+        }
+
+      /* "%s  %2d %.6o  %.6o  %7d %s %s\n" */
+      out = ls_out + ls_out_used;
+      switch (file_inode.type)
+        {
+        case INODE_FT_DIR:
+          *out++ = 'd'; /* Directory */
+          break;
+        case INODE_FT_CHAR:
+          *out++ = 'c'; /* Char special */
+          break;
+        case INODE_FT_BLK:
+          *out++ = 'b'; /* Block special */
+          break;
+        case INODE_FT_FIFO:
+          *out++ = 'p'; /* FIFO */
+          break;
+        default:
+          *out++ = '-';
+          break;
+        }
+
+      memcpy(out, ls_perm_table[file_inode.mode & 0777], 9);
+      out += 9;
+      *out++ = ' ';
+      *out++ = ' ';
+      out = ls_number(out, file_inode.nlink, 10, 2, ' ');
+      *out++ = ' ';
+      out = ls_number(out, file_inode.uid, 8, 6, '0');
+      *out++ = ' ';
+      *out++ = ' ';
+      out = ls_number(out, file_inode.gid, 8, 6, '0');
+      *out++ = ' ';
+      *out++ = ' ';
+      out = ls_number(out, file_inode.size, 10, 7, ' ');
+      *out++ = ' ';
+      strcpy(out, modtime);
+      out += strlen(modtime);
+      *out++ = ' ';
+      memcpy(out, ent->name, namelen);
+      out += namelen;
+      *out++ = '\n';
+      ls_out_used = out - ls_out;
+    }
+  return ls_flush();
+}
+
+/* DIRECTORY WAITING TO BE WALKED */
+typedef struct rWalkDir
+{
+  int number;       /* INODE NUMBER */
+  uint32_t block;   /* FIRST DATA BLOCK (SORT KEY) */
+  char *path;       /* IMAGE PATH */
+} WalkDir;
+
+/* CALLED FOR EACH DIRECTORY WALKED, WITH ITS ENTRY INODES DECODED */
+typedef int (*WalkVisit)(const char *path, Inode *dir, DirIndex *index,
+                         void *ctx);
+
+/* ORDER DIRECTORIES BY WHERE THEIR BLOCKS ARE */
+int
+walk_dir_compare(const void *a, const void *b)
+{
+  const WalkDir *da = a;
+  const WalkDir *db = b;
+
+  if (da->block != db->block)
+    {
+      return da->block < db->block ? -1 : 1;
+    }
+
+  return da->number - db->number;
+}
+
+/* JOIN IMAGE DIRECTORY PATH AND ENTRY NAME */
+char *
+walk_path_join(const char *dir, const char *name)
+{
+  size_t dirlen = strcmp(dir, "/") == 0 ? 0 : strlen(dir);
+  char *path = malloc(dirlen + strlen(name) + 2);
+
+  if (path == NULL)
+    {
+      perror("unixtool: walk malloc()");
+      return NULL;
+    }
+
+  memcpy(path, dir, dirlen);
+  path[dirlen] = '/';
+  strcpy(path + dirlen + 1, name);
+  return path;
+}
+
+/* WALK DIRECTORY TREE BREADTH-FIRST */
+/*
+ * Each level of the tree is visited in order of the directories' first
+ * data block (then inode number), after hinting all of the level's
+ * directory blocks to the kernel, and each directory's entry inodes are
+ * decoded in i-list order before visit() sees them.  Reads of the
+ * directory blocks and the i-list therefore sweep forward through the
+ * image instead of seeking back and forth.  Errors in one directory are
+ * reported and the walk carries on; returns -1 if there were any.
+ * Subdirectories with unusable names (see dir_name_valid) are not
+ * entered; visit() still sees those entries, to report them.
+ */
+int
+tree_walk(const char *path, Inode *root, WalkVisit visit, void *ctx)
+{
+  uint8_t visited[65536 / 8];
+  WalkDir *level;
+  WalkDir *next = NULL;
+  size_t nlevel = 1;
+  size_t nnext = 0;
+  size_t anext = 0;
+  int rv = 0;
+
+  memset(visited, 0, sizeof ( visited ));
+  level = malloc(sizeof ( WalkDir ));
+  if (level == NULL)
+    {
+      perror("unixtool: walk malloc()");
+      return -1;
+    }
+
+  level[0].number = root->number;
+  level[0].block = root->addr[0];
+  level[0].path = strdup(path);
+  if (level[0].path == NULL)
+    {
+      perror("unixtool: walk strdup()");
+      free(level);
+      return -1;
+    }
+
+  visited[root->number / 8] |= 1 << ( root->number % 8 );
+  while (nlevel > 0)
+    {
+      size_t x = 0;
+
+      qsort(level, nlevel, sizeof ( WalkDir ), walk_dir_compare);
+      while (x < nlevel)
+        {
+          /* Prefetch the whole level's directory blocks */
+          Inode dir;
+          int y = 0;
+          if (read_inode(level[x++].number, &dir) == 0)
+            {
+              while (y < 10 && dir.addr[y] != 0)
+                {
+                  int run = 1;
+                  while (y + run < 10 && dir.addr[y + run] == dir.addr[y] + run)
+                    {
+                      run++;
+                    }
+
+                  disk_prefetch(dir.addr[y], run);
+                  y += run;
+                }
+            }
+        }
+
+      x = 0;
+      while (x < nlevel)
+        {
+          WalkDir *wd = &level[x++];
+          DirIndex *index;
+          Inode dir;
+          int y = 0;
+
+          if (read_inode(wd->number, &dir) < 0
+              || ( index = dir_index_get(&dir)) == NULL
+              || inode_table_prefetch(index->entry, index->count) < 0)
+            {
+              printf("unixtool: %s: unreadable directory\n", wd->path);
+              rv = -1;
+              free(wd->path);
+              continue;
+            }
+
+          if (visit(wd->path, &dir, index, ctx) < 0)
+            {
+              rv = -1;
+            }
+
+          /* Queue subdirectories for the next level */
+          while (y < index->count)
+            {
+              DirEntry *ent = &index->entry[y++];
+              Inode inode;
+
+              if (strcmp(ent->name, ".") == 0 || strcmp(ent->name, "..") == 0
+                  || !dir_name_valid(ent->name)
+                  || read_inode(ent->inode, &inode) < 0
+                  || inode.type != INODE_FT_DIR
+                  || ( visited[ent->inode / 8] & ( 1 << ( ent->inode % 8 ))))
+                {
+                  continue;
+                }
+
+              visited[ent->inode / 8] |= 1 << ( ent->inode % 8 );
+              if (nnext == anext)
+                {
+                  size_t alloc = anext ? anext * 2 : 64;
+                  WalkDir *grown = realloc(next, alloc * sizeof ( WalkDir ));
+                  if (grown == NULL)
+                    {
+                      perror("unixtool: walk realloc()");
+                      rv = -1;
+                      break;
+                    }
+
+                  next = grown;
+                  anext = alloc;
+                }
+
+              next[nnext].number = ent->inode;
+              next[nnext].block = inode.addr[0];
+              next[nnext].path = walk_path_join(wd->path, ent->name);
+              if (next[nnext].path == NULL)
+                {
+                  rv = -1;
+                  break;
+                }
+
+              nnext++;
+            }
+          free(wd->path);
+        }
+
+      /* Next level */
+      free(level);
+      level = next;
+      nlevel = nnext;
+      next = NULL;
+      nnext = anext = 0;
+    }
+  free(level);
+  return rv;
+}
+
+/* ls -R: LIST EACH DIRECTORY WALKED */
+int
+ls_visit(const char *path, Inode *dir, DirIndex *index, void *ctx)
+{
+  int *first = ctx;
+
+  (void)dir;
+  if (!*first)
+    {
+      printf("\n");
+    }
+
+  *first = 0;
+  return ls_print_dir(path, index);
+}
+
+int
+unix_ls(char *path)
+{
+  /* List the given path */
+  Inode dir_inode;
+  DirIndex *index;
+  int rv = 0;
+
+  rv = namei(path, &dir_inode);
+  if (rv < 0)
+    {
+      return rv;
+    }
+
+  if (dir_inode.type != INODE_FT_DIR)
+    {
+      printf("unixtool: ls: Not a directory (in image).\n");
+      return -1;
+    }
+
+  if (ls_recursive)
+    {
+      int first = 1;
+      return tree_walk(path, &dir_inode, ls_visit, &first);
+    }
+
+  index = dir_index_get(&dir_inode);
+  if (index == NULL)
+    {
+      return -1;
+    }
+
+  return ls_print_dir(path, index);
+}
+
+/* find FILTERS */
+typedef struct rFindFilter
+{
+  const char *name;   /* fnmatch() PATTERN FOR THE ENTRY NAME, OR NULL */
+  int type;           /* INODE_FT_* TO MATCH, OR 0 */
+  int size_cmp;       /* -1: SMALLER, 0: EXACTLY, 1: LARGER */
+  int64_t size;       /* SIZE TO COMPARE, OR -1 */
+} FindFilter;
+
+/* DOES INODE MATCH FILTERS? */
+int
+find_match(FindFilter *filter, const char *name, Inode *inode)
+{
+  if (filter->name != NULL && fnmatch(filter->name, name, 0) != 0)
+    {
+      return 0;
+    }
+
+  if (filter->type != 0 && inode->type != filter->type)
+    {
+      return 0;
+    }
+
+  if (filter->size >= 0)
+    {
+      if (( filter->size_cmp < 0 && inode->size >= filter->size )
+          || ( filter->size_cmp == 0 && inode->size != filter->size )
+          || ( filter->size_cmp > 0 && inode->size <= filter->size ))
+        {
+          return 0;
+        }
+    }
+
+  return 1;
+}
+
+/* APPEND LINE TO LISTING BUFFER */
+int
+ls_puts(const char *text, size_t len)
+{
+  if (ls_out_used + len + 1 > sizeof ( ls_out ) && ls_flush() < 0)
+    {
+      return -1;
+    }
+
+  if (len + 1 > sizeof ( ls_out ))
+    {
+      fflush(stdout);
+      return host_write(STDOUT_FILENO, (const uint8_t *)text, len)
+             | host_write(STDOUT_FILENO, (const uint8_t *)"\n", 1);
+    }
+
+  memcpy(ls_out + ls_out_used, text, len);
+  ls_out_used += len;
+  ls_out[ls_out_used++] = '\n';
+  return 0;
+}
+
+/* find: PRINT MATCHING ENTRIES OF EACH DIRECTORY WALKED */
+int
+find_visit(const char *path, Inode *dir, DirIndex *index, void *ctx)
+{
+  FindFilter *filter = ctx;
+  int x = 0;
+
+  (void)dir;
+  while (x < index->count)
+    {
+      DirEntry *ent = &index->entry[x++];
+      Inode inode;
+      char *full;
+
+      if (strcmp(ent->name, ".") == 0 || strcmp(ent->name, "..") == 0)
+        {
+          continue;
+        }
+
+      if (read_inode(ent->inode, &inode) < 0)
+        {
+          return -1;
+        }
+
+      if (!find_match(filter, ent->name, &inode))
+        {
+          continue;
+        }
+
+      full = walk_path_join(path, ent->name);
+      if (full == NULL || ls_puts(full, strlen(full)) < 0)
+        {
+          free(full);
+          return -1;
+        }
+
+      free(full);
+    }
+  return 0;
+}
+
+int
+unix_find(char *path, int argc, char *argv[])
+{
+  /* List paths under path matching the filters in argv */
+  FindFilter filter;
+  Inode inode;
+  char *base;
+  int x = 0;
+  int rv;
+
+  memset(&filter, 0, sizeof ( filter ));
+  filter.size = -1;
+  while (x < argc)
+    {
+      char *arg = argv[x++];
+      char *value = x < argc ? argv[x++] : NULL;
+      if (value == NULL)
+        {
+          printf("unixtool: find: %s: value required\n", arg);
+          return -1;
+        }
+
+      if (strcmp(arg, "-name") == 0)
+        {
+          filter.name = value;
+        }
+      else if (strcmp(arg, "-type") == 0)
+        {
+          const char *types = "fdcbp";
+          const int codes[] = { INODE_FT_FILE, INODE_FT_DIR, INODE_FT_CHAR,
+                                INODE_FT_BLK, INODE_FT_FIFO };
+          const char *found = value[1] == 0 ? strchr(types, value[0]) : NULL;
+          if (found == NULL || *found == 0)
+            {
+              printf("unixtool: find: -type: expected one of f, d, c, b, p\n");
+              return -1;
+            }
+
+          filter.type = codes[found - types];
+        }
+      else if (strcmp(arg, "-size") == 0)
+        {
+          char *end;
+          filter.size_cmp = value[0] == '+' ? 1 : value[0] == '-' ? -1 : 0;
+          filter.size = strtoll(value + ( filter.size_cmp != 0 ), &end, 10);
+          if (*end == 'k')
+            {
+              filter.size *= 1024;
+              end++;
+            }
+          else if (*end == 'M')
+            {
+              filter.size *= 1024 * 1024;
+              end++;
+            }
+
+          if (*end != 0 || end == value + ( filter.size_cmp != 0 )
+              || filter.size < 0)
+            {
+              printf("unixtool: find: -size: expected [+|-]N[k|M]\n");
+              return -1;
+            }
+        }
+      else
+        {
+          printf("unixtool: find: Unknown filter %s\n", arg);
+          return -1;
+        }
+    }
+
+  if (namei(path, &inode) < 0)
+    {
+      return -1;
+    }
+
+  /* The starting point is a candidate too */
+  while (strlen(path) > 1 && path[strlen(path) - 1] == '/')
+    {
+      path[strlen(path) - 1] = 0;
+    }
+
+  base = strrchr(path, '/') + 1;
+  if (find_match(&filter, *base ? base : "/", &inode)
+      && ls_puts(path, strlen(path)) < 0)
+    {
+      return -1;
+    }
+
+  rv = 0;
+  if (inode.type == INODE_FT_DIR)
+    {
+      rv = tree_walk(path, &inode, find_visit, &filter);
+    }
+
+  if (ls_flush() < 0)
+    {
+      return -1;
+    }
+
+  return rv;
+}
+
+/* CLAIM STDOUT FOR BINARY OUTPUT */
+/*
+ * Returns a private descriptor for what was stdout and points stdout at
+ * stderr, so messages printed along the way can't corrupt the stream.
+ */
+int
+stdout_claim(void)
+{
+  int fd;
+
+  fflush(stdout);
+  fd = dup(STDOUT_FILENO);
+  if (fd < 0)
+    {
+      perror("unixtool: dup()");
+      return -1;
+    }
+
+  if (dup2(STDERR_FILENO, STDOUT_FILENO) < 0)
+    {
+      perror("unixtool: dup2()");
+      close(fd);
+      return -1;
+    }
+
+  return fd;
+}
+
+/* ARCHIVE BEING STREAMED */
+typedef struct rTarOut
+{
+  int fd;             /* WHERE THE ARCHIVE GOES */
+  uint8_t *buf;       /* THE ONE REUSABLE OUTPUT BUFFER */
+  size_t used;        /* BYTES WAITING IN buf */
+  char **link_path;   /* FIRST MEMBER NAME PER MULTIPLY-LINKED INODE */
+  int members;        /* MEMBERS WRITTEN */
+  int errors;         /* ENTRIES THAT COULD NOT BE ARCHIVED */
+} TarOut;
+
+#define TAR_BUFFER_SIZE 0x100000
+
+/* WRITE OUT BUFFERED ARCHIVE BYTES */
+int
+tar_flush(TarOut *tar)
+{
+  int rv = host_write(tar->fd, tar->buf, tar->used);
+
+  tar->used = 0;
+  return rv;
+}
+
+/* APPEND BYTES (NULL: ZEROES) TO ARCHIVE */
+/* Large runs out of a mapped image bypass the buffer */
+int
+tar_put(TarOut *tar, const uint8_t *data, size_t len)
+{
+  if (data != NULL && len >= TAR_BUFFER_SIZE / 2)
+    {
+      if (tar_flush(tar) < 0)
+        {
+          return -1;
+        }
+
+      return host_write(tar->fd, data, len);
+    }
+
+  while (len > 0)
+    {
+      size_t chunk = TAR_BUFFER_SIZE - tar->used;
+      if (chunk > len)
+        {
+          chunk = len;
+        }
+
+      if (data != NULL)
+        {
+          memcpy(tar->buf + tar->used, data, chunk);
+          data += chunk;
+        }
+      else
+        {
+          memset(tar->buf + tar->used, 0, chunk);
+        }
+
+      tar->used += chunk;
+      len -= chunk;
+      if (tar->used == TAR_BUFFER_SIZE && tar_flush(tar) < 0)
+        {
+          return -1;
+        }
+    }
+  return 0;
+}
+
+/* APPEND FILE DATA STRAIGHT FROM THE BLOCK MAP */
+/*
+ * The header has already promised inode->size bytes, so if the image
+ * can't be read the rest of the member is filled with zeroes (and
+ * counted as an error) to keep the archive readable.  Returns -1 only
+ * if the archive itself can't be written.
+ */
+int
+tar_put_data(TarOut *tar, const char *path, Inode *inode)
+{
+  BlockMap *map = inode_block_map(inode);
+  uint32_t extent = 0;
+  uint32_t done = 0; /* Bytes of the member written */
+
+  while (map != NULL && extent < map->nextents && done < inode->size)
+    {
+      Extent *ext = &map->extent[extent++];
+      off_t offset = (off_t)ext->start * 0x400;
+      size_t len = (size_t)ext->length * 1024;
+
+      if (( inode->size - done ) < len)
+        {
+          len = inode->size - done;
+        }
+
+      if (ext->start == 0)
+        {
+          /* Unallocated blocks read as zeroes */
+          if (tar_put(tar, NULL, len) < 0)
+            {
+              return -1;
+            }
+
+          done += len;
+          continue;
+        }
+
+      if (disk->map != NULL)
+        {
+          if (offset > disk->size || (off_t)len > disk->size - offset)
+            {
+              printf("unixtool: Unexpected end-of-file\n");
+              break;
+            }
+
+          if (tar_put(tar, disk->map + offset, len) < 0)
+            {
+              return -1;
+            }
+
+          done += len;
+          continue;
+        }
+
+      while (len > 0)
+        {
+          /* pread() straight into the output buffer */
+          size_t chunk = TAR_BUFFER_SIZE - tar->used;
+          ssize_t io_res;
+          if (chunk > len)
+            {
+              chunk = len;
+            }
+
+          io_res = disk_pread(tar->buf + tar->used, chunk, offset);
+          STAT_ADD(disk_reads, 1);
+          if (io_res < 0 && errno == EINTR)
+            {
+              continue;
+            }
+
+          if (io_res < 0)
+            {
+              perror("unixtool: disk pread()");
+              break;
+            }
+
+          if (io_res == 0)
+            {
+              printf("unixtool: Unexpected end-of-file\n");
+              break;
+            }
+
+          STAT_ADD(disk_read_bytes, io_res);
+          tar->used += io_res;
+          done += io_res;
+          offset += io_res;
+          len -= io_res;
+          if (tar->used == TAR_BUFFER_SIZE && tar_flush(tar) < 0)
+            {
+              return -1;
+            }
+        }
+
+      if (len > 0)
+        {
+          break;
+        }
+    }
+
+  if (done < inode->size)
+    {
+      printf("unixtool: tar: %s: read failed, %u bytes zero-filled\n", path,
+             inode->size - done);
+      tar->errors++;
+    }
+
+  /* Rest of the member, then pad to the next 512-byte record */
+  return tar_put(tar, NULL,
+                 inode->size - done + ( 512 - inode->size % 512 ) % 512);
+}
+
+/* STORE OCTAL NUMBER IN HEADER FIELD (width INCLUDES THE NUL) */
+void
+tar_octal(char *field, int width, uint32_t value)
+{
+  field[--width] = 0;
+  while (width-- > 0)
+    {
+      field[width] = '0' + ( value & 7 );
+      value >>= 3;
+    }
+}
+
+/* APPEND MEMBER HEADER (AND DATA) FOR ONE INODE */
+/* path is the image path; the member name drops its leading slash */
+int
+tar_member(TarOut *tar, const char *path, Inode *inode)
+{
+  uint8_t header[512];
+  const char *name = path + 1;
+  size_t namelen = strlen(name);
+  char typeflag;
+  unsigned sum = 0;
+  int first_link = 0;
+  int x = 0;
+
+  switch (inode->type)
+    {
+    case INODE_FT_DIR:
+      typeflag = '5';
+      break;
+    case INODE_FT_CHAR:
+      typeflag = '3';
+      break;
+    case INODE_FT_BLK:
+      typeflag = '4';
+      break;
+    case INODE_FT_FIFO:
+      typeflag = '6';
+      break;
+    default:
+      typeflag = '0';
+      break;
+    }
+
+  memset(header, 0, sizeof ( header ));
+  if (typeflag == '0' && inode->nlink > 1 && tar->link_path != NULL)
+    {
+      /* Later names of a multiply-linked file become hard links */
+      if (tar->link_path[inode->number] != NULL)
+        {
+          typeflag = '1';
+          if (strlen(tar->link_path[inode->number]) > 100)
+            {
+              typeflag = '0'; /* Can't name the target; store it again */
+            }
+          else
+            {
+              memcpy(header + 157, tar->link_path[inode->number],
+                     strlen(tar->link_path[inode->number]));
+            }
+        }
+      else
+        {
+          first_link = 1;
+        }
+    }
+
+  /* name[100], or prefix[155] "/" name[100] */
+  if (typeflag == '5')
+    {
+      namelen++; /* Trailing slash */
+    }
+
+  if (namelen <= 100)
+    {
+      memcpy(header, name, strlen(name));
+    }
+  else
+    {
+      const char *split = name + namelen - 101;
+      split = strchr(split, '/');
+      if (split == NULL || split - name > 155 || split[1] == 0)
+        {
+          printf("unixtool: tar: %s: name too long for ustar, skipped\n", path);
+          tar->errors++;
+          return 0;
+        }
+
+      memcpy(header + 345, name, split - name);
+      memcpy(header, split + 1, strlen(split + 1));
+    }
+
+  if (typeflag == '5')
+    {
+      header[strlen((char *)header)] = '/';
+    }
+
+  tar_octal((char *)header + 100, 8, inode->mode & 07777);
+  tar_octal((char *)header + 108, 8, inode->uid);
+  tar_octal((char *)header + 116, 8, inode->gid);
+  tar_octal((char *)header + 124, 12, typeflag == '0' ? inode->size : 0);
+  tar_octal((char *)header + 136, 12, (uint32_t)inode->mtime);
+  header[156] = typeflag;
+  memcpy(header + 257, "ustar", 6);
+  memcpy(header + 263, "00", 2);
+  if (typeflag == '3' || typeflag == '4')
+    {
+      /* Device number lives in the first address */
+      tar_octal((char *)header + 329, 8, ( inode->addr[0] >> 8 ) & 0xFF);
+      tar_octal((char *)header + 337, 8, inode->addr[0] & 0xFF);
+    }
+
+  /* Checksum counts its own field as spaces */
+  memset(header + 148, ' ', 8);
+  while (x < 512)
+    {
+      sum += header[x++];
+    }
+
+  tar_octal((char *)header + 148, 7, sum);
+  if (tar_put(tar, header, sizeof ( header )) < 0)
+    {
+      return -1;
+    }
+
+  /* Recorded only once the member is there for later links to name */
+  if (first_link)
+    {
+      tar->link_path[inode->number] = strdup(name);
+    }
+
+  tar->members++;
+  if (typeflag == '0')
+    {
+      uint64_t start = stats_clock();
+      int rv = tar_put_data(tar, path, inode);
+      stats_phase(PHASE_COPY, start);
+      return rv;
+    }
+
+  return 0;
+}
+
+/* tar: ARCHIVE EACH DIRECTORY WALKED AND ITS NON-DIRECTORY ENTRIES */
+/* Subdirectories get their own visit (and so their header) later */
+int
+tar_visit(const char *path, Inode *dir, DirIndex *index, void *ctx)
+{
+  TarOut *tar = ctx;
+  int x = 0;
+
+  if (strcmp(path, "/") != 0 && tar_member(tar, path, dir) < 0)
+    {
+      return -1;
+    }
+
+  while (x < index->count)
+    {
+      DirEntry *ent = &index->entry[x++];
+      Inode inode;
+      char *full;
+      int rv;
+
+      if (strcmp(ent->name, ".") == 0 || strcmp(ent->name, "..") == 0)
+        {
+          continue;
+        }
+
+      if (!dir_name_valid(ent->name))
+        {
+          printf("unixtool: tar: %s: bad entry name \"%s\", skipped\n",
+                 path, ent->name);
+          tar->errors++;
+          continue;
+        }
+
+      if (read_inode(ent->inode, &inode) < 0)
+        {
+          return -1;
+        }
+
+      if (inode.type == INODE_FT_DIR)
+        {
+          continue;
+        }
+
+      full = walk_path_join(path, ent->name);
+      if (full == NULL)
+        {
+          return -1;
+        }
+
+      rv = tar_member(tar, full, &inode);
+      free(full);
+      if (rv < 0)
+        {
+          return -1;
+        }
+    }
+  return 0;
+}
+
+int
+unix_tar(char *path)
+{
+  /* Stream path (from image) to stdout as a ustar archive */
+  TarOut tar;
+  Inode inode;
+  int rv;
+  int x = 0;
+
+  if (isatty(STDOUT_FILENO))
+    {
+      printf("unixtool: tar: Refusing to write an archive to a terminal\n");
+      return -1;
+    }
+
+  memset(&tar, 0, sizeof ( tar ));
+  tar.fd = stdout_claim();
+  if (tar.fd < 0)
+    {
+      return -1;
+    }
+
+  tar.buf = malloc(TAR_BUFFER_SIZE);
+  tar.link_path = calloc(0x10000, sizeof ( char * ));
+  if (tar.buf == NULL || tar.link_path == NULL)
+    {
+      perror("unixtool: tar malloc()");
+      rv = -1;
+      goto done;
+    }
+
+  rv = namei(path, &inode);
+  if (rv >= 0)
+    {
+      while (strlen(path) > 1 && path[strlen(path) - 1] == '/')
+        {
+          path[strlen(path) - 1] = 0;
+        }
+
+      if (inode.type == INODE_FT_DIR)
+        {
+          rv = tree_walk(path, &inode, tar_visit, &tar);
+        }
+      else
+        {
+          rv = tar_member(&tar, path, &inode);
+        }
+    }
+
+  /* End of archive: two zero records, even after errors */
+  if (tar_put(&tar, NULL, 1024) < 0 || tar_flush(&tar) < 0)
+    {
+      rv = -1;
+    }
+
+  printf("unixtool: tar: %d members\n", tar.members);
+
+done:
+  while (tar.link_path != NULL && x < 0x10000)
+    {
+      free(tar.link_path[x++]);
+    }
+  free(tar.link_path);
+  free(tar.buf);
+  close(tar.fd);
+  if (rv < 0 || tar.errors > 0)
+    {
+      return -1;
+    }
+
+  return 0;
+}
+
+/* index: RECORDS GATHERED FOR THE INDEX FILE */
+typedef struct rIndexBuild
+{
+  IndexSpan *map;        /* Per inode: its extents */
+  IndexSpan *dir;        /* Per inode: its directory entries */
+  Extent *extent;
+  size_t nextents;
+  size_t aextents;
+  DirEntry *dirent;
+  size_t ndirents;
+  size_t adirents;
+  IndexPath *path;
+  size_t npaths;
+  size_t apaths;
+  char *name;            /* Path strings, back to back */
+  size_t nname;
+  size_t aname;
+} IndexBuild;
+
+const char *index_sort_names = NULL; /* Name strings for index_path_compare */
+
+/* MAKE ROOM FOR need MORE ELEMENTS OF size BYTES */
+int
+index_grow(void **array, size_t *alloc, size_t used, size_t need, size_t size)
+{
+  size_t grown = *alloc ? *alloc : 256;
+  void *p;
+
+  if (used + need <= *alloc)
+    {
+      return 0;
+    }
+
+  while (grown < used + need)
+    {
+      grown *= 2;
+    }
+
+  p = realloc(*array, grown * size);
+  if (p == NULL)
+    {
+      perror("unixtool: index realloc()");
+      return -1;
+    }
+
+  *array = p;
+  *alloc = grown;
+  return 0;
+}
+
+int
+index_path_compare(const void *a, const void *b)
+{
+  return strcmp(index_sort_names + ((const IndexPath *)a )->name,
+                index_sort_names + ((const IndexPath *)b )->name);
+}
+
+/* index: RECORD THE PATH OF EACH ENTRY OF EACH DIRECTORY WALKED */
+int
+index_visit(const char *path, Inode *dir, DirIndex *index, void *ctx)
+{
+  IndexBuild *build = ctx;
+  int x = 0;
+
+  (void)dir;
+  while (x < index->count)
+    {
+      DirEntry *ent = &index->entry[x++];
+      char *full;
+      size_t len;
+
+      if (strcmp(ent->name, ".") == 0 || strcmp(ent->name, "..") == 0)
+        {
+          continue;
+        }
+
+      if (!dir_name_valid(ent->name))
+        {
+          printf("unixtool: index: %s: bad entry name \"%s\", skipped\n",
+                 path, ent->name);
+          continue;
+        }
+
+      full = walk_path_join(path, ent->name);
+      if (full == NULL)
+        {
+          return -1;
+        }
+
+      len = strlen(full) + 1;
+      if (index_grow((void **)&build->name, &build->aname, build->nname, len, 1)
+          < 0
+          || index_grow((void **)&build->path, &build->apaths, build->npaths, 1,
+                        sizeof ( IndexPath )) < 0)
+        {
+          free(full);
+          return -1;
+        }
+
+      build->path[build->npaths].name = build->nname;
+      build->path[build->npaths].inode = ent->inode;
+      build->npaths++;
+      memcpy(build->name + build->nname, full, len);
+      build->nname += len;
+      free(full);
+    }
+  return 0;
+}
+
+/* WRITE A SECTION, PADDED TO 8 BYTES; *off TRACKS THE FILE OFFSET */
+int
+index_write(int fd, const void *data, size_t len, uint64_t *off)
+{
+  static const uint8_t pad[8];
+  size_t padding = ( 8 - len % 8 ) % 8;
+
+  if (host_write(fd, data, len) < 0 || host_write(fd, pad, padding) < 0)
+    {
+      return -1;
+    }
+
+  *off += len + padding;
+  return 0;
+}
+
+int
+unix_index(void)
+{
+  /* Write the metadata index for the image */
+  IndexBuild build;
+  IndexHeader hdr;
+  Inode root;
+  char *fname;
+  char *tmpname;
+  uint64_t off = 0;
+  uint32_t ninodes = disk->inode_count + 1;
+  uint32_t number = 1;
+  int fd;
+  int rv = 0;
+
+  if (disk->inode_count == 0)
+    {
+      printf("unixtool: index: image has no i-list\n");
+      return -1;
+    }
+
+  if (disk->index != NULL)
+    {
+      /* Rebuild from the image itself */
+      printf("unixtool: index: use --no-index to rebuild a current index\n");
+      return -1;
+    }
+
+  memset(&build, 0, sizeof ( build ));
+  build.map = malloc(ninodes * sizeof ( IndexSpan ));
+  build.dir = malloc(ninodes * sizeof ( IndexSpan ));
+  if (build.map == NULL || build.dir == NULL)
+    {
+      perror("unixtool: index malloc()");
+      return -1;
+    }
+
+  memset(build.map, 0xFF, ninodes * sizeof ( IndexSpan ));
+  memset(build.dir, 0xFF, ninodes * sizeof ( IndexSpan ));
+
+  /* Every inode, with the extents and entries of those in use */
+  while (rv == 0 && number < ninodes)
+    {
+      Inode inode;
+      BlockMap map;
+
+      if (read_inode(number, &inode) < 0)
+        {
+          rv = -1;
+          break;
+        }
+
+      if (inode.nlink == 0
+          || ( inode.type != INODE_FT_FILE && inode.type != INODE_FT_DIR )
+          || block_map_build(&inode, &map) < 0)
+        {
+          number++;
+          continue; /* Left to the image, should anyone ask */
+        }
+
+      if (index_grow((void **)&build.extent, &build.aextents, build.nextents,
+                     map.nextents, sizeof ( Extent )) < 0)
+        {
+          block_map_free(&map);
+          rv = -1;
+          break;
+        }
+
+      build.map[number].first = build.nextents;
+      build.map[number].count = map.nextents;
+      memcpy(build.extent + build.nextents, map.extent,
+             map.nextents * sizeof ( Extent ));
+      build.nextents += map.nextents;
+      block_map_free(&map);
+      if (inode.type == INODE_FT_DIR)
+        {
+          DirEntry *entries;
+          int count = dir_read(&inode, &entries);
+          if (count >= 0
+              && index_grow((void **)&build.dirent, &build.adirents,
+                            build.ndirents, count, sizeof ( DirEntry )) < 0)
+            {
+              free(entries);
+              rv = -1;
+              break;
+            }
+
+          if (count >= 0)
+            {
+              build.dir[number].first = build.ndirents;
+              build.dir[number].count = count;
+              memcpy(build.dirent + build.ndirents, entries,
+                     count * sizeof ( DirEntry ));
+              build.ndirents += count;
+              free(entries);
+            }
+        }
+
+      number++;
+    }
+
+  /* Every reachable path */
+  if (rv == 0 && read_inode(2, &root) == 0)
+    {
+      rv = tree_walk("/", &root, index_visit, &build);
+    }
+
+  if (rv == 0 && index_grow((void **)&build.name, &build.aname, build.nname, 1, 1)
+      == 0)
+    {
+      build.name[build.nname++] = 0; /* An index is never empty of names */
+      index_sort_names = build.name;
+      qsort(build.path, build.npaths, sizeof ( IndexPath ), index_path_compare);
+    }
+  else
+    {
+      rv = -1;
+    }
+
+  /* Lay out the file */
+  memset(&hdr, 0, sizeof ( hdr ));
+  memcpy(hdr.magic, INDEX_MAGIC, 8);
+  hdr.version = INDEX_VERSION;
+  hdr.layout = INDEX_LAYOUT;
+  hdr.sb_time = disk->superblock->time;
+  hdr.sb_fsize = disk->superblock->fsize;
+  hdr.sb_isize = disk->superblock->isize;
+  hdr.ninodes = ninodes;
+  hdr.nextents = build.nextents;
+  hdr.ndirents = build.ndirents;
+  hdr.npaths = build.npaths;
+  hdr.inode_off = ( sizeof ( hdr ) + 7 ) & ~7;
+  hdr.map_off = hdr.inode_off + (( ninodes * sizeof ( Inode ) + 7 ) & ~7 );
+  hdr.dir_off = hdr.map_off + (( ninodes * sizeof ( IndexSpan ) + 7 ) & ~7 );
+  hdr.extent_off = hdr.dir_off + (( ninodes * sizeof ( IndexSpan ) + 7 ) & ~7 );
+  hdr.dirent_off = hdr.extent_off
+                   + (( build.nextents * sizeof ( Extent ) + 7 ) & ~7 );
+  hdr.path_off = hdr.dirent_off
+                 + (( build.ndirents * sizeof ( DirEntry ) + 7 ) & ~7 );
+  hdr.name_off = hdr.path_off + (( build.npaths * sizeof ( IndexPath ) + 7 ) & ~7 );
+  hdr.size = hdr.name_off + build.nname;
+
+  fname = index_file_name();
+  tmpname = fname ? malloc(strlen(fname) + 5) : NULL;
+  if (rv == 0 && tmpname == NULL)
+    {
+      perror("unixtool: index malloc()");
+      rv = -1;
+    }
+
+  if (rv == 0)
+    {
+      /* Written aside and renamed, so readers never see half an index */
+      strcpy(tmpname, fname);
+      strcat(tmpname, ".tmp");
+      fd = open(tmpname, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+      if (fd < 0)
+        {
+          printf("unixtool: index: %s: %s\n", tmpname, strerror(errno));
+          rv = -1;
+        }
+      else
+        {
+          if (index_write(fd, &hdr, sizeof ( hdr ), &off) < 0
+              || index_write(fd, &disk->inode_table[0], ninodes * sizeof ( Inode ),
+                             &off) < 0
+              || index_write(fd, build.map, ninodes * sizeof ( IndexSpan ),
+                             &off) < 0
+              || index_write(fd, build.dir, ninodes * sizeof ( IndexSpan ),
+                             &off) < 0
+              || index_write(fd, build.extent, build.nextents * sizeof ( Extent ),
+                             &off) < 0
+              || index_write(fd, build.dirent,
+                             build.ndirents * sizeof ( DirEntry ), &off) < 0
+              || index_write(fd, build.path, build.npaths * sizeof ( IndexPath ),
+                             &off) < 0
+              || host_write(fd, (uint8_t *)build.name, build.nname) < 0)
+            {
+              rv = -1;
+            }
+
+          if (close(fd) < 0 && rv == 0)
+            {
+              perror("unixtool: index close()");
+              rv = -1;
+            }
+
+          if (rv == 0 && rename(tmpname, fname) < 0)
+            {
+              printf("unixtool: index: %s: %s\n", fname, strerror(errno));
+              rv = -1;
+            }
+
+          if (rv < 0)
+            {
+              unlink(tmpname);
+            }
+        }
+    }
+
+  if (rv == 0)
+    {
+      printf("Indexed %u inodes, %zu extents, %zu directory entries and %zu "
+             "paths into %s\n", ninodes - 1, build.nextents, build.ndirents,
+             build.npaths, fname);
+    }
+
+  free(fname);
+  free(tmpname);
+  free(build.map);
+  free(build.dir);
+  free(build.extent);
+  free(build.dirent);
+  free(build.path);
+  free(build.name);
+  return rv;
+}
+
+/* FREE LIST VISITOR (see free_list_walk) */
+typedef int (*FreeVisit)(uint32_t list, const uint32_t *entry, int count,
+                         void *ctx);
+
+#define FREE_CHAIN_WINDOW 256 /* Blocks read ahead along the free chain */
+
+/* FOLLOW THE FREE BLOCK LIST */
+/*
+ * The superblock holds the first nfree/free[] list; free[0] of each list
+ * names the block holding the next (nfree then 50 addresses, as in the
+ * superblock), 0 ending the chain.  Every address is a free block, the
+ * list blocks included.  visit gets each list in turn (numbered from 0,
+ * the superblock's) and stops the walk by returning nonzero.  Link blocks
+ * can only be found one at a time, so FREE_CHAIN_WINDOW blocks are read
+ * at once in the direction the chain runs; mkfs lays it out in order, so
+ * the next links usually come from the same read.  Returns the number of
+ * lists, or -1 (reported) if the chain is unreadable.
+ */
+int
+free_list_walk(FreeVisit visit, void *ctx)
+{
+  uint32_t isize = swap_hword(disk->superblock->isize);
+  uint32_t fsize = swap_word(disk->superblock->fsize);
+  uint16_t nfree = swap_hword(disk->superblock->nfree);
+  uint32_t entry[50];
+  uint32_t lists = 0;
+  uint32_t here = 1;
+  uint32_t window_lo = 0;
+  uint32_t window_hi = 0;
+  uint8_t *window = NULL;
+  const uint8_t *blocks = NULL;
+  int rv = -1;
+
+  if (disk->map == NULL)
+    {
+      window = malloc(FREE_CHAIN_WINDOW * 1024);
+      if (window == NULL)
+        {
+          perror("unixtool: free list malloc()");
+          return -1;
+        }
+    }
+
+  memcpy(entry, disk->superblock->free, sizeof ( entry ));
+  for (;;)
+    {
+      uint32_t next;
+      int x;
+
+      if (nfree > 50)
+        {
+          printf("unixtool: free list %u (block %u): count %u is over 50\n",
+                 lists, here, nfree);
+          goto out;
+        }
+
+      for (x = 0; x < 50; x++)
+        {
+          entry[x] = swap_word(entry[x]);
+        }
+
+      if (nfree == 0 || visit(lists++, entry, nfree, ctx) != 0)
+        {
+          break;
+        }
+
+      next = entry[0];
+      if (next < isize || next >= fsize)
+        {
+          /* 0 ends the chain; anything else out of range is the visitor's */
+          break;
+        }
+
+      if (next < window_lo || next >= window_hi)
+        {
+          /* Read ahead the way the chain is going */
+          ssize_t io_res;
+          window_lo = next < here && next >= isize + FREE_CHAIN_WINDOW - 1
+                      ? next - ( FREE_CHAIN_WINDOW - 1 ) : next;
+          io_res = disk_ptr(
+            (off_t)window_lo * 0x400,
+            FREE_CHAIN_WINDOW * 1024,
+            window,
+            &blocks);
+          window_hi = window_lo + ( io_res > 0 ? io_res / 1024 : 0 );
+          if (next >= window_hi)
+            {
+              printf("unixtool: free list block %u unreadable\n", next);
+              goto out;
+            }
+        }
+
+      here = next;
+      memcpy(&nfree, blocks + ( next - window_lo ) * 1024, 2);
+      nfree = swap_hword(nfree);
+      memcpy(entry, blocks + ( next - window_lo ) * 1024 + 2,
+             sizeof ( entry ));
+    }
+  rv = lists;
+out:
+  free(window);
+  return rv;
+}
+
+/* PER-INODE FINDINGS OF check */
+typedef struct rCheckInode
+{
+  uint16_t refs;      /* DIRECTORY ENTRIES NAMING IT */
+  uint16_t parent;    /* DIRECTORY OF THE FIRST OF THEM */
+  char name[15];      /* ... AND ITS NAME */
+  uint32_t bad;       /* BLOCK ADDRESSES OUTSIDE THE DATA AREA */
+  uint32_t bad_ind;   /* ... OF WHICH INDIRECT BLOCKS */
+  uint32_t dups;      /* BLOCKS ALSO CLAIMED ELSEWHERE */
+  uint32_t past_eof;  /* BLOCKS MAPPED BEYOND THE FILE SIZE */
+} CheckInode;
+
+/* STATE SHARED BY check AND ITS WORKERS */
+typedef struct rCheck
+{
+  Image *image;         /* IMAGE BEING CHECKED */
+  uint32_t isize;       /* FIRST DATA BLOCK */
+  uint32_t fsize;       /* BLOCKS IN THE VOLUME */
+  int ninodes;          /* INODES IN THE I-LIST */
+  Inode *inode;         /* DECODED I-LIST, BY NUMBER */
+  CheckInode *found;    /* FINDINGS, BY NUMBER */
+  uint32_t *owned;      /* BITMAP: BLOCKS CLAIMED BY AN INODE */
+  uint32_t *dup;        /* BITMAP: BLOCKS CLAIMED MORE THAN ONCE */
+  int pass;             /* 1: CLAIM BLOCKS, 2: FIND OWNERS OF dup ONES */
+  int next;             /* NEXT I-LIST BLOCK TO HAND OUT (ATOMIC) */
+  int errors;           /* I-LIST BLOCKS THAT COULD NOT BE READ (ATOMIC) */
+} Check;
+
+#define CHECK_CHUNK 64 /* I-list blocks per worker grab */
+
+/* TEST AND SET BIT IN A SHARED BITMAP; RETURNS THE OLD BIT */
+int
+check_bit_set(uint32_t *bitmap, uint32_t bit)
+{
+  uint32_t mask = 1u << ( bit % 32 );
+
+  return ( __atomic_fetch_or(&bitmap[bit / 32], mask, __ATOMIC_RELAXED)
+           & mask ) != 0;
+}
+
+/* TEST BIT */
+int
+check_bit(const uint32_t *bitmap, uint32_t bit)
+{
+  return ( bitmap[bit / 32] >> ( bit % 32 )) & 1;
+}
+
+/* ACCOUNT FOR ONE BLOCK ADDRESS OF AN INODE; 0 IF IT IS OUT OF RANGE */
+int
+check_claim(Check *check, CheckInode *found, uint32_t adr, int past_eof)
+{
+  if (adr < check->isize || adr >= check->fsize)
+    {
+      found->bad++;
+      return 0;
+    }
+
+  if (check->pass == 1)
+    {
+      found->past_eof += past_eof;
+      if (check_bit_set(check->owned, adr))
+        {
+          check_bit_set(check->dup, adr);
+        }
+    }
+  else if (check_bit(check->dup, adr))
+    {
+      found->dups++;
+    }
+
+  return 1;
+}
+
+/* WALK AN INDIRECT BLOCK (level 1-3) OF AN INODE */
+void
+check_indirect(Check *check, CheckInode *found, uint32_t adr, int level,
+               uint64_t logical, uint64_t nblocks)
+{
+  uint32_t entry[256];
+  uint64_t span = level == 1 ? 1 : level == 2 ? 256 : 65536;
+  int x = 0;
+
+  if (adr == 0)
+    {
+      return;
+    }
+
+  if (!check_claim(check, found, adr, logical >= nblocks))
+    {
+      found->bad_ind++;
+      return;
+    }
+
+  if (indirect_block_read(adr, entry, 256) < 0)
+    {
+      found->bad_ind++;
+      return;
+    }
+
+  while (x < 256)
+    {
+      if (entry[x] != 0 && level > 1)
+        {
+          check_indirect(check, found, entry[x], level - 1,
+                         logical + x * span, nblocks);
+        }
+      else if (entry[x] != 0)
+        {
+          check_claim(check, found, entry[x], logical + x >= nblocks);
+        }
+
+      x++;
+    }
+}
+
+/* WALK EVERY BLOCK ADDRESS OF AN INODE */
+void
+check_blocks(Check *check, Inode *inode)
+{
+  CheckInode *found = &check->found[inode->number];
+  CheckInode scratch;
+  uint64_t nblocks = ( (uint64_t)inode->size + 1023 ) / 1024;
+  int x = 0;
+
+  if (check->pass == 2)
+    {
+      /* Only dups is wanted; the rest was counted in pass 1 */
+      memset(&scratch, 0, sizeof ( scratch ));
+      found = &scratch;
+    }
+
+  while (x < 10)
+    {
+      if (inode->addr[x] != 0)
+        {
+          check_claim(check, found, inode->addr[x], (uint64_t)x >= nblocks);
+        }
+
+      x++;
+    }
+
+  check_indirect(check, found, inode->addr[10], 1, 10, nblocks);
+  check_indirect(check, found, inode->addr[11], 2, 266, nblocks);
+  check_indirect(check, found, inode->addr[12], 3, 65802, nblocks);
+  if (check->pass == 2)
+    {
+      check->found[inode->number].dups = scratch.dups;
+    }
+}
+
+/* CHECK WORKER: DECODE AND WALK I-LIST BLOCKS, A CHUNK AT A TIME */
+void *
+check_worker(void *arg)
+{
+  Check *check = arg;
+  int iblocks = check->ninodes / 16;
+  uint8_t *buf = malloc(CHECK_CHUNK * 1024);
+
+  disk = check->image;
+  if (buf == NULL)
+    {
+      perror("unixtool: check malloc()");
+      __atomic_fetch_add(&check->errors, 1, __ATOMIC_RELAXED);
+      return NULL;
+    }
+
+  for (;;)
+    {
+      int first = __atomic_fetch_add(&check->next, CHECK_CHUNK,
+                                     __ATOMIC_RELAXED);
+      int count = iblocks - first < CHECK_CHUNK ? iblocks - first : CHECK_CHUNK;
+      int x = 0;
+
+      if (count <= 0)
+        {
+          break;
+        }
+
+      if (check->pass == 1)
+        {
+          if (disk_range_read((off_t)( 2 + first ) * 0x400, count * 1024,
+                              buf) < 0)
+            {
+              __atomic_fetch_add(&check->errors, 1, __ATOMIC_RELAXED);
+              continue;
+            }
+
+          decode_inodes(first * 16 + 1, (const InodeODR *)buf,
+                        &check->inode[first * 16 + 1], count * 16);
+        }
+
+      while (x < count * 16)
+        {
+          Inode *inode = &check->inode[first * 16 + 1 + x++];
+          if (( inode->mode != 0 || inode->type != 0 )
+              && ( inode->type == INODE_FT_FILE
+                   || inode->type == INODE_FT_DIR ))
+            {
+              check_blocks(check, inode);
+            }
+        }
+    }
+  free(buf);
+  return NULL;
+}
+
+/* RUN ONE PASS OF check OVER THE I-LIST ON nthreads THREADS */
+void
+check_pass(Check *check, int pass, long nthreads)
+{
+  pthread_t *threads = malloc(nthreads * sizeof ( pthread_t ));
+  long started = 0;
+
+  check->pass = pass;
+  check->next = 0;
+  while (threads != NULL && started < nthreads
+         && pthread_create(&threads[started], NULL, check_worker, check) == 0)
+    {
+      started++;
+    }
+
+  if (started == 0)
+    {
+      check_worker(check);
+    }
+
+  while (started > 0)
+    {
+      pthread_join(threads[--started], NULL);
+    }
+  free(threads);
+}
+
+/* IMAGE PATH OF AN INODE, AS FIRST FOUND IN THE TREE */
+const char *
+check_path(Check *check, int number, char *buf, size_t len)
+{
+  size_t used = len - 1;
+  int depth = 0;
+
+  buf[used] = 0;
+  if (check->found[number].refs == 0)
+    {
+      snprintf(buf, len, "inode %d", number);
+      return buf;
+    }
+
+  while (number != 2 && depth++ < 256)
+    {
+      const char *name = check->found[number].name;
+      size_t n = strlen(name);
+      if (n + 1 > used)
+        {
+          break;
+        }
+
+      used -= n;
+      memcpy(buf + used, name, n);
+      buf[--used] = '/';
+      number = check->found[number].parent;
+    }
+  if (used == len - 1)
+    {
+      buf[--used] = '/';
+    }
+
+  return buf + used;
+}
+
+/* WALK THE DIRECTORY TREE, COUNTING REFERENCES TO EACH INODE */
+/* Returns the number of problems found */
+int
+check_tree(Check *check)
+{
+  uint16_t *queue = malloc(check->ninodes * sizeof ( uint16_t ));
+  uint8_t *seen = calloc(check->ninodes + 1, 1);
+  char path[1024];
+  int head = 0;
+  int tail = 0;
+  int problems = 0;
+
+  if (queue == NULL || seen == NULL)
+    {
+      perror("unixtool: check malloc()");
+      free(queue);
+      free(seen);
+      return 1;
+    }
+
+  if (check->inode[2].type != INODE_FT_DIR)
+    {
+      printf("unixtool: check: root inode is not a directory\n");
+      free(queue);
+      free(seen);
+      return 1;
+    }
+
+  seen[2] = 1;
+  queue[tail++] = 2;
+  while (head < tail)
+    {
+      int number = queue[head++];
+      DirEntry *entries;
+      int count = dir_read(&check->inode[number], &entries);
+      int dot = 0;
+      int dotdot = 0;
+      int x = 0;
+
+      if (count < 0)
+        {
+          printf("unixtool: check: %s: directory unreadable\n",
+                 check_path(check, number, path, sizeof ( path )));
+          problems++;
+          continue;
+        }
+
+      while (x < count)
+        {
+          DirEntry *ent = &entries[x++];
+          CheckInode *found;
+          Inode *inode;
+          int dots = strcmp(ent->name, ".") == 0 ? 1
+                     : strcmp(ent->name, "..") == 0 ? 2 : 0;
+
+          if (ent->inode > check->ninodes)
+            {
+              printf("unixtool: check: %s: entry \"%s\" names inode %u, "
+                     "past the i-list\n",
+                     check_path(check, number, path, sizeof ( path )),
+                     ent->name, ent->inode);
+              problems++;
+              continue;
+            }
+
+          found = &check->found[ent->inode];
+          inode = &check->inode[ent->inode];
+          if (found->refs < UINT16_MAX)
+            {
+              found->refs++;
+            }
+
+          if (dots == 1)
+            {
+              dot++;
+              if (ent->inode != number)
+                {
+                  printf("unixtool: check: %s: \".\" names inode %u\n",
+                         check_path(check, number, path, sizeof ( path )),
+                         ent->inode);
+                  problems++;
+                }
+
+              continue;
+            }
+
+          if (dots == 2)
+            {
+              dotdot++;
+              if (ent->inode != ( number == 2 ? 2 : check->found[number].parent ))
+                {
+                  printf("unixtool: check: %s: \"..\" names inode %u\n",
+                         check_path(check, number, path, sizeof ( path )),
+                         ent->inode);
+                  problems++;
+                }
+
+              continue;
+            }
+
+          if (inode->mode == 0 && inode->type == 0)
+            {
+              printf("unixtool: check: %s: entry \"%s\" names free inode %u\n",
+                     check_path(check, number, path, sizeof ( path )),
+                     ent->name, ent->inode);
+              problems++;
+              continue;
+            }
+
+          if (found->refs == 1)
+            {
+              found->parent = number;
+              memcpy(found->name, ent->name, sizeof ( found->name ));
+            }
+
+          if (inode->type == INODE_FT_DIR)
+            {
+              if (seen[ent->inode])
+                {
+                  printf("unixtool: check: %s: entry \"%s\" is another link "
+                         "to directory inode %u\n",
+                         check_path(check, number, path, sizeof ( path )),
+                         ent->name, ent->inode);
+                  problems++;
+                  continue;
+                }
+
+              seen[ent->inode] = 1;
+              queue[tail++] = ent->inode;
+            }
+        }
+      free(entries);
+      if (dot != 1 || dotdot != 1)
+        {
+          printf("unixtool: check: %s: %d \".\" and %d \"..\" entries\n",
+                 check_path(check, number, path, sizeof ( path )), dot,
+                 dotdot);
+          problems++;
+        }
+    }
+  free(queue);
+  free(seen);
+  return problems;
+}
+
+/* check's VIEW OF THE FREE LIST */
+typedef struct rCheckFree
+{
+  Check *check;
+  uint32_t *freed;    /* BITMAP: BLOCKS ON THE FREE LIST */
+  uint32_t total;     /* DISTINCT BLOCKS LISTED */
+  uint32_t in_use;    /* ... OF WHICH CLAIMED BY INODES */
+  uint32_t twice;     /* ADDRESSES LISTED AGAIN */
+  uint32_t bad;       /* ADDRESSES OUTSIDE THE DATA AREA */
+  int loop;           /* NONZERO IF THE CHAIN CAME BACK ON ITSELF */
+} CheckFree;
+
+/* MARK ONE FREE LIST (free_list_walk() VISITOR) */
+int
+check_free_visit(uint32_t list, const uint32_t *entry, int count, void *ctx)
+{
+  CheckFree *cf = ctx;
+  Check *check = cf->check;
+  int x;
+
+  for (x = 0; x < count; x++)
+    {
+      uint32_t adr = entry[x];
+      if (x == 0 && adr == 0)
+        {
+          /* End of the chain */
+          continue;
+        }
+
+      if (adr < check->isize || adr >= check->fsize)
+        {
+          cf->bad++;
+        }
+      else if (check_bit_set(cf->freed, adr))
+        {
+          cf->twice++;
+          cf->loop |= x == 0;
+        }
+      else
+        {
+          cf->in_use += check_bit(check->owned, adr);
+          cf->total++;
+        }
+    }
+
+  if (cf->loop)
+    {
+      /* Chain comes back to a list already followed */
+      printf("unixtool: check: free list %u loops back to block %u\n", list,
+             entry[0]);
+      return 1;
+    }
+
+  return 0;
+}
+
+/* FOLLOW THE FREE BLOCK LIST, MARKING freed */
+/*
+ * Returns the number of problems found and the block count in *total.
+ */
+int
+check_free_list(Check *check, uint32_t *freed, uint32_t *total)
+{
+  CheckFree cf;
+  int problems = 0;
+
+  memset(&cf, 0, sizeof ( cf ));
+  cf.check = check;
+  cf.freed = freed;
+  if (free_list_walk(check_free_visit, &cf) < 0 || cf.loop)
+    {
+      problems++;
+    }
+
+  if (cf.bad > 0)
+    {
+      printf("unixtool: check: free list: %u addresses outside the data "
+             "area\n", cf.bad);
+      problems++;
+    }
+
+  if (cf.twice > (uint32_t)cf.loop)
+    {
+      printf("unixtool: check: free list: %u blocks listed more than once\n",
+             cf.twice - (uint32_t)cf.loop);
+      problems++;
+    }
+
+  if (cf.in_use > 0)
+    {
+      printf("unixtool: check: free list: %u blocks also in use by files\n",
+             cf.in_use);
+      problems++;
+    }
+
+  *total = cf.total;
+  return problems;
+}
+
+/* CHECK IMAGE CONSISTENCY */
+/*
+ * Pass 1 decodes the i-list on worker threads, each taking CHECK_CHUNK
+ * i-list blocks at a time, and claims every block address in a shared
+ * ownership bitmap; blocks claimed twice go in a second bitmap, which
+ * pass 2 (only run if there are any) uses to name their owners.  Then the
+ * directory tree is walked from the root to count links and the
+ * free list is followed against the ownership bitmap.  Memory is two
+ * bits per block (three with the free list) and a record per inode.
+ * Metadata is read from the image itself, never from an index.
+ */
+int
+unix_check(void)
+{
+  Check check;
+  const IndexHeader *index = disk->index;
+  long nthreads = extract_threads;
+  uint32_t words;
+  uint32_t *freed;
+  uint32_t nfree = 0;
+  uint32_t used = 0;
+  uint32_t missing = 0;
+  uint32_t adr;
+  int iblocks = swap_hword(disk->superblock->isize) - 2;
+  int allocated = 0;
+  int free_inodes = 0;
+  int problems = 0;
+  int x;
+  char path[1024];
+
+  memset(&check, 0, sizeof ( check ));
+  check.image = disk;
+  check.isize = swap_hword(disk->superblock->isize);
+  check.fsize = swap_word(disk->superblock->fsize);
+  if (iblocks <= 0 || check.fsize <= check.isize
+      || ( disk->size > 0 && (off_t)check.isize * 0x400 > disk->size ))
+    {
+      printf("unixtool: check: superblock sizes make no sense (isize %u, "
+             "fsize %u)\n", check.isize, check.fsize);
+      return -1;
+    }
+
+  if (disk->size > 0 && (off_t)check.fsize * 0x400 > disk->size)
+    {
+      printf("unixtool: check: volume is %u blocks but the image holds only "
+             "%lld\n", check.fsize, (long long)( disk->size / 0x400 ));
+      problems++;
+    }
+
+  if (iblocks > 4096)
+    {
+      printf("unixtool: check: i-list of %d blocks; only the first 4096 "
+             "can be named by directories\n", iblocks);
+      iblocks = 4096;
+    }
+
+  check.ninodes = iblocks * 16;
+  words = ( check.fsize + 31 ) / 32;
+  check.inode = calloc(check.ninodes + 1, sizeof ( Inode ));
+  check.found = calloc(check.ninodes + 1, sizeof ( CheckInode ));
+  check.owned = calloc(words, sizeof ( uint32_t ));
+  check.dup = calloc(words, sizeof ( uint32_t ));
+  freed = calloc(words, sizeof ( uint32_t ));
+  if (check.inode == NULL || check.found == NULL || check.owned == NULL
+      || check.dup == NULL || freed == NULL)
+    {
+      perror("unixtool: check calloc()");
+      problems = -1;
+      goto out;
+    }
+
+  if (nthreads <= 0)
+    {
+      nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+
+  if (nthreads > ( iblocks + CHECK_CHUNK - 1 ) / CHECK_CHUNK)
+    {
+      nthreads = ( iblocks + CHECK_CHUNK - 1 ) / CHECK_CHUNK;
+    }
+
+  /* The image, not the index, is what's being checked */
+  disk->index = NULL;
+  check_pass(&check, 1, nthreads);
+  if (check.errors > 0)
+    {
+      printf("unixtool: check: i-list unreadable\n");
+      problems = -1;
+      goto out;
+    }
+
+  for (adr = 0; adr < words; adr++)
+    {
+      if (check.dup[adr] != 0)
+        {
+          check_pass(&check, 2, nthreads);
+          break;
+        }
+    }
+
+  problems += check_tree(&check);
+  for (x = 1; x <= check.ninodes; x++)
+    {
+      Inode *inode = &check.inode[x];
+      CheckInode *found = &check.found[x];
+      const char *name = check_path(&check, x, path, sizeof ( path ));
+
+      if (inode->mode == 0 && inode->type == 0)
+        {
+          free_inodes++;
+          continue;
+        }
+
+      allocated++;
+      if (inode->type != INODE_FT_FILE && inode->type != INODE_FT_DIR
+          && inode->type != INODE_FT_CHAR && inode->type != INODE_FT_BLK
+          && inode->type != INODE_FT_FIFO)
+        {
+          printf("unixtool: check: %s: unknown file type %u\n", name,
+                 inode->type);
+          problems++;
+        }
+
+      if (x == 1)
+        {
+          /* Reserved; nothing links to it */
+        }
+      else if (found->refs == 0)
+        {
+          printf("unixtool: check: inode %d: in use (%u bytes) but in no "
+                 "directory\n", x, inode->size);
+          problems++;
+        }
+      else if (found->refs != inode->nlink)
+        {
+          printf("unixtool: check: %s: link count %u, %u references\n", name,
+                 inode->nlink, found->refs);
+          problems++;
+        }
+
+      if (found->bad > 0)
+        {
+          printf("unixtool: check: %s: %u block addresses outside the data "
+                 "area (%u of them indirect)\n", name, found->bad,
+                 found->bad_ind);
+          problems++;
+        }
+
+      if (found->dups > 0)
+        {
+          printf("unixtool: check: %s: %u blocks also claimed by another "
+                 "inode\n", name, found->dups);
+          problems++;
+        }
+
+      if (found->past_eof > 0)
+        {
+          printf("unixtool: check: %s: %u blocks mapped past the end of the "
+                 "file\n", name, found->past_eof);
+          problems++;
+        }
+    }
+
+  /* Superblock free inode cache must list free inodes */
+  for (x = 0; x < swap_hword(disk->superblock->ninode) && x < 100; x++)
+    {
+      uint16_t number = swap_hword(disk->superblock->inode[x]);
+      if (number < 1 || number > check.ninodes
+          || check.inode[number].mode != 0 || check.inode[number].type != 0)
+        {
+          printf("unixtool: check: superblock free inode list names inode "
+                 "%u, which is not free\n", number);
+          problems++;
+        }
+    }
+
+  if (swap_hword(disk->superblock->tinode) != free_inodes)
+    {
+      printf("unixtool: check: superblock counts %u free inodes; %d are "
+             "free\n", swap_hword(disk->superblock->tinode), free_inodes);
+      problems++;
+    }
+
+  problems += check_free_list(&check, freed, &nfree);
+  if (swap_word(disk->superblock->tfree) != nfree)
+    {
+      printf("unixtool: check: superblock counts %u free blocks; the free "
+             "list holds %u\n", swap_word(disk->superblock->tfree), nfree);
+      problems++;
+    }
+
+  for (adr = check.isize; adr < check.fsize; adr++)
+    {
+      if (check_bit(check.owned, adr))
+        {
+          used++;
+        }
+      else if (!check_bit(freed, adr))
+        {
+          missing++;
+        }
+    }
+
+  if (missing > 0)
+    {
+      printf("unixtool: check: %u blocks neither in use nor free\n", missing);
+      problems++;
+    }
+
+  printf(
+    "Checked %d inodes (%d in use) and %u data blocks (%u in use, %u free): "
+    "%d problems\n",
+    check.ninodes,
+    allocated,
+    check.fsize - check.isize,
+    used,
+    nfree,
+    problems);
+out:
+  disk->index = index;
+  free(check.inode);
+  free(check.found);
+  free(check.owned);
+  free(check.dup);
+  free(freed);
+  return problems != 0 ? -1 : 0;
+}
+
+/* SUPERBLOCK NAME FIELD AS A STRING */
+void
+df_name(char *out, const char *field)
+{
+  int x = 0;
+
+  while (x < 6 && field[x] >= ' ' && field[x] < 0x7F)
+    {
+      out[x] = field[x];
+      x++;
+    }
+  out[x] = 0;
+}
+
+/* REPORT SPACE AND INODE USE FROM THE SUPERBLOCK */
+int
+unix_df(void)
+{
+  uint32_t isize = swap_hword(disk->superblock->isize);
+  uint32_t fsize = swap_word(disk->superblock->fsize);
+  uint32_t tfree = swap_word(disk->superblock->tfree);
+  uint32_t tinode = swap_hword(disk->superblock->tinode);
+  uint32_t data = fsize > isize ? fsize - isize : 0;
+  uint32_t used = data > tfree ? data - tfree : 0;
+  uint32_t inodes = isize > 2 ? ( isize - 2 ) * 16 : 0;
+  uint32_t iused = inodes > tinode ? inodes - tinode : 0;
+  char fname[7];
+  char fpack[7];
+
+  df_name(fname, disk->superblock->fname);
+  df_name(fpack, disk->superblock->fpack);
+  printf("%-24s %-6s %-6s %10s %10s %10s %4s %7s %7s %7s %5s\n", "Image",
+         "Name", "Pack", "1K-blocks", "Used", "Free", "Use%", "Inodes",
+         "IUsed", "IFree", "IUse%");
+  printf("%-24s %-6s %-6s %10u %10u %10u %3u%% %7u %7u %7u %4u%%\n",
+         disk->fname, fname, fpack, data, used, tfree,
+         data ? (unsigned)(( used * 100ULL + data - 1 ) / data ) : 0, inodes,
+         iused, tinode,
+         inodes ? (unsigned)(( iused * 100ULL + inodes - 1 ) / inodes ) : 0);
+  return 0;
+}
+
+/* LIST THE FILESYSTEMS (BANDS) IN A DISK DUMP */
+/* Offsets are what --offset takes; the band numbers are for --band */
+int
+unix_scan(void)
+{
+  Band *bands;
+  int count;
+  int x = 0;
+
+  if (image_offset != 0 && disk_base_set(image_offset) < 0)
+    {
+      return -1;
+    }
+
+  count = band_scan(&bands, INT_MAX);
+  if (count < 0)
+    {
+      return -1;
+    }
+
+  if (count == 0)
+    {
+      printf("unixtool: scan: no filesystems found\n");
+      return -1;
+    }
+
+  printf("%-4s %14s %10s %-6s %-6s %7s\n", "Band", "Offset", "1K-blocks",
+         "Name", "Pack", "Inodes");
+  while (x < count)
+    {
+      Band *band = &bands[x];
+      char fname[7];
+      char fpack[7];
+
+      df_name(fname, band->sb.fname);
+      df_name(fpack, band->sb.fpack);
+      printf("%4d %14lld %10u %-6s %-6s %7u%s\n", x,
+             (long long)( disk->base + band->offset ), swap_word(band->sb.fsize),
+             fname, fpack, ( swap_hword(band->sb.isize) - 2 ) * 16,
+             band->truncated ? "  (truncated)" : "");
+      x++;
+    }
+  free(bands);
+  return 0;
+}
+
+/* blockmap's VIEW OF THE FREE LIST */
+typedef struct rBlockmapFree
+{
+  uint32_t *freed;    /* BITMAP: BLOCKS ON THE FREE LIST */
+  uint32_t isize;     /* DATA AREA */
+  uint32_t fsize;
+  uint32_t total;     /* DISTINCT FREE BLOCKS */
+  uint32_t lists;     /* LISTS FOLLOWED */
+  uint32_t bad;       /* ADDRESSES OUTSIDE THE DATA AREA, OR REPEATED */
+} BlockmapFree;
+
+/* MARK ONE FREE LIST (free_list_walk() VISITOR) */
+int
+blockmap_free_visit(uint32_t list, const uint32_t *entry, int count, void *ctx)
+{
+  BlockmapFree *bf = ctx;
+  uint32_t mask = 0;
+  int x;
+
+  bf->lists = list + 1;
+  for (x = 0; x < count; x++)
+    {
+      uint32_t adr = entry[x];
+      if (x == 0 && adr == 0)
+        {
+          continue;
+        }
+
+      if (adr < bf->isize || adr >= bf->fsize)
+        {
+          bf->bad++;
+          continue;
+        }
+
+      mask = 1u << ( adr % 32 );
+      if (bf->freed[adr / 32] & mask)
+        {
+          bf->bad++;
+          if (x == 0)
+            {
+              /* Chain loops; see check */
+              return 1;
+            }
+
+          continue;
+        }
+
+      bf->freed[adr / 32] |= mask;
+      bf->total++;
+    }
+  return 0;
+}
+
+#define BLOCKMAP_WIDTH 64 /* Cells per line of the map */
+#define BLOCKMAP_CELLS 2048 /* Cells in the map when not told the scale */
+
+/* DRAW FREE/USED MAP AND REPORT FRAGMENTATION */
+/*
+ * Free blocks come from the free list; everything else in the data area
+ * counts as used.  Each map cell covers per_cell blocks (by default
+ * enough for the volume to fit BLOCKMAP_CELLS cells): '.' all free, '#'
+ * all used, '+' some of each, 'i' boot block, superblock and i-list.
+ * Extents per file come from the block maps (or the index, if any).
+ */
+int
+unix_blockmap(char *per_cell_arg)
+{
+  BlockmapFree bf;
+  uint32_t words;
+  uint32_t per_cell;
+  uint32_t adr;
+  uint32_t last;
+  uint32_t runs = 0;
+  uint32_t longest = 0;
+  uint32_t run = 0;
+  uint64_t file_blocks = 0;
+  uint64_t file_extents = 0;
+  uint32_t files = 0;
+  uint32_t dirs = 0;
+  uint32_t scattered = 0;
+  char line[BLOCKMAP_WIDTH + 1];
+  int used = 0;
+  int x;
+
+  memset(&bf, 0, sizeof ( bf ));
+  bf.isize = swap_hword(disk->superblock->isize);
+  bf.fsize = swap_word(disk->superblock->fsize);
+  if (bf.fsize <= bf.isize)
+    {
+      printf("unixtool: blockmap: superblock sizes make no sense (isize %u, "
+             "fsize %u)\n", bf.isize, bf.fsize);
+      return -1;
+    }
+
+  per_cell = ( bf.fsize + BLOCKMAP_CELLS - 1 ) / BLOCKMAP_CELLS;
+  if (per_cell_arg != NULL)
+    {
+      char *end = NULL;
+      long value = strtol(per_cell_arg, &end, 10);
+      if (*end != 0 || value < 1)
+        {
+          printf("unixtool: blockmap: blocks per cell must be a number\n");
+          return -1;
+        }
+
+      /* One cell for the whole volume at most */
+      per_cell = (unsigned long)value < bf.fsize ? (uint32_t)value : bf.fsize;
+    }
+
+  words = ( bf.fsize + 31 ) / 32;
+  bf.freed = calloc(words, sizeof ( uint32_t ));
+  if (bf.freed == NULL)
+    {
+      perror("unixtool: blockmap calloc()");
+      return -1;
+    }
+
+  if (free_list_walk(blockmap_free_visit, &bf) < 0)
+    {
+      free(bf.freed);
+      return -1;
+    }
+
+  /* The map */
+  printf("Block map of %s: %u blocks, %u per cell ('.' free, '#' used, "
+         "'+' both, 'i' i-list)\n", disk->fname, bf.fsize, per_cell);
+  x = 0;
+  for (adr = 0; adr < bf.fsize; adr = last)
+    {
+      /* Not adr + per_cell: that can wrap */
+      last = bf.fsize - adr > per_cell ? adr + per_cell : bf.fsize;
+      uint32_t b;
+      int nfree = 0;
+      int nused = 0;
+
+      for (b = adr; b < last; b++)
+        {
+          if (( bf.freed[b / 32] >> ( b % 32 )) & 1)
+            {
+              nfree++;
+            }
+          else
+            {
+              nused++;
+            }
+        }
+
+      line[x++] = last <= bf.isize ? 'i' : nfree == 0 ? '#'
+                  : nused == 0 ? '.' : '+';
+      if (x == BLOCKMAP_WIDTH || last == bf.fsize)
+        {
+          line[x] = 0;
+          printf("%9u %s\n", adr - ( x - 1 ) * per_cell, line);
+          x = 0;
+        }
+    }
+
+  /* Free space runs */
+  for (adr = bf.isize; adr <= bf.fsize; adr++)
+    {
+      if (adr < bf.fsize && (( bf.freed[adr / 32] >> ( adr % 32 )) & 1))
+        {
+          run++;
+          continue;
+        }
+
+      if (run > 0)
+        {
+          runs++;
+          longest = run > longest ? run : longest;
+          run = 0;
+        }
+
+      used += adr < bf.fsize;
+    }
+
+  /* File extents */
+  for (x = 1; x <= disk->inode_count; x++)
+    {
+      Inode inode;
+      BlockMap *map;
+      uint32_t e;
+      uint32_t n = 0;
+
+      if (read_inode(x, &inode) < 0)
+        {
+          free(bf.freed);
+          return -1;
+        }
+
+      if (( inode.type != INODE_FT_FILE && inode.type != INODE_FT_DIR )
+          || inode.size == 0)
+        {
+          continue;
+        }
+
+      map = inode_block_map(&inode);
+      if (map == NULL)
+        {
+          continue;
+        }
+
+      for (e = 0; e < map->nextents; e++)
+        {
+          if (map->extent[e].start != 0)
+            {
+              file_blocks += map->extent[e].length;
+              n++;
+            }
+        }
+
+      file_extents += n;
+      scattered += n > 1;
+      if (inode.type == INODE_FT_DIR)
+        {
+          dirs++;
+        }
+      else
+        {
+          files++;
+        }
+    }
+
+  printf("Data area: %u blocks, %d used, %u free (%.1f%%)\n",
+         bf.fsize - bf.isize, used, bf.total,
+         100.0 * bf.total / ( bf.fsize - bf.isize ));
+  printf("Free space: %u runs, longest %u blocks, average %.1f blocks, in %u "
+         "free lists\n", runs, longest, runs ? (double)bf.total / runs : 0.0,
+         bf.lists);
+  if (bf.bad > 0 || bf.total != swap_word(disk->superblock->tfree))
+    {
+      printf("Free list: %u bad or repeated addresses; superblock counts %u "
+             "free (run unixtool check)\n", bf.bad,
+             swap_word(disk->superblock->tfree));
+    }
+
+  printf("Files: %u files and %u directories, %llu blocks in %llu extents "
+         "(%.1f blocks per extent), %u in more than one extent\n", files,
+         dirs, (unsigned long long)file_blocks,
+         (unsigned long long)file_extents,
+         file_extents ? (double)file_blocks / file_extents : 0.0, scattered);
+  free(bf.freed);
+  return 0;
+}
+
+/* OPEN THE MANIFEST (--hash, OR STDOUT) ONCE */
+/* On stdout, messages move to stderr as for tar */
+FILE *
+manifest_open(void)
+{
+  if (manifest_file != NULL)
+    {
+      return manifest_file;
+    }
+
+  if (hash_manifest == NULL || strcmp(hash_manifest, "-") == 0)
+    {
+      int fd = stdout_claim();
+      manifest_file = fd < 0 ? NULL : fdopen(fd, "w");
+    }
+  else
+    {
+      manifest_file = fopen(hash_manifest, "w");
+    }
+
+  if (manifest_file == NULL)
+    {
+      perror("unixtool: manifest");
+    }
+
+  return manifest_file;
+}
+
+/* WRITE ONE MANIFEST LINE: SHA-256 (HEX), SIZE, MTIME (EPOCH), PATH */
+void
+manifest_line(FILE *out, const uint8_t *digest, Inode *inode,
+              const char *path)
+{
+  int x;
+
+  for (x = 0; x < 32; x++)
+    {
+      fprintf(out, "%02x", digest[x]);
+    }
+
+  fprintf(out, " %10u %10lld %s\n", inode->size, (long long)inode->mtime,
+          path);
+}
+
+int
+unix_read(char *path, char *filename)
+{
+  /* Read path (from image) into filename (on host) */
+  Inode file_inode;
+  uint8_t *copy_buffer;
+  BlockMap *map;
+  unsigned int x = 0;   /* Bytes written */
+  uint64_t start;
+  int file_fd;          /* FD for target file */
+  int rv = 0;
+  Sha256 hash;
+
+  rv = namei(path, &file_inode);
+  if (rv < 0)
+    {
+      return rv;
+    }
+
+  if (file_inode.type != INODE_FT_FILE)
+    {
+      printf("unixtool: No such file or directory (in image, file read).\n");
+      return -1;
+    }
+
+  /* Do the deed! */
+  map = inode_block_map(&file_inode);
+  if (map == NULL)
+    {
+      return -1;
+    }
+
+  copy_buffer = copy_buffer_alloc();
+  if (copy_buffer == NULL)
+    {
+      return -1;
+    }
+
+  /* Open target */
+  file_fd = host_create(filename);
+  if (file_fd < 0)
+    {
+      perror("unixtool:open()");
+      free(copy_buffer);
+      return -1;
+    }
+
+  printf("Copying %d bytes\n", file_inode.size);
+  start = stats_clock();
+  if (hash_manifest != NULL)
+    {
+      sha256_init(&hash);
+      copy_hash = &hash;
+    }
+
+  rv = inode_copy(&file_inode, map, file_fd, copy_buffer);
+  copy_hash = NULL;
+  stats_phase(PHASE_COPY, start);
+  free(copy_buffer);
+  if (rv < 0)
+    {
+      close(file_fd);
+      return rv;
+    }
+
+  if (hash_manifest != NULL)
+    {
+      FILE *out = manifest_open();
+      uint8_t digest[32];
+      sha256_final(&hash, digest);
+      if (out != NULL)
+        {
+          manifest_line(out, digest, &file_inode, filename);
+        }
+
+      if (out == NULL || fflush(out) != 0 || ferror(out))
+        {
+          perror("unixtool: manifest write");
+          close(file_fd);
+          return -1;
+        }
+    }
+
+  x = file_inode.size;
+  printf("Wrote %d of %d bytes\n", x, file_inode.size);
+  close(file_fd);
+  return 0;
+}
+
+/* PARSE BYTE COUNT ARGUMENT (cat) */
+int
+cat_number(const char *what, const char *arg, uint64_t *value)
+{
+  char *end = NULL;
+
+  errno = 0;
+  if (arg[0] >= '0' && arg[0] <= '9')
+    {
+      *value = strtoull(arg, &end, 10);
+    }
+
+  if (end == NULL || *end != 0 || errno != 0)
+    {
+      printf("unixtool: cat: %s must be a number of bytes\n", what);
+      return -1;
+    }
+
+  return 0;
+}
+
+/* WRITE BYTES OF A FILE TO STDOUT */
+/*
+ * Only the data blocks under the range are read, found through the
+ * block map; extents are copied without a user-space buffer where the
+ * host allows it and holes are written as zeros (or skipped, if stdout
+ * is a file).
+ * offset_arg and length_arg may be NULL (whole file, rest of file).
+ */
+int
+unix_cat(char *path, char *offset_arg, char *length_arg)
+{
+  Inode inode;
+  BlockMap *map;
+  uint8_t *buf = NULL;
+  uint64_t offset = 0;
+  uint64_t length = UINT64_MAX;
+  uint64_t end;
+  uint64_t start;
+  uint32_t extent = 0;
+  int fd;
+  int rv = 0;
+
+  if (( offset_arg != NULL && cat_number("offset", offset_arg, &offset) < 0 )
+      || ( length_arg != NULL && cat_number("length", length_arg, &length) < 0 ))
+    {
+      return -1;
+    }
+
+  if (namei(path, &inode) < 0)
+    {
+      return -1;
+    }
+
+  if (inode.type == INODE_FT_DIR)
+    {
+      printf("unixtool: cat: %s: Is a directory (in image)\n", path);
+      return -1;
+    }
+
+  if (offset > inode.size)
+    {
+      offset = inode.size;
+    }
+
+  end = length < inode.size - offset ? offset + length : inode.size;
+  map = inode_block_map(&inode);
+  if (map == NULL)
+    {
+      return -1;
+    }
+
+  if (disk->map == NULL)
+    {
+      buf = malloc(COPY_BUFFER_SIZE);
+      if (buf == NULL)
+        {
+          perror("unixtool: copy buffer malloc()");
+          return -1;
+        }
+    }
+
+  fd = stdout_claim();
+  if (fd < 0)
+    {
+      free(buf);
+      return -1;
+    }
+
+  start = stats_clock();
+  while (rv == 0 && extent < map->nextents)
+    {
+      Extent *ext = &map->extent[extent++];
+      uint64_t first = (uint64_t)ext->logical * 0x400;
+      uint64_t last = first + (uint64_t)ext->length * 0x400;
+
+      if (last <= offset)
+        {
+          continue;
+        }
+
+      if (first >= end)
+        {
+          break;
+        }
+
+      if (first < offset)
+        {
+          first = offset;
+        }
+
+      if (last > end)
+        {
+          last = end;
+        }
+
+      if (ext->start == 0)
+        {
+          rv = host_hole(fd, last - first);
+          continue;
+        }
+
+      rv = disk_range_copy(
+        fd,
+        (off_t)ext->start * 0x400 + ( first - (uint64_t)ext->logical * 0x400 ),
+        last - first,
+        buf,
+        COPY_BUFFER_SIZE);
+    }
+  stats_phase(PHASE_COPY, start);
+  free(buf);
+  close(fd);
+  return rv;
+}
+
+/* FILE QUEUED FOR EXTRACTION */
+typedef struct rExtractJob
+{
+  Inode inode;        /* SOURCE INODE */
+  char *host_path;    /* DESTINATION ON HOST (hash: IMAGE PATH) */
+  int hashed;         /* NONZERO ONCE digest IS SET */
+  int unchanged;      /* --incremental: HOST COPY IS CURRENT, DON'T WRITE */
+  uint8_t digest[32]; /* SHA-256 OF THE CONTENTS (hash, --hash) */
+} ExtractJob;
+
+/* WORK QUEUE SHARED BY EXTRACT WORKERS */
+typedef struct rExtractQueue
+{
+  ExtractJob *job;       /* FILES TO COPY */
+  size_t count;          /* NUMBER OF JOBS */
+  size_t alloc;          /* JOB SLOTS ALLOCATED */
+  size_t next;           /* NEXT JOB TO HAND OUT */
+  ExtractJob *dir;       /* DIRECTORIES CREATED, IN WALK ORDER */
+  size_t dirs;           /* NUMBER OF THEM */
+  size_t dir_alloc;      /* DIRECTORY SLOTS ALLOCATED */
+  uint64_t bytes;        /* BYTES COPIED */
+  size_t unchanged;      /* --incremental: FILES LEFT AS THEY WERE */
+  uint64_t unchanged_bytes; /* ... AND THEIR SIZE */
+  int errors;            /* FAILED JOBS */
+  Image *image;          /* IMAGE BEING EXTRACTED FROM */
+  int hash_only;         /* hash: DIGEST THE FILES, WRITE NOTHING */
+  pthread_mutex_t lock;  /* PROTECTS next, bytes, errors */
+} ExtractQueue;
+
+/* APPEND TO A LIST OF EXTRACT JOBS */
+int
+extract_list_add(ExtractJob **list, size_t *count, size_t *alloc,
+                 Inode *inode, const char *host_path)
+{
+  if (*count == *alloc)
+    {
+      size_t grow = *alloc ? *alloc * 2 : 256;
+      ExtractJob *grown = realloc(*list, grow * sizeof ( ExtractJob ));
+      if (grown == NULL)
+        {
+          perror("unixtool: extract realloc()");
+          return -1;
+        }
+
+      *list = grown;
+      *alloc = grow;
+    }
+
+  ( *list )[*count].inode = *inode;
+  ( *list )[*count].hashed = 0;
+  ( *list )[*count].unchanged = 0;
+  ( *list )[*count].host_path = strdup(host_path);
+  if (( *list )[*count].host_path == NULL)
+    {
+      perror("unixtool: extract strdup()");
+      return -1;
+    }
+
+  ( *count )++;
+  return 0;
+}
+
+/* QUEUE A FILE FOR EXTRACTION */
+int
+extract_queue_add(ExtractQueue *queue, Inode *inode, const char *host_path)
+{
+  return extract_list_add(&queue->job, &queue->count, &queue->alloc, inode,
+                          host_path);
+}
+
+/* IS HOST FILE ALREADY AN EXTRACTED COPY OF inode? */
+/*
+ * Decided from metadata alone: a regular file of the same size, with the
+ * mtime and permissions host_restore() gives a finished copy.  Those are
+ * set after the data is written, so a copy cut short is never taken as
+ * current.  The image ctime has no host counterpart to compare against;
+ * chmod shows up in the permissions instead.
+ */
+int
+extract_unchanged(Inode *inode, const char *host_path)
+{
+  struct stat st;
+
+  if (lstat(host_path, &st) < 0 || !S_ISREG(st.st_mode))
+    {
+      return 0;
+    }
+
+  return st.st_size == (off_t)inode->size && st.st_mtime == inode->mtime
+    && ( st.st_mode & 0777 ) == ( inode->mode & 0777 );
+}
+
+/* QUEUE A FILE FOR extract, UNLESS --incremental FINDS IT CURRENT */
+/* Unchanged files are still queued with --hash, to be hashed but not written */
+int
+extract_queue_file(ExtractQueue *queue, Inode *inode, const char *host_path)
+{
+  if (!extract_incremental || !extract_unchanged(inode, host_path))
+    {
+      return extract_queue_add(queue, inode, host_path);
+    }
+
+  TRACE(1, "%s unchanged\n", host_path);
+  queue->unchanged++;
+  queue->unchanged_bytes += inode->size;
+  if (hash_manifest == NULL)
+    {
+      return 0;
+    }
+
+  if (extract_queue_add(queue, inode, host_path) < 0)
+    {
+      return -1;
+    }
+
+  queue->job[queue->count - 1].unchanged = 1;
+  return 0;
+}
+
+/* COPY ONE QUEUED FILE */
+/* Runs on worker threads: private block map, pread()/mmap access only */
+int
+extract_file(ExtractJob *job, uint8_t *buf)
+{
+  BlockMap map;
+  int fd;
+  int rv;
+
+  TRACE(1, "%s (%u bytes)\n", job->host_path, job->inode.size);
+  fd = host_create(job->host_path);
+  if (fd < 0)
+    {
+      printf("unixtool: extract: %s: %s\n", job->host_path,
+             strerror(errno));
+      return -1;
+    }
+
+  rv = block_map_build(&job->inode, &map);
+  if (rv == 0)
+    {
+      uint64_t start = stats_clock();
+      rv = inode_copy(&job->inode, &map, fd, buf);
+      stats_phase(PHASE_COPY, start);
+      block_map_free(&map);
+    }
+
+  if (rv == 0)
+    {
+      rv = host_restore(fd, job->host_path, &job->inode);
+    }
+
+  if (close(fd) < 0 && rv == 0)
+    {
+      perror("unixtool: extract close()");
+      rv = -1;
+    }
+
+  if (rv < 0)
+    {
+      printf("unixtool: extract: %s: copy failed\n", job->host_path);
+    }
+
+  return rv;
+}
+
+/* DIGEST INODE CONTENTS */
+/*
+ * Reads each extent once: mapped images are hashed in place, others
+ * through buf (COPY_BUFFER_SIZE bytes) with the next extents hinted to
+ * the kernel ahead of use.  Holes hash as zeros.
+ */
+int
+inode_hash(Inode *inode, BlockMap *map, uint8_t *buf, uint8_t *digest)
+{
+  Sha256 ctx;
+  uint32_t extent = 0; /* Extent index into source file */
+  uint32_t ahead = 0;  /* Extents hinted so far */
+  uint32_t x = 0;      /* Bytes hashed so far */
+
+  sha256_init(&ctx);
+  while (extent < map->nextents && x < inode->size)
+    {
+      Extent *ext = &map->extent[extent++];
+      off_t offset = (off_t)ext->start * 0x400;
+      size_t len = (size_t)ext->length * 1024;
+      if (( inode->size - x ) < len)
+        {
+          len = inode->size - x;
+        }
+
+      copy_readahead(map, &ahead, extent + copy_depth);
+      x += len;
+      if (ext->start == 0)
+        {
+          sha256_update(&ctx, NULL, len);
+          continue;
+        }
+
+      while (len > 0)
+        {
+          const uint8_t *ptr;
+          ssize_t io_res = disk_ptr(
+            offset,
+            len < COPY_BUFFER_SIZE ? len : COPY_BUFFER_SIZE,
+            buf,
+            &ptr);
+          if (io_res <= 0)
+            {
+              if (io_res == 0)
+                {
+                  printf("unixtool: Unexpected end-of-file\n");
+                }
+
+              return -1;
+            }
+
+          sha256_update(&ctx, ptr, io_res);
+          offset += io_res;
+          len -= io_res;
+        }
+    }
+  sha256_final(&ctx, digest);
+  return 0;
+}
+
+/* DIGEST ONE QUEUED FILE (hash) */
+int
+hash_file(ExtractJob *job, uint8_t *buf)
+{
+  BlockMap map;
+  int rv = block_map_build(&job->inode, &map);
+
+  if (rv == 0)
+    {
+      uint64_t start = stats_clock();
+      rv = inode_hash(&job->inode, &map, buf, job->digest);
+      stats_phase(PHASE_COPY, start);
+      block_map_free(&map);
+    }
+
+  if (rv < 0)
+    {
+      printf("unixtool: hash: %s: read failed\n", job->host_path);
+      return -1;
+    }
+
+  job->hashed = 1;
+  return 0;
+}
+
+/* ORDER ExtractJob POINTERS BY PATH */
+int
+manifest_compare(const void *a, const void *b)
+{
+  const ExtractJob *ja = *(ExtractJob *const *)a;
+  const ExtractJob *jb = *(ExtractJob *const *)b;
+
+  return strcmp(ja->host_path, jb->host_path);
+}
+
+/* APPEND MANIFEST LINES FOR THE HASHED JOBS, SORTED BY PATH */
+int
+manifest_write(ExtractJob *jobs, size_t count)
+{
+  FILE *out = manifest_open();
+  ExtractJob **sorted;
+  size_t x;
+
+  if (out == NULL)
+    {
+      return -1;
+    }
+
+  sorted = malloc(( count ? count : 1 ) * sizeof ( ExtractJob * ));
+  if (sorted == NULL)
+    {
+      perror("unixtool: manifest malloc()");
+      return -1;
+    }
+
+  for (x = 0; x < count; x++)
+    {
+      sorted[x] = &jobs[x];
+    }
+
+  qsort(sorted, count, sizeof ( ExtractJob * ), manifest_compare);
+  for (x = 0; x < count; x++)
+    {
+      if (sorted[x]->hashed)
+        {
+          manifest_line(out, sorted[x]->digest, &sorted[x]->inode,
+                        sorted[x]->host_path);
+        }
+    }
+  free(sorted);
+  if (fflush(out) != 0 || ferror(out))
+    {
+      perror("unixtool: manifest write");
+      return -1;
+    }
+
+  return 0;
+}
+
+/* EXTRACT WORKER THREAD */
+void *
+extract_worker(void *arg)
+{
+  ExtractQueue *queue = arg;
+  uint8_t *buf = copy_buffer_alloc();
+
+  disk = queue->image;
+  if (buf == NULL)
+    {
+      pthread_mutex_lock(&queue->lock);
+      queue->errors++;
+      pthread_mutex_unlock(&queue->lock);
+      return NULL;
+    }
+
+  for (;;)
+    {
+      ExtractJob *job;
+      int rv;
+
+      pthread_mutex_lock(&queue->lock);
+      if (queue->next >= queue->count)
+        {
+          pthread_mutex_unlock(&queue->lock);
+          break;
+        }
+
+      job = &queue->job[queue->next++];
+      pthread_mutex_unlock(&queue->lock);
+
+      if (queue->hash_only || job->unchanged)
+        {
+          rv = hash_file(job, buf);
+        }
+      else if (hash_manifest != NULL)
+        {
+          Sha256 ctx;
+          sha256_init(&ctx);
+          copy_hash = &ctx;
+          rv = extract_file(job, buf);
+          copy_hash = NULL;
+          sha256_final(&ctx, job->digest);
+          job->hashed = rv == 0;
+        }
+      else
+        {
+          rv = extract_file(job, buf);
+        }
+
+      pthread_mutex_lock(&queue->lock);
+      if (rv < 0)
+        {
+          queue->errors++;
+        }
+      else if (!job->unchanged)
+        {
+          queue->bytes += job->inode.size;
+        }
+
+      pthread_mutex_unlock(&queue->lock);
+    }
+  free(buf);
+  return NULL;
+}
+
+/* CREATE A HOST DIRECTORY AND QUEUE ITS FILES (tree_walk() VISITOR) */
+/* The walk starts at the target directory, so its paths are host paths */
+int
+extract_visit(const char *host_dir, Inode *dir, DirIndex *index, void *ctx)
+{
+  ExtractQueue *queue = ctx;
+  int x = 0;
+
+  if (mkdir(host_dir, 0755) < 0 && errno != EEXIST)
+    {
+      printf("unixtool: extract: %s: %s\n", host_dir, strerror(errno));
+      return -1;
+    }
+
+  if (extract_list_add(&queue->dir, &queue->dirs, &queue->dir_alloc, dir,
+                       host_dir) < 0)
+    {
+      return -1;
+    }
+
+  while (x < index->count)
+    {
+      DirEntry *ent = &index->entry[x++];
+      Inode inode;
+      char *host_path;
+      int rv = 0;
+
+      if (strcmp(ent->name, ".") == 0 || strcmp(ent->name, "..") == 0)
+        {
+          continue;
+        }
+
+      if (!dir_name_valid(ent->name))
+        {
+          printf("unixtool: extract: %s: bad entry name \"%s\", skipped\n",
+                 host_dir, ent->name);
+          queue->errors++;
+          continue;
+        }
+
+      if (read_inode(ent->inode, &inode) < 0)
+        {
+          queue->errors++;
+          continue;
+        }
+
+      if (inode.type == INODE_FT_DIR)
+        {
+          continue;
+        }
+
+      host_path = walk_path_join(host_dir, ent->name);
+      if (host_path == NULL)
+        {
+          return -1;
+        }
+
+      if (inode.type == INODE_FT_FILE)
+        {
+          rv = extract_queue_file(queue, &inode, host_path);
+        }
+      else
+        {
+          printf("unixtool: extract: %s: special file, skipped\n",
+                 host_path);
+        }
+
+      free(host_path);
+      if (rv < 0)
+        {
+          return -1;
+        }
+    }
+  return 0;
+}
+
+/* WORK THROUGH THE QUEUE ON -j THREADS (DEFAULT: ONE PER CPU) */
+void
+extract_run(ExtractQueue *queue)
+{
+  pthread_t *threads;
+  long nthreads = extract_threads;
+  long started = 0;
+  long x = 0;
+
+  if (nthreads <= 0)
+    {
+      nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+
+  if (nthreads > (long)queue->count)
+    {
+      nthreads = queue->count;
+    }
+
+  if (nthreads <= 1)
+    {
+      extract_worker(queue);
+      return;
+    }
+
+  threads = malloc(nthreads * sizeof ( pthread_t ));
+  while (threads != NULL && started < nthreads
+         && pthread_create(&threads[started], NULL, extract_worker, queue)
+         == 0)
+    {
+      started++;
+    }
+  if (started == 0)
+    {
+      /* No threads to be had; do it ourselves */
+      extract_worker(queue);
+    }
+
+  while (x < started)
+    {
+      pthread_join(threads[x++], NULL);
+    }
+  free(threads);
+}
+
+/* QUEUE THE FILES OF ONE DIRECTORY FOR hash (tree_walk() VISITOR) */
+int
+hash_visit(const char *path, Inode *dir, DirIndex *index, void *ctx)
+{
+  ExtractQueue *queue = ctx;
+  int x = 0;
+
+  (void)dir;
+  while (x < index->count)
+    {
+      DirEntry *ent = &index->entry[x++];
+      Inode inode;
+      char *full;
+      int rv;
+
+      if (strcmp(ent->name, ".") == 0 || strcmp(ent->name, "..") == 0)
+        {
+          continue;
+        }
+
+      if (read_inode(ent->inode, &inode) < 0)
+        {
+          return -1;
+        }
+
+      if (inode.type != INODE_FT_FILE)
+        {
+          continue;
+        }
+
+      full = walk_path_join(path, ent->name);
+      if (full == NULL)
+        {
+          return -1;
+        }
+
+      rv = extract_queue_add(queue, &inode, full);
+      free(full);
+      if (rv < 0)
+        {
+          return -1;
+        }
+    }
+  return 0;
+}
+
+/* WRITE A SHA-256 MANIFEST OF THE FILES UNDER path */
+/*
+ * Files are hashed on -j threads, one file per job, straight from the
+ * image (see inode_hash()).  The manifest goes to stdout, or to the
+ * --hash file.
+ */
+int
+unix_hash(char *path)
+{
+  ExtractQueue queue;
+  Inode inode;
+  size_t x = 0;
+  int rv;
+
+  if (namei(path, &inode) < 0)
+    {
+      return -1;
+    }
+
+  while (strlen(path) > 1 && path[strlen(path) - 1] == '/')
+    {
+      path[strlen(path) - 1] = 0;
+    }
+
+  memset(&queue, 0, sizeof ( queue ));
+  queue.image = disk;
+  queue.hash_only = 1;
+  pthread_mutex_init(&queue.lock, NULL);
+  if (inode.type == INODE_FT_DIR)
+    {
+      rv = tree_walk(path, &inode, hash_visit, &queue);
+    }
+  else if (inode.type == INODE_FT_FILE)
+    {
+      rv = extract_queue_add(&queue, &inode, path);
+    }
+  else
+    {
+      printf("unixtool: hash: %s: special file\n", path);
+      rv = -1;
+    }
+
+  if (rv == 0)
+    {
+      extract_run(&queue);
+      rv = manifest_write(queue.job, queue.count);
+      printf("unixtool: hash: %zu files (%llu bytes)\n",
+             queue.count - queue.errors, (unsigned long long)queue.bytes);
+    }
+
+  while (x < queue.count)
+    {
+      free(queue.job[x++].host_path);
+    }
+  free(queue.job);
+  pthread_mutex_destroy(&queue.lock);
+  if (rv < 0 || queue.errors > 0)
+    {
+      return -1;
+    }
+
+  return 0;
+}
+
+int
+unix_extract(char *path, char *hostdir)
+{
+  /* Recreate path (from image) under hostdir (on host) */
+  ExtractQueue queue;
+  Inode inode;
+  long x = 0;
+  int rv = 0;
+
+  if (namei(path, &inode) < 0)
+    {
+      return -1;
+    }
+
+  memset(&queue, 0, sizeof ( queue ));
+  queue.image = disk;
+  pthread_mutex_init(&queue.lock, NULL);
+  if (inode.type == INODE_FT_DIR)
+    {
+      rv = tree_walk(hostdir, &inode, extract_visit, &queue);
+    }
+  else if (inode.type == INODE_FT_FILE)
+    {
+      /* Single file: hostdir/basename */
+      char host_path[4096];
+      char *base;
+      while (strlen(path) > 1 && path[strlen(path) - 1] == '/')
+        {
+          path[strlen(path) - 1] = 0;
+        }
+
+      base = strrchr(path, '/') + 1;
+      if (mkdir(hostdir, 0755) < 0 && errno != EEXIST)
+        {
+          printf("unixtool: extract: %s: %s\n", hostdir,
+                 strerror(errno));
+          return -1;
+        }
+
+      snprintf(host_path, sizeof ( host_path ), "%s/%s", hostdir, base);
+      rv = extract_queue_file(&queue, &inode, host_path);
+    }
+  else
+    {
+      printf("unixtool: extract: %s: special file\n", path);
+      return -1;
+    }
+
+  if (rv == 0)
+    {
+      extract_run(&queue);
+    }
+
+  /* Directory times last, innermost first, once nothing more goes in */
+  x = queue.dirs;
+  while (x > 0)
+    {
+      x--;
+      if (host_restore(-1, queue.dir[x].host_path, &queue.dir[x].inode) < 0)
+        {
+          rv = -1;
+        }
+    }
+
+  if (hash_manifest != NULL && manifest_write(queue.job, queue.count) < 0)
+    {
+      rv = -1;
+    }
+
+  printf(
+    "Extracted %zu files (%llu bytes) in %zu directories\n",
+    queue.count - queue.errors - ( hash_manifest != NULL ? queue.unchanged : 0 ),
+    (unsigned long long)queue.bytes,
+    queue.dirs);
+  if (extract_incremental)
+    {
+      printf("Skipped %zu unchanged files (%llu bytes)\n", queue.unchanged,
+             (unsigned long long)queue.unchanged_bytes);
+    }
+
+  x = 0;
+  while ((size_t)x < queue.count)
+    {
+      free(queue.job[x++].host_path);
+    }
+  free(queue.job);
+  x = 0;
+  while ((size_t)x < queue.dirs)
+    {
+      free(queue.dir[x++].host_path);
+    }
+  free(queue.dir);
+  pthread_mutex_destroy(&queue.lock);
+  if (rv < 0 || queue.errors > 0)
+    {
+      return -1;
+    }
+
+  return 0;
+}
+
+/* SPLIT BATCH LINE INTO WORDS */
+/*
+ * Words are separated by whitespace; "double quotes" keep a word with
+ * spaces together and # starts a comment.  Returns the word count, or -1
+ * if there are more than max words.
+ */
+int
+batch_split(char *line, char **word, int max)
+{
+  int count = 0;
+
+  for (;;)
+    {
+      char *out;
+      while (*line == ' ' || *line == '\t' || *line == '\r' || *line == '\n')
+        {
+          line++;
+        }
+
+      if (*line == 0 || *line == '#')
+        {
+          return count;
+        }
+
+      if (count == max)
+        {
+          return -1;
+        }
+
+      word[count++] = out = line;
+      while (*line != 0 && *line != ' ' && *line != '\t' && *line != '\r'
+             && *line != '\n')
+        {
+          if (*line == '"')
+            {
+              /* Quoted run */
+              line++;
+              while (*line != 0 && *line != '"')
+                {
+                  *out++ = *line++;
+                }
+
+              if (*line == '"')
+                {
+                  line++;
+                }
+
+              continue;
+            }
+
+          *out++ = *line++;
+        }
+      if (*line != 0)
+        {
+          line++;
+        }
+
+      *out = 0;
+    }
+}
+
+int
+unix_batch(char *manifest)
+{
+  /* Run the operations listed in manifest (or stdin) against the image */
+  FILE *in = stdin;
+  char line[8192];
+  int lineno = 0;
+  int ops = 0;
+  int failed = 0;
+
+  if (manifest != NULL && strcmp(manifest, "-") != 0)
+    {
+      in = fopen(manifest, "r");
+      if (in == NULL)
+        {
+          perror("unixtool: batch fopen()");
+          return -1;
+        }
+    }
+
+  while (fgets(line, sizeof ( line ), in) != NULL)
+    {
+      char *word[4];
+      int count;
+      int rv = -1;
+
+      lineno++;
+      if (strchr(line, '\n') == NULL && !feof(in))
+        {
+          /* Skip the rest of an over-long line */
+          int c;
+          while (( c = getc(in)) != EOF && c != '\n')
+            {
+              ;
+            }
+          printf("unixtool: batch: line %d: line too long\n", lineno);
+          ops++;
+          failed++;
+          continue;
+        }
+
+      count = batch_split(line, word, 4);
+      if (count == 0)
+        {
+          continue;
+        }
+
+      ops++;
+      if (count == 2 && strcmp(word[0], "ls") == 0)
+        {
+          rv = unix_ls(word[1]);
+        }
+      else if (count == 3 && strcmp(word[0], "read") == 0)
+        {
+          rv = unix_read(word[1], word[2]);
+        }
+      else if (count == 3 && strcmp(word[0], "extract") == 0)
+        {
+          rv = unix_extract(word[1], word[2]);
+        }
+      else
+        {
+          printf("unixtool: batch: line %d: expected \"ls <directory>\", "
+                 "\"read <source> <destination>\" or \"extract <source> "
+                 "<destination directory>\"\n", lineno);
+        }
+
+      if (rv < 0)
+        {
+          failed++;
+        }
+    }
+  if (ferror(in))
+    {
+      perror("unixtool: batch read");
+      failed++;
+    }
+
+  if (in != stdin)
+    {
+      fclose(in);
+    }
+
+  printf("Batch: %d operations, %d failed\n", ops, failed);
+  return failed > 0 ? -1 : 0;
+}
+
+/* STRIP GLOBAL OPTIONS FROM ARGV */
+/* Options may appear anywhere; returns the count of remaining arguments */
+int
+parse_options(int argc, char *argv[])
+{
+  int in = 1;
+  int out = 1;
+
+  while (in < argc)
+    {
+      char *arg = argv[in++];
+      if (strcmp(arg, "--") == 0)
+        {
+          /* Everything after is positional */
+          while (in < argc)
+            {
+              argv[out++] = argv[in++];
+            }
+          break;
+        }
+
+      if (strcmp(arg, "-v") == 0 || strcmp(arg, "--verbose") == 0)
+        {
+          verbose++;
+          continue;
+        }
+
+      if (strcmp(arg, "-vv") == 0)
+        {
+          verbose += 2;
+          continue;
+        }
+
+      if (strcmp(arg, "--cache") == 0)
+        {
+          /* --cache N: buffer cache blocks */
+          char *value = argv[in++];
+          char *end = NULL;
+          if (value != NULL)
+            {
+              bcache_blocks = strtol(value, &end, 10);
+            }
+
+          if (value == NULL || *end != 0 || bcache_blocks < 1)
+            {
+              printf("unixtool: %s: block count required\n", arg);
+              exit(-1);
+            }
+
+          continue;
+        }
+
+      if (strcmp(arg, "--stats") == 0 || strcmp(arg, "--stats=text") == 0)
+        {
+          stats_enabled = 1;
+          continue;
+        }
+
+      if (strcmp(arg, "--stats=json") == 0)
+        {
+          stats_enabled = 2;
+          continue;
+        }
+
+      if (strcmp(arg, "--index") == 0)
+        {
+          /* --index FILE: index file other than <image>.idx */
+          index_fname = argv[in++];
+          if (index_fname == NULL)
+            {
+              printf("unixtool: %s: file name required\n", arg);
+              exit(-1);
+            }
+
+          continue;
+        }
+
+      if (strcmp(arg, "--no-index") == 0)
+        {
+          index_disabled = 1;
+          continue;
+        }
+
+      if (strcmp(arg, "--hash") == 0)
+        {
+          /* --hash F: manifest of files read/extracted */
+          hash_manifest = argv[in++];
+          if (hash_manifest == NULL)
+            {
+              printf("unixtool: %s: manifest file name required\n", arg);
+              exit(-1);
+            }
+
+          continue;
+        }
+
+      if (strcmp(arg, "--direct") == 0)
+        {
+          copy_direct = 1;
+          continue;
+        }
+
+      if (strcmp(arg, "--offset") == 0 || strcmp(arg, "--band") == 0)
+        {
+          /* --offset BYTES (0x... for hex) or --band N (from scan) */
+          char *value = argv[in++];
+          char *end = NULL;
+          long long number = -1;
+          if (value != NULL)
+            {
+              number = strtoll(value, &end, 0);
+            }
+
+          if (value == NULL || *end != 0 || number < 0)
+            {
+              printf("unixtool: %s: %s required\n", arg,
+                     arg[2] == 'o' ? "byte offset" : "band number");
+              exit(-1);
+            }
+
+          if (arg[2] == 'o')
+            {
+              image_offset = number;
+            }
+          else
+            {
+              image_band = number;
+            }
+
+          continue;
+        }
+
+      if (strcmp(arg, "--incremental") == 0)
+        {
+          extract_incremental = 1;
+          continue;
+        }
+
+      if (strcmp(arg, "--qd") == 0)
+        {
+          /* --qd N: copy queue depth */
+          char *value = argv[in++];
+          char *end = NULL;
+          long depth = 0;
+          if (value != NULL)
+            {
+              depth = strtol(value, &end, 10);
+            }
+
+          if (value == NULL || *end != 0 || depth < 1 || depth > 256)
+            {
+              printf("unixtool: %s: queue depth (1-256) required\n", arg);
+              exit(-1);
+            }
+
+          copy_depth = depth;
+          continue;
+        }
+
+      if (strcmp(arg, "-R") == 0)
+        {
+          ls_recursive = 1;
+          continue;
+        }
+
+      if (strncmp(arg, "-j", 2) == 0 || strcmp(arg, "--jobs") == 0)
+        {
+          /* -j N, -jN or --jobs N */
+          char *value = arg[1] == 'j' && arg[2] != 0 ? arg + 2 : argv[in++];
+          char *end = NULL;
+          if (value != NULL)
+            {
+              extract_threads = strtol(value, &end, 10);
+            }
+
+          if (value == NULL || *end != 0 || extract_threads < 1)
+            {
+              printf("unixtool: %s: thread count required\n", arg);
+              exit(-1);
+            }
+
+          continue;
+        }
+
+      argv[out++] = arg;
+    }
+  argv[out] = NULL;
+  return out;
+}
+
+/* LIBRARY INTERFACE (see unixtool.h) */
+
+pthread_once_t library_once = PTHREAD_ONCE_INIT;
+
+/* MAKE IMAGE CURRENT FOR THIS THREAD AND LOCK IT; RETURNS THE OLD ONE */
+Image *
+library_enter(Image *image)
+{
+  Image *prev = disk;
+
+  pthread_mutex_lock(&image->lock);
+  disk = image;
+  return prev;
+}
+
+/* UNDO library_enter() */
+void
+library_leave(Image *image, Image *prev)
+{
+  pthread_mutex_unlock(&image->lock);
+  disk = prev;
+}
+
+/* FILL LIBRARY STAT FROM INODE */
+void
+library_stat_fill(const Inode *inode, UnixtoolStat *st)
+{
+  memset(st, 0, sizeof ( *st ));
+  st->ino = inode->number;
+  st->mode = inode->mode & 07777;
+  switch (inode->type)
+    {
+    case INODE_FT_FIFO:
+      st->mode |= S_IFIFO;
+      break;
+
+    case INODE_FT_CHAR:
+      st->mode |= S_IFCHR;
+      st->rdev = inode->addr[0];
+      break;
+
+    case INODE_FT_DIR:
+      st->mode |= S_IFDIR;
+      break;
+
+    case INODE_FT_BLK:
+      st->mode |= S_IFBLK;
+      st->rdev = inode->addr[0];
+      break;
+
+    default:
+      st->mode |= S_IFREG;
+      break;
+    }
+  st->nlink = inode->nlink;
+  st->uid = inode->uid;
+  st->gid = inode->gid;
+  st->size = inode->size;
+  st->atime = inode->atime;
+  st->mtime = inode->mtime;
+  st->ctime = inode->ctime;
+}
+
+UNIXTOOL_API UnixtoolImage *
+unixtool_open(const char *fname)
+{
+  Image *prev = disk;
+  Image *image;
+
+  pthread_once(&library_once, decode_kernels_init);
+  image = image_open(fname);
+  disk = prev;
+  if (image == NULL && errno == 0)
+    {
+      errno = EINVAL;
+    }
+
+  return image;
+}
+
+UNIXTOOL_API void
+unixtool_close(UnixtoolImage *image)
+{
+  image_close(image);
+}
+
+UNIXTOOL_API int
+unixtool_stat(UnixtoolImage *image, const char *path, UnixtoolStat *st)
+{
+  Image *prev = library_enter(image);
+  Inode inode;
+  int rv = -1;
+
+  errno = 0;
+  if (namei(path, &inode) > 0)
+    {
+      library_stat_fill(&inode, st);
+      rv = 0;
+    }
+  else if (errno == 0)
+    {
+      errno = EIO;
+    }
+
+  library_leave(image, prev);
+  return rv;
+}
+
+UNIXTOOL_API int
+unixtool_fstat(UnixtoolImage *image, uint32_t ino, UnixtoolStat *st)
+{
+  Image *prev = library_enter(image);
+  Inode inode;
+  int rv = -1;
+
+  if (ino < 1 || ino > (uint32_t)disk->inode_count)
+    {
+      errno = EINVAL;
+    }
+  else if (read_inode(ino, &inode) < 0)
+    {
+      errno = EIO;
+    }
+  else
+    {
+      library_stat_fill(&inode, st);
+      rv = 0;
+    }
+
+  library_leave(image, prev);
+  return rv;
+}
+
+UNIXTOOL_API int
+unixtool_readdir(UnixtoolImage *image, const char *path,
+                 UnixtoolDirent **entries)
+{
+  Image *prev = library_enter(image);
+  DirIndex *index = NULL;
+  Inode inode;
+  int rv = -1;
+  int x;
+
+  errno = 0;
+  *entries = NULL;
+  if (namei(path, &inode) <= 0)
+    {
+      if (errno == 0)
         {
-          /* Read next block */
-          dirblock++;
+          errno = EIO;
         }
     }
-  return 0;
+  else if (inode.type != INODE_FT_DIR)
+    {
+      errno = ENOTDIR;
+    }
+  else if (( index = dir_index_get(&inode)) == NULL)
+    {
+      errno = EIO;
+    }
+  else if (( *entries = calloc(index->count + 1, sizeof ( **entries ))) == NULL)
+    {
+      errno = ENOMEM;
+    }
+  else
+    {
+      for (x = 0; x < index->count; x++)
+        {
+          ( *entries )[x].ino = index->entry[x].inode;
+          memcpy(( *entries )[x].name, index->entry[x].name, 14);
+        }
+      rv = index->count;
+    }
+
+  library_leave(image, prev);
+  return rv;
 }
 
-int
-unix_read(char *path, char *filename)
+/*
+ * The block numbers for the range are copied out under the lock; the
+ * data itself is read without it, in runs of contiguous blocks.
+ */
+UNIXTOOL_API ssize_t
+unixtool_pread(UnixtoolImage *image, uint32_t ino, void *buf, size_t len,
+               uint64_t offset)
 {
-  /* Read path (from image) into filename (on host) */
-  Inode dir_inode;
-  Inode file_inode;
-  char *pathpart;
-  uint8_t dir_buffer[1024];
-  uint8_t file_buffer[1024];
-  unsigned int x = 0;   /* index into directory */
-  int dirblock = 0;     /* Block index into directory inode */
-  int fileblock = 0;    /* Block index into source file */
-  int rv = 0;
-  int done = 0;
-  uint16_t dir_inode_number = 0;
-  uint16_t file_inode_number = 0;
+  Image *prev = library_enter(image);
+  uint8_t *out = buf;
+  uint32_t *blocks = NULL;
+  uint32_t count = 0;
+  uint32_t x = 0;
+  size_t done = 0;
+  BlockMap *map = NULL;
+  Inode inode;
 
-  /* Fast checks */
-  if (path[0] != '/')
+  if (ino < 1 || ino > (uint32_t)disk->inode_count)
     {
-      printf("unixtool: read: Invalid path\n");
+      library_leave(image, prev);
+      errno = EINVAL;
       return -1;
     }
 
-  /* Open target */
-  file_fd = open(filename, O_RDWR | O_CREAT, 0660);
-  if (file_fd < 0)
+  if (read_inode(ino, &inode) < 0
+      || ( offset < inode.size && ( map = inode_block_map(&inode)) == NULL ))
     {
-      perror("unixtool:open()");
+      library_leave(image, prev);
+      errno = EIO;
       return -1;
     }
 
-  /* Load the root directory */
-  rv = read_inode(2, &dir_inode);
-  if (rv < 0)
+  if (offset >= inode.size)
     {
-      return rv;
+      len = 0;
+    }
+  else if (len > inode.size - offset)
+    {
+      len = inode.size - offset;
     }
 
-  /* Walk path */
-  pathpart = strtok(path, "/");
-  while (pathpart != NULL)
+  if (len > 0)
     {
-      if (file_inode_number != 0)
+      uint32_t first = offset / 0x400;
+      count = ( offset + len - 1 ) / 0x400 - first + 1;
+      blocks = malloc(count * sizeof ( uint32_t ));
+      if (blocks == NULL)
         {
-          /* We already found a regular file? Something went wrong. */
-          printf(
-            "unixtool: No such file or directory (found regular file early "
-            "in image).\n");
-          return 0;
+          library_leave(image, prev);
+          errno = ENOMEM;
+          return -1;
         }
 
-      printf("pathpart: %s\n", pathpart);
-      done = 0;
-      while (!done)
+      memcpy(blocks, map->block + first, count * sizeof ( uint32_t ));
+    }
+
+  pthread_mutex_unlock(&image->lock);
+  while (done < len)
+    {
+      uint32_t within = ( offset + done ) % 0x400;
+      uint32_t run = 1;
+      size_t chunk;
+
+      while (x + run < count
+             && ( blocks[x] == 0 ? blocks[x + run] == 0
+                  : blocks[x + run] == blocks[x] + run ))
         {
-          Dirent *dir_entry = (Dirent *)&dir_buffer;
-          rv = inode_block_read(dirblock, &dir_inode, dir_buffer);
-          if (rv < 0)
-            {
-              return rv;
-            }
+          run++;
+        }
 
-          if (rv == 0)
-            {
-              return 0;
-            } /* EOF, we are done */
+      chunk = (size_t)run * 0x400 - within;
+      if (chunk > len - done)
+        {
+          chunk = len - done;
+        }
 
-          x = 0;
-          dir_inode_number = 0;
-          while (dir_entry->inode != 0 && x < 64)
+      if (blocks[x] == 0)
+        {
+          /* Hole */
+          memset(out + done, 0, chunk);
+        }
+      else
+        {
+          const uint8_t *ptr;
+          ssize_t io_res = disk_ptr(
+            (off_t)blocks[x] * 0x400 + within,
+            chunk,
+            out + done,
+            &ptr);
+          if (io_res < (ssize_t)chunk)
             {
-              /* Stuff */
-              if (strlen(pathpart) > 14)
+              if (io_res >= 0)
                 {
-                  /* Very funny. */
-                  printf("unixtool: No such file or directory (in image).\n");
-                  return 0;
-                }
-
-              /* printf("ent %d: %s\n",x,dir_entry->name); */
-              if (strncmp(pathpart, (const char *)dir_entry->name, 14) == 0)
-                {
-                  /* FOUND! */
-                  rv = read_inode(swap_hword(dir_entry->inode), &file_inode);
-                  if (rv < 0)
-                    {
-                      return rv;
-                    }
-
-                  if (file_inode.type == INODE_FT_DIR)
-                    {
-                      /* Subdirectory */
-                      dir_inode_number = swap_hword(dir_entry->inode);
-                      /* printf("SUBDIRECTORY at %.4X\n",dir_inode_number); */
-                      rv = read_inode(dir_inode_number, &dir_inode);
-                      if (rv < 0)
-                        {
-                          return rv;
-                        }
-
-                      dirblock = 0;
-                    }
-
-                  if (file_inode.type == INODE_FT_FILE)
-                    {
-                      /* Regular file */
-                      file_inode_number = swap_hword(dir_entry->inode);
-                    }
-
-                  done = 1;
-                  break;
+                  printf(
+                    "unixtool: inode %u: block %u is beyond the end of the "
+                    "image\n",
+                    ino,
+                    blocks[x]);
                 }
 
-              dir_entry++;
-              x++;
-            }
-          if (x < 64)
-            {
-              /* We are done! */
-              done = 1;
+              free(blocks);
+              disk = prev;
+              errno = EIO;
+              return -1;
             }
-          else
+
+          if (ptr != out + done)
             {
-              /* Read next block */
-              dirblock++;
+              memcpy(out + done, ptr, chunk);
             }
         }
-      if (dir_inode_number == 0 && file_inode_number == 0)
-        {
-          printf(
-            "unixtool: No such file or directory (in image, path search).\n");
-          return -1;
-        }
 
-      /* Otherwise obtain next part and carry on */
-      pathpart = strtok(NULL, "/");
+      done += chunk;
+      x += run;
     }
-  if (file_inode_number == 0)
+
+  free(blocks);
+  disk = prev;
+  return done;
+}
+
+#if !defined(UNIXTOOL_LIBRARY)
+
+/* READ-ONLY FUSE MOUNT (mount) */
+/*
+ * Built on the library calls above, so each request takes the image lock
+ * only to resolve a path or copy out a block list, and FUSE's worker
+ * threads read data in parallel.  The image doesn't change while mounted:
+ * attributes, names and misses are cached by the kernel for a day and
+ * file pages are kept across opens.
+ */
+#if defined(UNIXTOOL_FUSE)
+
+#define MOUNT_TIMEOUT 86400.0 /* Seconds the kernel may cache lookups */
+
+/* UnixtoolStat TO HOST stat */
+void
+mount_stat_fill(const UnixtoolStat *ust, struct stat *st)
+{
+  memset(st, 0, sizeof ( *st ));
+  st->st_ino = ust->ino;
+  st->st_mode = ust->mode;
+  st->st_nlink = ust->nlink;
+  st->st_uid = ust->uid;
+  st->st_gid = ust->gid;
+  st->st_rdev = ust->rdev;
+  st->st_size = ust->size;
+  st->st_blksize = COPY_BUFFER_SIZE; /* cp and friends read this much */
+  st->st_blocks = ( (off_t)ust->size + 511 ) / 512;
+  st->st_atime = ust->atime;
+  st->st_mtime = ust->mtime;
+  st->st_ctime = ust->ctime;
+}
+
+void *
+mount_init(struct fuse_conn_info *conn, struct fuse_config *cfg)
+{
+  (void)conn;
+  cfg->use_ino = 1;
+  cfg->kernel_cache = 1;
+  cfg->entry_timeout = MOUNT_TIMEOUT;
+  cfg->attr_timeout = MOUNT_TIMEOUT;
+  cfg->negative_timeout = MOUNT_TIMEOUT;
+  return fuse_get_context()->private_data;
+}
+
+int
+mount_getattr(const char *path, struct stat *st, struct fuse_file_info *fi)
+{
+  UnixtoolImage *image = fuse_get_context()->private_data;
+  UnixtoolStat ust;
+  /* Only open files carry an inode in fh; directories leave it 0 */
+  int rv = fi != NULL && fi->fh != 0 ? unixtool_fstat(image, fi->fh, &ust)
+    : unixtool_stat(image, path, &ust);
+
+  if (rv < 0)
     {
-      printf("unixtool: No such file or directory (in image, file read).\n");
-      return 0;
+      return -errno;
     }
 
-  /* Do the deed! */
-  printf("Copying %d bytes\n", file_inode.size);
-  x = 0;
-  while (x < file_inode.size)
+  mount_stat_fill(&ust, st);
+  return 0;
+}
+
+/* Attributes go with the names, for readdirplus */
+int
+mount_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+              off_t offset, struct fuse_file_info *fi,
+              enum fuse_readdir_flags flags)
+{
+  UnixtoolImage *image = fuse_get_context()->private_data;
+  UnixtoolDirent *entries;
+  int count = unixtool_readdir(image, path, &entries);
+  int x;
+
+  (void)offset;
+  (void)fi;
+  if (count < 0)
     {
-      int osize = 1024;
-      if (( file_inode.size - x ) < 1024)
-        {
-          osize = file_inode.size - x;
-        }
+      return -errno;
+    }
 
-      rv = inode_block_read(fileblock, &file_inode, file_buffer);
-      if (rv < 0)
-        {
-          return rv;
-        }
+  for (x = 0; x < count; x++)
+    {
+      UnixtoolStat ust;
+      struct stat st;
 
-      if (rv == 0)
+      if (entries[x].ino == 0 || unixtool_fstat(image, entries[x].ino, &ust) < 0)
         {
-          /* EOF, we are done early? */
-          printf("unixtool: Unexpected end-of-file\n");
-          return -1;
+          continue;
         }
 
-      rv = write(file_fd, file_buffer, osize);
-      if (rv < 0)
+      mount_stat_fill(&ust, &st);
+      if (filler(buf, entries[x].name, &st, 0,
+                 flags & FUSE_READDIR_PLUS ? FUSE_FILL_DIR_PLUS : 0) != 0)
         {
-          perror("unixtool:write()");
-          return -1;
+          break;
         }
+    }
+  free(entries);
+  return 0;
+}
 
-      x += osize;
-      fileblock++;
+/* The inode number rides in fh, so reads skip the path lookup */
+int
+mount_open(const char *path, struct fuse_file_info *fi)
+{
+  UnixtoolImage *image = fuse_get_context()->private_data;
+  UnixtoolStat ust;
+
+  if (( fi->flags & O_ACCMODE ) != O_RDONLY)
+    {
+      return -EROFS;
     }
-  printf("Wrote %d of %d bytes\n", x, file_inode.size);
-  close(file_fd);
+
+  if (unixtool_stat(image, path, &ust) < 0)
+    {
+      return -errno;
+    }
+
+  fi->fh = ust.ino;
+  fi->keep_cache = 1;
   return 0;
 }
 
 int
-main(int argc, char *argv[])
+mount_read(const char *path, char *buf, size_t size, off_t offset,
+           struct fuse_file_info *fi)
 {
-  int rv = 0;
+  UnixtoolImage *image = fuse_get_context()->private_data;
+  ssize_t done = unixtool_pread(image, fi->fh, buf, size, offset);
+
+  (void)path;
+  return done < 0 ? -errno : (int)done;
+}
+
+int
+mount_statfs(const char *path, struct statvfs *sv)
+{
+  UnixtoolImage *image = fuse_get_context()->private_data;
+  SuperBlock *sb = image->superblock;
+  uint32_t isize = swap_hword(sb->isize);
+  uint32_t fsize = swap_word(sb->fsize);
+
+  (void)path;
+  memset(sv, 0, sizeof ( *sv ));
+  sv->f_bsize = 0x400;
+  sv->f_frsize = 0x400;
+  sv->f_blocks = fsize > isize ? fsize - isize : 0;
+  sv->f_bfree = swap_word(sb->tfree);
+  sv->f_bavail = sv->f_bfree;
+  sv->f_files = isize > 2 ? ( isize - 2 ) * 16 : 0;
+  sv->f_ffree = swap_hword(sb->tinode);
+  sv->f_favail = sv->f_ffree;
+  sv->f_flag = ST_RDONLY;
+  sv->f_namemax = 14;
+  return 0;
+}
+
+/* MOUNT THE IMAGE AT mountpoint UNTIL UNMOUNTED */
+/* Extra arguments go to FUSE (-f foreground, -s one thread, -d debug, -o) */
+int
+unix_mount(char *mountpoint, int argc, char *argv[])
+{
+  struct fuse_operations ops;
+  char **args = calloc(argc + 5, sizeof ( char * ));
+  int nargs = 0;
+  int rv;
+
+  if (args == NULL)
+    {
+      perror("unixtool: mount calloc()");
+      return -1;
+    }
+
+  memset(&ops, 0, sizeof ( ops ));
+  ops.init = mount_init;
+  ops.getattr = mount_getattr;
+  ops.readdir = mount_readdir;
+  ops.open = mount_open;
+  ops.read = mount_read;
+  ops.statfs = mount_statfs;
+
+  args[nargs++] = "unixtool";
+  args[nargs++] = mountpoint;
+  args[nargs++] = "-o";
+  args[nargs++] = "ro,subtype=unixtool";
+  while (argc-- > 0)
+    {
+      args[nargs++] = *argv++;
+    }
+
+  namei_quiet = 1;
+  rv = fuse_main(nargs, args, &ops, disk);
+  free(args);
+  return rv == 0 ? 0 : -1;
+}
+
+#else /* !defined(UNIXTOOL_FUSE) */
+
+int
+unix_mount(char *mountpoint, int argc, char *argv[])
+{
+  (void)mountpoint;
+  (void)argc;
+  (void)argv;
+  printf("unixtool: mount: not built with FUSE support (make FUSE=1)\n");
+  return -1;
+}
+
+#endif /* defined(UNIXTOOL_FUSE) */
 
+int
+main(int argc, char *argv[])
+{
   /* Sigh. */
   if (sizeof ( SuperBlock ) != 1024)
     {
@@ -728,19 +8678,68 @@ main(int argc, char *argv[])
       return -1;
     }
 
+  argc = parse_options(argc, argv);
+  stats_start = stats_clock();
+  decode_kernels_init();
   if (argc < 2 || strncmp(argv[1], "help", 4) == 0
       || strncmp(argv[1], "-?", 2) == 0)
     {
       /* Handle command-line options */
       printf("TI/LMI unixtool v0.0.1\n\n");
       printf(
-        "Usage: unixtool <command> <image file> [parameters]...\n\n");
+        "Usage: unixtool [options] <command> <image file> [parameters]...\n\n");
+      printf(" The image file may be gzip'ed if built with zlib (make ZLIB=1);\n"
+             " it is indexed on first use (<image file>.gzi), not unpacked.\n\n");
       printf(" Commands:\n\n");
       printf("   help       Prints this information\n\n");
       printf("   ls         Lists the given directory\n");
       printf("                Parameters: <directory>\n\n");
       printf("   read       Copy path from image file to destination\n");
       printf("                Parameters: <source path> <destination>\n\n");
+      printf("   cat        Writes a file (or a byte range of it) to stdout\n");
+      printf("                Parameters: <source path> [offset [length]]\n\n");
+      printf("   extract    Copy directory tree from image file to host\n");
+      printf("                Parameters: <source path> <destination directory>\n\n");
+      printf("   find       Lists paths under a directory, optionally filtered\n");
+      printf("                Parameters: <path> [-name <pattern>] [-type f|d|c|b|p]\n");
+      printf("                            [-size [+|-]<bytes>[k|M]]\n\n");
+      printf("   tar        Writes a ustar archive of a subtree to stdout\n");
+      printf("                Parameters: <path>\n\n");
+      printf("   batch      Run ls/read/extract lines from a manifest (or stdin)\n");
+      printf("                Parameters: [manifest file]\n\n");
+      printf("   index      Writes a metadata index (<image file>.idx) that later\n");
+      printf("              commands use instead of reading image metadata\n\n");
+      printf("   check      Checks the image for consistency: block ownership,\n");
+      printf("              link counts, the directory tree and the free list\n\n");
+      printf("   hash       Writes a SHA-256 manifest (digest, size, mtime, path)\n");
+      printf("              of the files under a path to stdout\n");
+      printf("                Parameters: <path>\n\n");
+      printf("   df         Reports space and inodes in use, from the superblock\n\n");
+      printf("   blockmap   Draws a free/used map from the free list and reports\n");
+      printf("              free space runs and extents per file\n");
+      printf("                Parameters: [blocks per map cell]\n\n");
+      printf("   scan       Lists the filesystems (bands) in a whole-disk dump,\n");
+      printf("              with the offsets and numbers --offset and --band take\n\n");
+      printf("   mount      Mounts the image read-only with FUSE (make FUSE=1)\n");
+      printf("                Parameters: <mount point> [FUSE options]\n\n");
+      printf(" Options:\n\n");
+      printf("   --band N   Use the Nth filesystem scan finds (from 0)\n");
+      printf("   --cache N  Cache N metadata blocks for unmapped images (default 4096)\n");
+      printf("   --direct   Write read/extract output with O_DIRECT\n");
+      printf("   --hash F   Write a SHA-256 manifest of the files read or extracted\n");
+      printf("                to F (\"-\" for stdout), hashing as they are copied\n");
+      printf("   --incremental  Leave files that extract finds already copied,\n");
+      printf("                with the same size, mtime and mode, as they are\n");
+      printf("   --index F  Use index file F instead of <image file>.idx\n");
+      printf("   --no-index Ignore any index file\n");
+      printf("   --offset N The filesystem starts N bytes into the image file\n");
+      printf("                (with --band: look for bands from there)\n");
+      printf("   --qd N     Keep N 1 MiB reads in flight when copying (default 4)\n");
+      printf("   -R         List subdirectories too (ls)\n");
+      printf("   --stats    Report I/O counters and phase times at exit\n");
+      printf("                (--stats=json for JSON, on stderr)\n");
+      printf("   -v         Trace path lookups (-vv: also block mapping)\n");
+      printf("   -j N       Use N threads (extract, check; default: one per CPU)\n\n");
       return 0;
     }
 
@@ -753,32 +8752,32 @@ main(int argc, char *argv[])
     }
 
   /* We have a disk filename, so open it. */
-  disk_fname = argv[2];
-  disk_fd = open(disk_fname, O_RDWR);
-  if (disk_fd < 0)
+  image_raw = strncmp(argv[1], "scan", 4) == 0;
+  if (image_open(argv[2]) == NULL)
     {
-      perror("unixtool: disk open()");
       return -1;
     }
 
-  /* Read in and check superblock */
-  rv = disk_block_read(1, superblock_buffer);
-  if (rv < 0)
+  if (verbose)
     {
-      return rv;
+      atexit(bcache_report);
     }
 
-  if (superblock->magic != 0x207E18FD)
+  if (stats_enabled)
     {
-      printf(
-        "unixtool: Bad superblock magic: Expected 0x207E18FD, got 0x%.8X\n",
-        superblock->magic);
-      return -1;
+      atexit(stats_report);
     }
 
+  stats_phase(PHASE_OPEN, stats_start);
+
   /* Select option (or bail) */
   if (argc >= 3)
     {
+      if (image_raw)
+        {
+          return unix_scan();
+        }
+
       if (strncmp(argv[1], "ls", 2) == 0)
         {
           if (argc < 4)
@@ -807,9 +8806,110 @@ main(int argc, char *argv[])
           return unix_read(argv[3], argv[4]);
         }
 
+      if (strncmp(argv[1], "cat", 3) == 0)
+        {
+          if (argc < 4)
+            {
+              printf("unixtool: cat: source path is required\n");
+              return -1;
+            }
+
+          return unix_cat(
+            argv[3],
+            argc >= 5 ? argv[4] : NULL,
+            argc >= 6 ? argv[5] : NULL);
+        }
+
+      if (strncmp(argv[1], "extract", 7) == 0)
+        {
+          if (argc < 4)
+            {
+              printf("unixtool: extract: source path is required\n");
+              return -1;
+            }
+
+          if (argc < 5)
+            {
+              printf("unixtool: extract: destination directory is required\n");
+              return -1;
+            }
+
+          return unix_extract(argv[3], argv[4]);
+        }
+
+      if (strncmp(argv[1], "find", 4) == 0)
+        {
+          if (argc < 4)
+            {
+              printf("unixtool: find: starting path is required\n");
+              return -1;
+            }
+
+          return unix_find(argv[3], argc - 4, argv + 4);
+        }
+
+      if (strncmp(argv[1], "tar", 3) == 0)
+        {
+          if (argc < 4)
+            {
+              printf("unixtool: tar: source path is required\n");
+              return -1;
+            }
+
+          return unix_tar(argv[3]);
+        }
+
+      if (strncmp(argv[1], "batch", 5) == 0)
+        {
+          return unix_batch(argc >= 4 ? argv[3] : NULL);
+        }
+
+      if (strncmp(argv[1], "index", 5) == 0)
+        {
+          return unix_index();
+        }
+
+      if (strncmp(argv[1], "check", 5) == 0)
+        {
+          return unix_check();
+        }
+
+      if (strncmp(argv[1], "hash", 4) == 0)
+        {
+          if (argc < 4)
+            {
+              printf("unixtool: hash: source path is required\n");
+              return -1;
+            }
+
+          return unix_hash(argv[3]);
+        }
+
+      if (strncmp(argv[1], "df", 2) == 0)
+        {
+          return unix_df();
+        }
+
+      if (strncmp(argv[1], "blockmap", 8) == 0)
+        {
+          return unix_blockmap(argc >= 4 ? argv[3] : NULL);
+        }
+
+      if (strncmp(argv[1], "mount", 5) == 0)
+        {
+          if (argc < 4)
+            {
+              printf("unixtool: mount: mount point is required\n");
+              return -1;
+            }
+
+          return unix_mount(argv[3], argc - 4, argv + 4);
+        }
+
       printf(
         "unixtool: Unknown parameters; See \"unixtool help\" for usage "
         "information.\n");
       return -1;
     }
 }
+#endif /* !defined(UNIXTOOL_LIBRARY) */
@@ -0,0 +1,88 @@
+/*
+ * TI/LMI SYSV disk tool - library interface
+ *
+ *  Copyright 2019
+ *  Daniel Seagraves <dseagrav@lunar-tokyo.net>
+ *
+ *  Copyright 2022
+ *  Modified for TI S1500 by Jeffrey H. Johnson <trnsz@pobox.com>
+ */
+
+/*
+ * Read-only access to band images from other programs (make lib, then
+ * link libunixtool.a or libunixtool.so).  Each handle is independent;
+ * any number may be open and any handle may be used from any thread.
+ * Calls on one handle are serialised except for the data copy in
+ * unixtool_pread(), so reads of one image from several threads overlap.
+ * Diagnostics are printed as the command line tool prints them; failing
+ * calls also set errno.
+ */
+
+#ifndef UNIXTOOL_H
+#define UNIXTOOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#if defined(__GNUC__)
+# define UNIXTOOL_API __attribute__ (( visibility("default") ))
+#else
+# define UNIXTOOL_API
+#endif
+
+/* Open band image (opaque) */
+typedef struct rImage UnixtoolImage;
+
+/* Inode attributes */
+typedef struct rUnixtoolStat
+{
+  uint32_t ino;    /* INODE NUMBER */
+  uint32_t mode;   /* HOST S_IFMT TYPE BITS | PERMISSIONS */
+  uint16_t nlink;  /* NUMBER OF LINKS TO HERE */
+  uint16_t uid;
+  uint16_t gid;
+  uint32_t size;   /* BYTES */
+  uint32_t rdev;   /* DEVICE NUMBER, FOR SPECIAL FILES */
+  int64_t atime;   /* LAST ACCESS TIMESTAMP */
+  int64_t mtime;   /* LAST MODIFICATION TIMESTAMP */
+  int64_t ctime;   /* CREATION TIMESTAMP */
+} UnixtoolStat;
+
+/* Directory entry */
+typedef struct rUnixtoolDirent
+{
+  uint32_t ino;   /* INODE NUMBER */
+  char name[15];  /* NAME, NUL-TERMINATED */
+} UnixtoolDirent;
+
+/* Open image; NULL on failure */
+UNIXTOOL_API UnixtoolImage *unixtool_open(const char *fname);
+
+/* Close image and free everything belonging to it */
+UNIXTOOL_API void unixtool_close(UnixtoolImage *image);
+
+/* Look up absolute path in image; 0, or -1 on failure */
+UNIXTOOL_API int unixtool_stat(UnixtoolImage *image, const char *path,
+                               UnixtoolStat *st);
+
+/* Attributes of inode ino; 0, or -1 on failure */
+UNIXTOOL_API int unixtool_fstat(UnixtoolImage *image, uint32_t ino,
+                                UnixtoolStat *st);
+
+/*
+ * Read directory at path, "." and ".." included.  *entries is set to a
+ * malloc()ed array for the caller to free().  Returns the number of
+ * entries, or -1 on failure.
+ */
+UNIXTOOL_API int unixtool_readdir(UnixtoolImage *image, const char *path,
+                                  UnixtoolDirent **entries);
+
+/*
+ * Read up to len bytes of inode ino from offset; holes read as zeros.
+ * Returns the number of bytes read (0 at or past the end), or -1.
+ */
+UNIXTOOL_API ssize_t unixtool_pread(UnixtoolImage *image, uint32_t ino,
+                                    void *buf, size_t len, uint64_t offset);
+
+#endif /* UNIXTOOL_H */